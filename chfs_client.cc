@@ -32,9 +32,18 @@ chfs_client::filename(inum inum)
     return ost.str();
 }
 
+#define EXT_RPC(xx) do { \
+    if ((xx) != extent_protocol::OK) { \
+        printf("EXT_RPC Error: %s:%d \n", __FILE__, __LINE__); \
+        r = IOERR; \
+        goto release; \
+    } \
+} while (0)
+
 bool
 chfs_client::isfile(inum inum)
 {
+    std::shared_lock<std::shared_mutex> lock(ilock(inum));
     extent_protocol::attr a;
 
     if (ec->getattr(inum, a) != extent_protocol::OK) {
@@ -52,36 +61,37 @@ chfs_client::isfile(inum inum)
 
 int
 chfs_client::symlink(inum parent, const char * name, inum & ino_out, const char * link) {
+    std::unique_lock<std::shared_mutex> lock(ilock(parent));
     int r = OK;
 
-    // step 01: check if the link file name has existed
-    bool found = false;
-    inum tmp;
-    lookup(parent, name, found, tmp);
-    if (found) return EXIST;
-
-    // step 02: create the link file
-    ec->create(extent_protocol::T_SYMLINK, ino_out);
-    ec->put(ino_out, std::string(link));
+    // step 01: create and link the file; fails if the name exists
+    extent_protocol::extentid_t ino;
+    r = ec->create_in_dir(parent, name, extent_protocol::T_SYMLINK, ino);
+    if (r != OK && r != EXIST) r = IOERR;
+    if (r != OK) return r;
+    ino_out = ino;
 
-    // step 03: add an entry to the parent directory
-    std::string buf;
-    ec->get(parent, buf);
-    buf.append(std::string(name) + ":" + filename(ino_out) + "/");
-    ec->put(parent, buf);
+    // step 02: fill in the link target
+    EXT_RPC(ec->put(ino_out, std::string(link)));
 
+release:
     return r;
 }
 
 int
 chfs_client::readlink(inum ino, std::string &data) {
-    ec->get(ino, data);  // get the content of link file
-    return OK;
+    std::shared_lock<std::shared_mutex> lock(ilock(ino));
+    int r = OK;
+    EXT_RPC(ec->get(ino, data));  // get the content of link file
+
+release:
+    return r;
 }
 
 bool
 chfs_client::isdir(inum inum)
 {
+    std::shared_lock<std::shared_mutex> lock(ilock(inum));
     extent_protocol::attr a;
     if (ec->getattr(inum, a) != extent_protocol::OK) return false;
     if (a.type == extent_protocol::T_DIR) return true;
@@ -91,6 +101,7 @@ chfs_client::isdir(inum inum)
 int
 chfs_client::getfile(inum inum, fileinfo &fin)
 {
+    std::shared_lock<std::shared_mutex> lock(ilock(inum));
     int r = OK;
 
     printf("getfile %016llx\n", inum);
@@ -113,6 +124,7 @@ release:
 int
 chfs_client::getdir(inum inum, dirinfo &din)
 {
+    std::shared_lock<std::shared_mutex> lock(ilock(inum));
     int r = OK;
 
     printf("getdir %016llx\n", inum);
@@ -130,39 +142,32 @@ release:
 }
 
 
-#define EXT_RPC(xx) do { \
-    if ((xx) != extent_protocol::OK) { \
-        printf("EXT_RPC Error: %s:%d \n", __FILE__, __LINE__); \
-        r = IOERR; \
-        goto release; \
-    } \
-} while (0)
-
 int
 chfs_client::setattr(inum ino, size_t size)
 {
+    std::unique_lock<std::shared_mutex> lock(ilock(ino));
+    int r = OK;
     std::string buf;
-    ec->get(ino, buf);
+    EXT_RPC(ec->get(ino, buf));
     buf.resize(size);
-    ec->put(ino, buf);
-    return OK;
+    EXT_RPC(ec->put(ino, buf));
+
+release:
+    return r;
 }
 
 int
 chfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
 {
+    std::unique_lock<std::shared_mutex> lock(ilock(parent));
     int r = OK;
 
-    bool found = false;  // check if the file has already existed
-    inum tmp;
-    lookup(parent, name, found, tmp);
-    if (found) return EXIST;
-
-    ec->create(extent_protocol::T_FILE, ino_out);  // allocate an inode for current file
-    std::string buf;
-    ec->get(parent, buf);
-    buf.append(std::string(name) + ":" + filename(ino_out) + "/");
-    ec->put(parent, buf);  // append the new entry to the parent folder
+    extent_protocol::extentid_t ino;
+    r = ec->create_in_dir(parent, name, extent_protocol::T_FILE, ino);
+    if (r == OK)
+        ino_out = ino;
+    else if (r != EXIST)
+        r = IOERR;
 
     return r;
 }
@@ -170,18 +175,15 @@ chfs_client::create(inum parent, const char *name, mode_t mode, inum &ino_out)
 int
 chfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
 {
+    std::unique_lock<std::shared_mutex> lock(ilock(parent));
     int r = OK;
 
-    inum tmp;
-    bool found = false;
-    lookup(parent, name, found, tmp);  // check if the directory name has existed
-    if (found) return EXIST;
-
-    ec->create(extent_protocol::T_DIR, ino_out);  // create an inode for the directory
-    std::string buf;
-    ec->get(parent, buf);  // get the original content of parent and add an entry
-    buf.append(std::string(name) + ":" + filename(ino_out) + "/");
-    ec->put(parent, buf);
+    extent_protocol::extentid_t ino;
+    r = ec->create_in_dir(parent, name, extent_protocol::T_DIR, ino);
+    if (r == OK)
+        ino_out = ino;
+    else if (r != EXIST)
+        r = IOERR;
 
     return r;
 }
@@ -195,74 +197,52 @@ chfs_client::mkdir(inum parent, const char *name, mode_t mode, inum &ino_out)
 int
 chfs_client::lookup(inum parent, const char *name, bool &found, inum &ino_out)
 {
+    std::shared_lock<std::shared_mutex> lock(ilock(parent));
     int r = OK;
-    std::list<dirent> file_list;
-    readdir(parent, file_list);  // find all of the files in the directory
-    if (file_list.empty()) {
-        found = false;
-        return r;
-    } else {
-        for (std::list<dirent>::iterator it = file_list.begin(); it != file_list.end(); it++) {
-            if (!it->name.compare(name)) {  // find the target file
-                found = true;
-                ino_out = it->inum;
-                return r;
-            }
-        }
-    }
-    found = false;  // there is no file with 'name' in the current directory
+    extent_protocol::extentid_t ino;
+    int ret = ec->dir_lookup(parent, name, ino);
+    found = (ret == extent_protocol::OK);
+    if (found)
+        ino_out = ino;
+    else if (ret != extent_protocol::NOENT)
+        r = IOERR;
 
     return r;
 }
 
 /*
- * parse the directory content and get the list of files in directory
- * format: "name:inum/"
+ * get the list of files in directory
  * dir: the inode number of the current directory
  * list: reference to the list of files in the directory
  */
 int
 chfs_client::readdir(inum dir, std::list<dirent> &list)
 {
+    std::shared_lock<std::shared_mutex> lock(ilock(dir));
     int r = OK;
-    std::string buf;
-    ec->get(dir, buf);  // get the content of the directory
-
-    int name_start = 0;
-    int name_end = buf.find(':');  // get the initial index of char
-    while (name_end != std::string::npos) {
-        std::string file_name = buf.substr(name_start, name_end - name_start);
-        int inum_start = name_end + 1;
-        int inum_end = buf.find('/', inum_start);
-        std::string inum_val = buf.substr(inum_start, inum_end - inum_start);
+    std::map<std::string, extent_protocol::extentid_t> ents;
+    EXT_RPC(ec->readdir(dir, ents));
+    for (std::map<std::string, extent_protocol::extentid_t>::iterator it = ents.begin();
+         it != ents.end(); ++it) {
         struct dirent entry;
-        entry.name = file_name;
-        entry.inum = n2i(inum_val);  // get the entry of one file in the directory
+        entry.name = it->first;
+        entry.inum = it->second;
         list.push_back(entry);
-        name_start = inum_end + 1;
-        name_end = buf.find(':', name_start);
     }
 
+release:
     return r;
 }
 
 int
 chfs_client::read(inum ino, size_t size, off_t off, std::string &data)
 {
+    std::shared_lock<std::shared_mutex> lock(ilock(ino));
     int r = OK;
 
-    std::string buf;
-    ec->get(ino, buf);  // read the whole file
-    if (off > buf.size()) {  // offset is greater than the file size
-        data = "";
-        return r;
-    } else if (off + size > buf.size()) {  // 'off + size' overflows
-        data = buf.substr(off);
-        return r;
-    } else {
-        data = buf.substr(off, size);
-    }
+    EXT_RPC(ec->read_range(ino, off, size, data));  // short read past EOF
 
+release:
     return r;
 }
 
@@ -270,36 +250,24 @@ int
 chfs_client::write(inum ino, size_t size, off_t off, const char *data,
         size_t &bytes_written)
 {
+    std::unique_lock<std::shared_mutex> lock(ilock(ino));
     int r = OK;
 
-    std::string buf;
-    ec->get(ino, buf);  // get the original content in the file
-    if (size + off > buf.size())
-        buf.resize(off + size);
-    for (int i=off; i<off+size; i++) {
-        buf[i] = data[i-off];
-    }
+    EXT_RPC(ec->write_range(ino, off, std::string(data, size)));
     bytes_written = size;
-    ec->put(ino, buf);
 
+release:
     return r;
 }
 
 int chfs_client::unlink(inum parent,const char *name)
 {
+    std::unique_lock<std::shared_mutex> lock(ilock(parent));
     int r = OK;
 
-    inum tmp;
-    bool found = false;
-    lookup(parent, name, found, tmp);
-    ec->remove(tmp);
-
-    std::string buf;
-    ec->get(parent, buf);  // remove the entry from the parent file
-    int start = buf.find(name);
-    int end = buf.find('/', start);
-    buf.erase(start, end - start + 1);
-    ec->put(parent, buf);
+    r = ec->unlink_from_dir(parent, name);
+    if (r != OK && r != NOENT)
+        r = IOERR;
 
     return r;
 }
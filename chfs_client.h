@@ -5,6 +5,9 @@
 //#include "chfs_protocol.h"
 #include "extent_client.h"
 #include <vector>
+#include <shared_mutex>
+
+#define NILOCK 1024
 
 
 class chfs_client {
@@ -39,6 +42,11 @@ class chfs_client {
   };
 
  private:
+  // Per-inode reader/writer locks, hashed by inum. An operation holds at
+  // most one of them, so there is no ordering to get wrong.
+  std::shared_mutex ilocks[NILOCK];
+  std::shared_mutex &ilock(inum ino) { return ilocks[ino % NILOCK]; }
+
   static std::string filename(inum);
   static inum n2i(std::string);
 
@@ -1,84 +1,200 @@
 #include "chfs_state_machine.h"
 
-chfs_command_raft::chfs_command_raft() {
+chfs_command_raft::chfs_command_raft() : off(0), len(0), ino(0), client_id(0), seq(0), acked(0) {
     res = std::make_shared<result>();
 }
 
 chfs_command_raft::chfs_command_raft(const chfs_command_raft &cmd) :
-    cmd_tp(cmd.cmd_tp), type(cmd.type),  id(cmd.id), buf(cmd.buf), res(cmd.res) { }
+    cmd_tp(cmd.cmd_tp), type(cmd.type),  id(cmd.id), off(cmd.off), len(cmd.len), ino(cmd.ino), buf(cmd.buf), res(cmd.res),
+    client_id(cmd.client_id), seq(cmd.seq), acked(cmd.acked) { }
+chfs_command_raft::chfs_command_raft(chfs_command_raft &&cmd) :
+    cmd_tp(cmd.cmd_tp), type(cmd.type),  id(cmd.id), off(cmd.off), len(cmd.len), ino(cmd.ino), buf(std::move(cmd.buf)), res(cmd.res),
+    client_id(cmd.client_id), seq(cmd.seq), acked(cmd.acked) { }
 chfs_command_raft::~chfs_command_raft() { }
 
 int chfs_command_raft::size() const {
-    return sizeof(chfs_command_raft::command_type) + sizeof(uint32_t) + sizeof(extent_protocol::extentid_t)
-         + sizeof(int) + buf.size() + 1;
+    return header_size + buf.size();
+}
+
+bool chfs_command_raft::read_only() const {
+    switch (cmd_tp) {
+        case CMD_NONE: case CMD_GET: case CMD_GETA: case CMD_READ:
+        case CMD_DLOOKUP: case CMD_READDIR:
+            return true;
+        default:
+            return false;
+    }
+}
+
+template <typename T>
+static char *encode(char *out, T v) {
+    memcpy(out, &v, sizeof(T));
+    return out + sizeof(T);
+}
+
+template <typename T>
+static const char *decode(const char *in, T &v) {
+    memcpy(&v, in, sizeof(T));
+    return in + sizeof(T);
+}
+
+void chfs_command_raft::serialize_header(char *out) const {
+    out = encode(out, encoding_version);
+    out = encode(out, (uint8_t) cmd_tp);
+    out = encode(out, type);
+    out = encode(out, id);
+    out = encode(out, off);
+    out = encode(out, len);
+    out = encode(out, ino);
+    out = encode(out, client_id);
+    out = encode(out, seq);
+    out = encode(out, acked);
+    encode(out, (uint32_t) buf.size());
 }
 
 void chfs_command_raft::serialize(char *buf_out, int size) const {
-    * ((command_type *) buf_out) = cmd_tp;
-    * ((uint32_t *)(buf_out + sizeof(command_type))) = type;
-    * ((extent_protocol::extentid_t *)(buf_out + sizeof(command_type) + sizeof(uint32_t))) = id;
-    * ((int *)(buf_out + sizeof(command_type) + sizeof(uint32_t) + sizeof(extent_protocol::extentid_t))) = buf.size();
-    strcpy(buf_out + sizeof(command_type) + sizeof(uint32_t) + sizeof(extent_protocol::extentid_t) + sizeof(int), buf.data());
-    // buf_out[this->size()] = '\0';
-    // memcpy(buf_out + sizeof(command_type) + sizeof(uint32_t) + sizeof(extent_protocol::extentid_t) + sizeof(int), buf.data(), buf.size());
-    return;
+    if (size != this->size()) {
+        return;
+    }
+    serialize_header(buf_out);
+    memcpy(buf_out + header_size, buf.data(), buf.size());
 }
 
 void chfs_command_raft::deserialize(const char *buf_in, int size) {
-    cmd_tp = *((command_type *) buf_in);
-    type = *((uint32_t *) (buf_in + sizeof(command_type)));
-    id = *((extent_protocol::extentid_t *) (buf_in + sizeof(command_type) + sizeof(uint32_t)));
-    int buf_size = *((int *) (buf_in + sizeof(command_type) + sizeof(uint32_t) + sizeof(extent_protocol::extentid_t)));
-    // buf = std::string(buf_in + sizeof(command_type) + sizeof(uint32_t) + sizeof(extent_protocol::extentid_t) + sizeof(int), buf_size);
-    buf.assign(buf_in + sizeof(command_type) + sizeof(uint32_t) + sizeof(extent_protocol::extentid_t) + sizeof(int));
-    return;
+    uint8_t version = 0, tp = CMD_NONE;
+    uint32_t buf_size = 0;
+    const char *in = buf_in;
+    if (size >= header_size) {
+        in = decode(in, version);
+        in = decode(in, tp);
+        in = decode(in, type);
+        in = decode(in, id);
+        in = decode(in, off);
+        in = decode(in, len);
+        in = decode(in, ino);
+        in = decode(in, client_id);
+        in = decode(in, seq);
+        in = decode(in, acked);
+        in = decode(in, buf_size);
+    }
+    if (size < header_size || version != encoding_version || (size_t) size - header_size != buf_size) {
+        printf("chfs_command_raft: bad encoding (%d bytes, version %u)\n", size, version);
+        cmd_tp = CMD_NONE;
+        client_id = 0;
+        buf.clear();
+        return;
+    }
+    cmd_tp = (command_type) tp;
+    buf.assign(in, buf_size);
 }
 
+// On the wire a command is its encoding, length-prefixed like a string;
+// the payload goes straight from buf into the message.
 marshall &operator<<(marshall &m, const chfs_command_raft &cmd) {
-    m << (int) cmd.cmd_tp << cmd.type << cmd.id << cmd.buf;
+    char header[chfs_command_raft::header_size];
+    cmd.serialize_header(header);
+    m << (unsigned int) cmd.size();
+    m.rawbytes(header, sizeof(header));
+    m.rawbytes(cmd.buf.data(), cmd.buf.size());
     return m;
 }
 
+// Decoded straight out of the message, so the payload is copied once,
+// into cmd.buf.
 unmarshall &operator>>(unmarshall &u, chfs_command_raft &cmd) {
-    int type;
-    u >> type >> cmd.type >> cmd.id >> cmd.buf;
-    cmd.cmd_tp = (chfs_command_raft::command_type) type;
+    unsigned int size = 0;
+    const char *data = NULL;
+    u >> size;
+    if (u.ok()) {
+        data = u.rawptr(size);
+    }
+    cmd.deserialize(data, data ? size : 0);
     return u;
 }
 
-void chfs_state_machine::apply_log(raft_command &cmd) {
-    chfs_command_raft &chfs_cmd = dynamic_cast<chfs_command_raft &>(cmd);
+// Runs the command and fills in its result, without waking the caller.
+void chfs_state_machine::execute(chfs_command_raft &chfs_cmd) {
     std::unique_lock<std::mutex> lock(chfs_cmd.res->mtx);
     chfs_cmd.res->start = std::chrono::system_clock::now();
     switch (chfs_cmd.cmd_tp) {
         case chfs_command_raft::CMD_NONE: break;
         case chfs_command_raft::CMD_CRT: {
+            // cmd.id names the shard to number the new inode in
             extent_protocol::extentid_t id;
             es.create(chfs_cmd.type, id);
-            mtx.lock();
-            chfs_cmd.res->id = id;
-            mtx.unlock();
+            chfs_cmd.res->id = inum_make(inum_shard(chfs_cmd.id), id);
             break;
         }
         case chfs_command_raft::CMD_PUT: {
             int tmp = 0;
             es.put(chfs_cmd.id, chfs_cmd.buf, tmp);
+            chfs_cmd.res->version = tmp;
             break;
         }
         case chfs_command_raft::CMD_GET: {
             std::string buf = "";
             es.get(chfs_cmd.id, buf);
-            mtx.lock();
             chfs_cmd.res->buf = buf;
-            mtx.unlock();
+            break;
+        }
+        case chfs_command_raft::CMD_READ: {
+            std::string buf = "";
+            es.read_range(chfs_cmd.id, chfs_cmd.off, chfs_cmd.len, buf);
+            chfs_cmd.res->buf = buf;
+            break;
+        }
+        case chfs_command_raft::CMD_WRITE: {
+            int tmp = 0;
+            es.write_range(chfs_cmd.id, chfs_cmd.off, chfs_cmd.buf, tmp);
+            chfs_cmd.res->version = tmp;
+            break;
+        }
+        case chfs_command_raft::CMD_DLOOKUP: {
+            extent_protocol::extentid_t ino = 0;
+            int r = es.dir_lookup(chfs_cmd.id, chfs_cmd.buf, ino);
+            chfs_cmd.res->status = r;
+            chfs_cmd.res->id = ino;
+            break;
+        }
+        case chfs_command_raft::CMD_DINSERT: {
+            int tmp = 0;
+            int r = es.dir_insert(chfs_cmd.id, chfs_cmd.buf, chfs_cmd.ino, tmp);
+            chfs_cmd.res->status = r;
+            chfs_cmd.res->version = tmp;
+            break;
+        }
+        case chfs_command_raft::CMD_DREMOVE: {
+            extent_protocol::extentid_t ino = 0;
+            int r = es.dir_remove(chfs_cmd.id, chfs_cmd.buf, ino);
+            chfs_cmd.res->status = r;
+            chfs_cmd.res->id = ino;
+            break;
+        }
+        case chfs_command_raft::CMD_READDIR: {
+            std::map<std::string, extent_protocol::extentid_t> ents;
+            int r = es.readdir(chfs_cmd.id, ents);
+            chfs_cmd.res->status = r;
+            chfs_cmd.res->entries = ents;
+            break;
+        }
+        case chfs_command_raft::CMD_CRTDIR: {
+            extent_protocol::extentid_t ino = 0;
+            int r = es.create_in_dir(chfs_cmd.id, chfs_cmd.buf, chfs_cmd.type, ino);
+            chfs_cmd.res->status = r;
+            chfs_cmd.res->id = ino;
+            break;
+        }
+        case chfs_command_raft::CMD_UNLINK: {
+            extent_protocol::extentid_t ino = 0;
+            int r = es.unlink_entry(chfs_cmd.id, chfs_cmd.buf, ino);
+            chfs_cmd.res->status = r;
+            chfs_cmd.res->id = ino;
             break;
         }
         case chfs_command_raft::CMD_GETA: {
             extent_protocol::attr attr;
             es.getattr(chfs_cmd.id, attr);
-            mtx.lock();
             chfs_cmd.res->attr = attr;
-            mtx.unlock();
             break;
         }
         case chfs_command_raft::CMD_RMV: {
@@ -89,6 +205,136 @@ void chfs_state_machine::apply_log(raft_command &cmd) {
         default: break;
     }
     chfs_cmd.res->done = true;
+}
+
+// Runs the command unless it is a copy of one already applied; a copy
+// gets the first one's result, or none if its client has moved on.
+void chfs_state_machine::apply(chfs_command_raft &cmd) {
+    if (cmd.client_id == 0) {
+        execute(cmd);
+        return;
+    }
+    session &s = sessions[cmd.client_id];
+    if (cmd.acked > s.acked) {
+        s.acked = cmd.acked;
+        s.done.erase(s.done.begin(), s.done.lower_bound(s.acked));
+    }
+    auto it = s.done.find(cmd.seq);
+    if (cmd.seq < s.acked || it != s.done.end()) {
+        std::lock_guard<std::mutex> lock(cmd.res->mtx);
+        if (it != s.done.end()) {
+            cmd.res->status = it->second.status;
+            cmd.res->id = it->second.id;
+            cmd.res->version = it->second.version;
+        }
+        cmd.res->done = true;
+        return;
+    }
+
+    execute(cmd);
+    saved_result &r = s.done[cmd.seq];
+    r.status = cmd.res->status;
+    r.id = cmd.res->id;
+    r.version = cmd.res->version;
+}
+
+void chfs_state_machine::apply_log(raft_command &cmd) {
+    chfs_command_raft &chfs_cmd = dynamic_cast<chfs_command_raft &>(cmd);
+    apply(chfs_cmd);
     chfs_cmd.res->cv.notify_all();
-    return;
+}
+
+void chfs_state_machine::apply_logs(raft_command *const *begin, raft_command *const *end) {
+    {
+        extent_server::batch hold(es);
+        for (raft_command *const *it = begin; it != end; ++it) {
+            apply(dynamic_cast<chfs_command_raft &>(**it));
+        }
+    }
+    // Wake the callers only once the batch is in, so they don't compete
+    // with the rest of it for the CPU and the extent server's lock.
+    for (raft_command *const *it = begin; it != end; ++it) {
+        static_cast<chfs_command_raft *>(*it)->res->cv.notify_all();
+    }
+}
+
+// Sessions are stored as
+//
+//     [u32 count] { [u64 client_id][u64 acked][u32 count]
+//                   { [u64 seq][i32 status][u64 id][i32 version] } }
+void chfs_state_machine::save_sessions(std::vector<char> &out) const {
+    char buf[3 * sizeof(uint64_t) + 2 * sizeof(int32_t)];
+    char *p = encode(buf, (uint32_t) sessions.size());
+    out.insert(out.end(), buf, p);
+    for (auto &s : sessions) {
+        p = encode(buf, s.first);
+        p = encode(p, s.second.acked);
+        p = encode(p, (uint32_t) s.second.done.size());
+        out.insert(out.end(), buf, p);
+        for (auto &d : s.second.done) {
+            p = encode(buf, d.first);
+            p = encode(p, (int32_t) d.second.status);
+            p = encode(p, d.second.id);
+            p = encode(p, (int32_t) d.second.version);
+            out.insert(out.end(), buf, p);
+        }
+    }
+}
+
+// Returns where the disk starts, or 0 if the sessions are cut short.
+size_t chfs_state_machine::load_sessions(const std::vector<char> &in) {
+    const char *p = in.data(), *end = in.data() + in.size();
+    uint32_t n = 0;
+    sessions.clear();
+    if (end - p < (long) sizeof(n)) {
+        return 0;
+    }
+    p = decode(p, n);
+    for (uint32_t i = 0; i < n; i++) {
+        uint64_t client_id;
+        uint32_t m;
+        if (end - p < (long) (2 * sizeof(uint64_t) + sizeof(m))) {
+            return 0;
+        }
+        p = decode(p, client_id);
+        session &s = sessions[client_id];
+        p = decode(p, s.acked);
+        p = decode(p, m);
+        for (uint32_t j = 0; j < m; j++) {
+            uint64_t seq;
+            int32_t status, version;
+            saved_result r;
+            if (end - p < (long) (2 * sizeof(uint64_t) + 2 * sizeof(int32_t))) {
+                return 0;
+            }
+            p = decode(p, seq);
+            p = decode(p, status);
+            p = decode(p, r.id);
+            p = decode(p, version);
+            r.status = status;
+            r.version = version;
+            s.done[seq] = r;
+        }
+    }
+    return p - in.data();
+}
+
+std::vector<char> chfs_state_machine::snapshot() {
+    std::vector<char> data;
+    save_sessions(data);
+    es.snapshot(data);
+    return data;
+}
+
+void chfs_state_machine::apply_snapshot(const std::vector<char> &data) {
+    size_t off = load_sessions(data);
+    if (off == 0 || !es.restore(data.data() + off, data.size() - off)) {
+        printf("chfs_state_machine: cannot restore a %lu-byte snapshot\n", (unsigned long) data.size());
+    }
+}
+
+std::unique_ptr<raft_snapshot_view> chfs_state_machine::snapshot_view() {
+    std::vector<char> data;
+    save_sessions(data);
+    return std::unique_ptr<raft_snapshot_view>(new frozen_view(es, std::move(data)));
 }
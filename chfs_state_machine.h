@@ -11,6 +11,14 @@ public:
         CMD_GET,  // Get a file
         CMD_GETA, // Get a file's attributes
         CMD_RMV,  // Remove a file   
+        CMD_READ, // Read a byte range
+        CMD_WRITE,// Write a byte range
+        CMD_DLOOKUP, // Look up a name in a directory
+        CMD_DINSERT, // Add a directory entry
+        CMD_DREMOVE, // Remove a directory entry
+        CMD_READDIR, // List a directory
+        CMD_CRTDIR,  // Create a file and link it into a directory
+        CMD_UNLINK,  // Unlink a name and remove its file
     };
 
     struct result {
@@ -18,6 +26,9 @@ public:
         extent_protocol::extentid_t id;
         std::string buf;
         extent_protocol::attr attr;
+        int version;                // inode version after a write
+        extent_protocol::status status;
+        std::map<std::string, extent_protocol::extentid_t> entries;
         command_type tp;
 
         bool done;
@@ -28,23 +39,54 @@ public:
     command_type cmd_tp;
     uint32_t type;
     extent_protocol::extentid_t id;
+    uint32_t off, len;  // byte range for CMD_READ / CMD_WRITE
+    extent_protocol::extentid_t ino;  // entry inum for CMD_DINSERT
     std::string buf;
     std::shared_ptr<result> res;
 
+    // A command that changes the filesystem carries its client's id and a
+    // sequence number, so a copy proposed again after the first seemed
+    // lost is applied only once. Every seq below acked has been answered.
+    // A client_id of 0 marks an untagged command.
+    uint64_t client_id, seq, acked;
+
     chfs_command_raft();
 
     chfs_command_raft(const chfs_command_raft &cmd);
 
+    // Takes over cmd's buffer but shares its result, so the caller can
+    // hand a command to raft and still wait on it.
+    chfs_command_raft(chfs_command_raft &&cmd);
+
     virtual ~chfs_command_raft();
 
+    // The encoding, shared by the WAL and the wire (host byte order):
+    //
+    //     [u8 version][u8 cmd_tp][u32 type][u64 id][u32 off][u32 len]
+    //     [u64 ino][u64 client_id][u64 seq][u64 acked][u32 buf size][buf]
+    //
+    // buf may hold any bytes, NULs included.
+    static const uint8_t encoding_version = 2;
+    static const int header_size = 2 * sizeof(uint8_t) + 4 * sizeof(uint32_t)
+                                 + 2 * sizeof(extent_protocol::extentid_t)
+                                 + 3 * sizeof(uint64_t);
+
+    // Whether the command leaves the filesystem as it is.
+    bool read_only() const;
+
     virtual int size() const override;
 
     virtual void serialize(char *buf, int size) const override;
 
+    // A malformed encoding decodes to CMD_NONE.
     virtual void deserialize(const char *buf, int size);
 
-    chfs_command_raft(command_type cmd_tp, uint32_t type, extent_protocol::extentid_t id, std::string buf)
-    : cmd_tp(cmd_tp), type(type), id(id), buf(buf) {
+    void serialize_header(char *out) const;
+
+    chfs_command_raft(command_type cmd_tp, uint32_t type, extent_protocol::extentid_t id, std::string buf,
+                      uint32_t off = 0, uint32_t len = 0, extent_protocol::extentid_t ino = 0)
+    : cmd_tp(cmd_tp), type(type), id(id), off(off), len(len), ino(ino), buf(std::move(buf)),
+      client_id(0), seq(0), acked(0) {
         res = std::make_shared<result>();
     }
 };
@@ -61,17 +103,64 @@ public:
     // Apply a log to the state machine.
     virtual void apply_log(raft_command &cmd) override;
 
-    // You don't need to implement this function.
-    virtual std::vector<char> snapshot() {
-        return std::vector<char>();
-    }
+    // Applies the batch, then wakes every command's caller.
+    virtual void apply_logs(raft_command *const *begin, raft_command *const *end) override;
 
-    // You don't need to implement this function.
-    virtual void apply_snapshot(const std::vector<char> &) {
+    // Run a read-only command directly, without a log entry. Only safe
+    // once raft::read_index has vouched that this replica is current.
+    void read(chfs_command_raft &cmd) {
+        apply_log(cmd);
     }
 
+    // The whole filesystem: the client sessions, then every live block of
+    // the extent server's disk.
+    virtual std::vector<char> snapshot() override;
+
+    virtual void apply_snapshot(const std::vector<char> &) override;
+
+    // Freezes the disk copy-on-write, so the blocks are serialized while
+    // commands keep applying.
+    virtual std::unique_ptr<raft_snapshot_view> snapshot_view() override;
+
 private:
+    class frozen_view : public raft_snapshot_view {
+    public:
+        frozen_view(extent_server &_es, std::vector<char> &&_sessions): es(_es), sessions(std::move(_sessions)) {
+            es.freeze();
+        }
+        virtual ~frozen_view() {
+            es.thaw();
+        }
+        virtual std::vector<char> serialize() override {
+            std::vector<char> data(std::move(sessions));
+            es.snapshot_frozen(data);
+            return data;
+        }
+    private:
+        extent_server &es;
+        std::vector<char> sessions;
+    };
+
+    // What a client is told about a command, kept to answer a copy of it.
+    struct saved_result {
+        extent_protocol::status status;
+        extent_protocol::extentid_t id;
+        int version;
+    };
+    // Per client, the results of the commands not yet acked. Only the
+    // apply path and snapshots touch these, and raft never runs the two
+    // together.
+    struct session {
+        uint64_t acked;
+        std::map<uint64_t, saved_result> done;
+    };
+    std::map<uint64_t, session> sessions;
+
+    void apply(chfs_command_raft &cmd);
+    void execute(chfs_command_raft &cmd);
+    void save_sessions(std::vector<char> &out) const;
+    size_t load_sessions(const std::vector<char> &in);
+
     extent_server es;
-    std::mutex mtx;
     // You can add your own variables and functions here if you want.
 };
@@ -6,8 +6,9 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <time.h>
+#include <algorithm>
 
-extent_client::extent_client(std::string dst) {
+extent_client::extent_client(std::string dst) : cache_bytes(0) {
     sockaddr_in dstsock;
     make_sockaddr(dst.c_str(), &dstsock);
     cl = new rpcc(dstsock);
@@ -20,24 +21,183 @@ extent_protocol::status
 extent_client::create(uint32_t type,  extent_protocol::extentid_t &id) {
     extent_protocol::status ret = extent_protocol::OK;
     ret = cl->call(extent_protocol::create, type,  id);
-    VERIFY(ret == extent_protocol::OK);
     return ret;
 }
 
+// The cache helpers expect cache_mtx to be held.
+
+extent_client::cache_entry *
+extent_client::lookup_cache(extent_protocol::extentid_t eid) {
+    auto it = cache.find(eid);
+    if (it == cache.end())
+        return NULL;
+    lru.splice(lru.begin(), lru, it->second.lru_pos);
+    return &it->second;
+}
+
+// A new entry for eid, with neither attrs nor data.
+extent_client::cache_entry *
+extent_client::insert_cache(extent_protocol::extentid_t eid) {
+    erase_cache(eid);
+    cache_entry *e = &cache[eid];
+    e->has_data = false;
+    e->lru_pos = lru.insert(lru.begin(), eid);
+    e->bytes = 0;
+    charge(*e);
+    return e;
+}
+
+void
+extent_client::erase_cache(extent_protocol::extentid_t eid) {
+    auto it = cache.find(eid);
+    if (it == cache.end())
+        return;
+    cache_bytes -= it->second.bytes;
+    lru.erase(it->second.lru_pos);
+    cache.erase(it);
+}
+
+// Recount e after it changed and evict the least recently used entries
+// until the cache fits again. If e alone does not fit it keeps no data.
+void
+extent_client::charge(cache_entry &e) {
+    for (;;) {
+        size_t bytes = sizeof(cache_entry) + e.data.size();
+        cache_bytes = cache_bytes - e.bytes + bytes;
+        e.bytes = bytes;
+
+        extent_protocol::extentid_t eid = *e.lru_pos;
+        while (cache_bytes > cache_max_bytes && lru.back() != eid)
+            erase_cache(lru.back());
+        if (cache_bytes <= cache_max_bytes || !e.has_data)
+            return;
+        e.has_data = false;
+        std::string().swap(e.data);
+    }
+}
+
+// Install freshly fetched attributes, dropping the cached data if the
+// version moved.
+extent_client::cache_entry *
+extent_client::refresh(extent_protocol::extentid_t eid,
+                       const extent_protocol::attr &attr) {
+    cache_entry *e = lookup_cache(eid);
+    if (e == NULL) {
+        e = insert_cache(eid);
+    } else if (e->attr.version != attr.version) {
+        e->has_data = false;
+        e->data.clear();
+        charge(*e);
+    }
+    e->attr = attr;
+    return e;
+}
+
+// Return the entry for eid with the server's current attrs, or NULL with
+// the getattr's error in ret. cache_mtx is dropped around the RPC.
+extent_client::cache_entry *
+extent_client::revalidate(extent_protocol::extentid_t eid,
+                          std::unique_lock<std::mutex> &lock,
+                          extent_protocol::status &ret) {
+    extent_protocol::attr attr;
+    lock.unlock();
+    ret = cl->call(extent_protocol::getattr, eid, attr);
+    lock.lock();
+    if (ret != extent_protocol::OK) {
+        erase_cache(eid);
+        return NULL;
+    }
+    return refresh(eid, attr);
+}
+
 extent_protocol::status
 extent_client::get(extent_protocol::extentid_t eid, std::string &buf) {
     extent_protocol::status ret = extent_protocol::OK;
+    std::unique_lock<std::mutex> lock(cache_mtx);
+    cache_entry *e = revalidate(eid, lock, ret);
+    if (e == NULL)
+        return ret;
+    if (e->has_data) {
+        buf = e->data;
+        return ret;
+    }
+
+    // attrs were read first, so the data is at least as new as version;
+    // if it is newer the next revalidation drops it
+    unsigned int version = e->attr.version;
+    lock.unlock();
     ret = cl->call(extent_protocol::get, eid, buf);
-    VERIFY(ret == extent_protocol::OK);
+    if (ret != extent_protocol::OK)
+        return ret;
+    lock.lock();
+
+    e = lookup_cache(eid);
+    if (e != NULL && e->attr.version == version) {
+        e->has_data = true;
+        e->data = buf;
+        e->attr.size = buf.size();
+        charge(*e);
+    }
+    return ret;
+}
+
+extent_protocol::status
+extent_client::read_range(extent_protocol::extentid_t eid, unsigned int off,
+                          unsigned int len, std::string &buf) {
+    extent_protocol::status ret = extent_protocol::OK;
+    {
+        std::unique_lock<std::mutex> lock(cache_mtx);
+        cache_entry *e = lookup_cache(eid);
+        if (e != NULL && e->has_data) {
+            e = revalidate(eid, lock, ret);
+            if (e == NULL)
+                return ret;
+            if (e->has_data) {
+                buf = off < e->data.size() ? e->data.substr(off, len) : "";
+                return ret;
+            }
+        }
+    }
+    ret = cl->call(extent_protocol::read_range, eid, off, len, buf);
+    return ret;
+}
+
+extent_protocol::status
+extent_client::write_range(extent_protocol::extentid_t eid, unsigned int off,
+                           std::string buf) {
+    int r;
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = cl->call(extent_protocol::write_range, eid, off, buf, r);
+
+    std::lock_guard<std::mutex> lock(cache_mtx);
+    cache_entry *e = lookup_cache(eid);
+    if (e == NULL)
+        return ret;
+    if (ret != extent_protocol::OK || e->attr.version + 1 != (unsigned int) r) {
+        // the write may not have happened, or someone else wrote in
+        // between; either way our copy can't be patched
+        erase_cache(eid);
+        return ret;
+    }
+    if (e->has_data) {
+        if (e->data.size() < off + buf.size())
+            e->data.resize(off + buf.size(), '\0');
+        e->data.replace(off, buf.size(), buf);
+    }
+    e->attr.version = r;
+    e->attr.size = std::max(e->attr.size, off + (unsigned int) buf.size());
+    charge(*e);
     return ret;
 }
 
 extent_protocol::status
 extent_client::getattr(extent_protocol::extentid_t eid,
                        extent_protocol::attr &attr) {
-    extent_protocol::status ret = extent_protocol::OK;
-    ret = cl->call(extent_protocol::getattr, eid, attr);
-    VERIFY(ret == extent_protocol::OK);
+    extent_protocol::status ret;
+    std::unique_lock<std::mutex> lock(cache_mtx);
+    cache_entry *e = revalidate(eid, lock, ret);
+    if (e != NULL)
+        attr = e->attr;
     return ret;
 }
 
@@ -46,7 +206,21 @@ extent_client::put(extent_protocol::extentid_t eid, std::string buf) {
     int r;
     extent_protocol::status ret = extent_protocol::OK;
     ret = cl->call(extent_protocol::put, eid, buf,  r);
-    VERIFY(ret == extent_protocol::OK);
+
+    // the contents are known exactly, as of version r
+    std::lock_guard<std::mutex> lock(cache_mtx);
+    if (ret != extent_protocol::OK) {
+        erase_cache(eid);
+        return ret;
+    }
+    cache_entry *e = lookup_cache(eid);
+    if (e == NULL)
+        e = insert_cache(eid);
+    e->attr.version = r;
+    e->attr.size = buf.size();
+    e->has_data = true;
+    e->data = buf;
+    charge(*e);
     return ret;
 }
 
@@ -55,6 +229,77 @@ extent_client::remove(extent_protocol::extentid_t eid) {
     int r = 0;
     extent_protocol::status ret = extent_protocol::OK;
     ret = cl->call(extent_protocol::remove, eid, r);
-    VERIFY(ret == extent_protocol::OK);
+    std::lock_guard<std::mutex> lock(cache_mtx);
+    erase_cache(eid);
+    return ret;
+}
+
+extent_protocol::status
+extent_client::dir_lookup(extent_protocol::extentid_t dir, std::string name,
+                          extent_protocol::extentid_t &ino) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = cl->call(extent_protocol::dir_lookup, dir, name, ino);
+    return ret;
+}
+
+extent_protocol::status
+extent_client::dir_insert(extent_protocol::extentid_t dir, std::string name,
+                          extent_protocol::extentid_t ino) {
+    int r;
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = cl->call(extent_protocol::dir_insert, dir, name, ino, r);
+    if (ret == extent_protocol::EXIST)
+        return ret;
+
+    std::lock_guard<std::mutex> lock(cache_mtx);
+    cache_entry *e = lookup_cache(dir);
+    if (e == NULL)
+        return ret;
+    if (ret != extent_protocol::OK || e->attr.version + 1 != (unsigned int) r) {
+        erase_cache(dir);
+        return ret;
+    }
+    e->attr.version = r;
+    e->has_data = false;
+    e->data.clear();
+    charge(*e);
+    return ret;
+}
+
+extent_protocol::status
+extent_client::dir_remove(extent_protocol::extentid_t dir, std::string name,
+                          extent_protocol::extentid_t &ino) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = cl->call(extent_protocol::dir_remove, dir, name, ino);
+    std::lock_guard<std::mutex> lock(cache_mtx);
+    erase_cache(dir);
+    return ret;
+}
+
+extent_protocol::status
+extent_client::readdir(extent_protocol::extentid_t dir,
+                       std::map<std::string, extent_protocol::extentid_t> &ents) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = cl->call(extent_protocol::readdir, dir, ents);
+    return ret;
+}
+
+extent_protocol::status
+extent_client::create_in_dir(extent_protocol::extentid_t dir, std::string name,
+                             uint32_t type, extent_protocol::extentid_t &ino) {
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = cl->call(extent_protocol::create_in_dir, dir, name, type, ino);
+    std::lock_guard<std::mutex> lock(cache_mtx);
+    erase_cache(dir);
+    return ret;
+}
+
+extent_protocol::status
+extent_client::unlink_from_dir(extent_protocol::extentid_t dir, std::string name) {
+    int r = 0;
+    extent_protocol::status ret = extent_protocol::OK;
+    ret = cl->call(extent_protocol::unlink_from_dir, dir, name, r);
+    std::lock_guard<std::mutex> lock(cache_mtx);
+    erase_cache(dir);
     return ret;
 }
@@ -4,6 +4,9 @@
 #define extent_client_h
 
 #include <cstdint>
+#include <list>
+#include <map>
+#include <mutex>
 #include <string>
 #include "extent_protocol.h"
 #include "extent_server.h"
@@ -12,16 +15,68 @@ class extent_client {
 private:
     rpcc *cl;
 
+    // Cached attributes and, once fetched, the whole contents of an
+    // extent. Every use asks the server for the attributes again, and the
+    // contents are kept only while the inode version they were read at is
+    // still current, so another client's write is seen at once. Writes go
+    // straight to the server and patch the entry from the version it
+    // returns. Entries are charged their size and the least recently used
+    // are evicted to keep the cache under cache_max_bytes.
+    struct cache_entry {
+        extent_protocol::attr attr;
+        bool has_data;
+        std::string data;
+        std::list<extent_protocol::extentid_t>::iterator lru_pos;
+        size_t bytes;       // what the entry is charged
+    };
+    std::map<extent_protocol::extentid_t, cache_entry> cache;
+    std::list<extent_protocol::extentid_t> lru;  // most recently used first
+    size_t cache_bytes;
+    std::mutex cache_mtx;   // protects the above; never held across an RPC
+
+    static constexpr size_t cache_max_bytes = 32 << 20;
+
+    cache_entry *lookup_cache(extent_protocol::extentid_t eid);
+    cache_entry *insert_cache(extent_protocol::extentid_t eid);
+    void erase_cache(extent_protocol::extentid_t eid);
+    void charge(cache_entry &e);
+    cache_entry *refresh(extent_protocol::extentid_t eid,
+                         const extent_protocol::attr &attr);
+    cache_entry *revalidate(extent_protocol::extentid_t eid,
+                            std::unique_lock<std::mutex> &lock,
+                            extent_protocol::status &ret);
+
 public:
     extent_client(std::string dst);
 
     extent_protocol::status create(uint32_t type,  extent_protocol::extentid_t &eid);
     extent_protocol::status get(extent_protocol::extentid_t eid,
                                 std::string &buf);
+    extent_protocol::status read_range(extent_protocol::extentid_t eid,
+                                       unsigned int off, unsigned int len,
+                                       std::string &buf);
+    extent_protocol::status write_range(extent_protocol::extentid_t eid,
+                                        unsigned int off, std::string buf);
     extent_protocol::status getattr(extent_protocol::extentid_t eid,
                                     extent_protocol::attr &a);
     extent_protocol::status put(extent_protocol::extentid_t eid, std::string buf);
     extent_protocol::status remove(extent_protocol::extentid_t eid);
+    extent_protocol::status dir_lookup(extent_protocol::extentid_t dir,
+                                       std::string name,
+                                       extent_protocol::extentid_t &ino);
+    extent_protocol::status dir_insert(extent_protocol::extentid_t dir,
+                                       std::string name,
+                                       extent_protocol::extentid_t ino);
+    extent_protocol::status dir_remove(extent_protocol::extentid_t dir,
+                                       std::string name,
+                                       extent_protocol::extentid_t &ino);
+    extent_protocol::status readdir(extent_protocol::extentid_t dir,
+                                    std::map<std::string, extent_protocol::extentid_t> &ents);
+    extent_protocol::status create_in_dir(extent_protocol::extentid_t dir,
+                                          std::string name, uint32_t type,
+                                          extent_protocol::extentid_t &ino);
+    extent_protocol::status unlink_from_dir(extent_protocol::extentid_t dir,
+                                            std::string name);
 
 };
 
@@ -9,13 +9,21 @@ class extent_protocol {
  public:
   typedef int status;
   typedef unsigned long long extentid_t;
-  enum xxstatus { OK, RPCERR, NOENT, IOERR };
+  enum xxstatus { OK, RPCERR, NOENT, IOERR, EXIST };
   enum rpc_numbers {
     put = 0x6001,
     get,
     getattr,
     remove,
-    create
+    create,
+    read_range,
+    write_range,
+    dir_lookup,
+    dir_insert,
+    dir_remove,
+    readdir,
+    create_in_dir,
+    unlink_from_dir
   };
 
   //add the new file type symlink.
@@ -31,6 +39,7 @@ class extent_protocol {
     unsigned int mtime;
     unsigned int ctime;
     unsigned int size;
+    unsigned int version;
   };
 };
 
@@ -42,6 +51,7 @@ operator>>(unmarshall &u, extent_protocol::attr &a)
   u >> a.mtime;
   u >> a.ctime;
   u >> a.size;
+  u >> a.version;
   return u;
 }
 
@@ -53,6 +63,7 @@ operator<<(marshall &m, extent_protocol::attr a)
   m << a.mtime;
   m << a.ctime;
   m << a.size;
+  m << a.version;
   return m;
 }
 
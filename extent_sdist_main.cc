@@ -33,6 +33,14 @@ int main(int argc, char *argv[]) {
     server.reg(extent_protocol::put, &es_rg, &extent_server_dist::put);
     server.reg(extent_protocol::remove, &es_rg, &extent_server_dist::remove);
     server.reg(extent_protocol::create, &es_rg, &extent_server_dist::create);
+    server.reg(extent_protocol::read_range, &es_rg, &extent_server_dist::read_range);
+    server.reg(extent_protocol::write_range, &es_rg, &extent_server_dist::write_range);
+    server.reg(extent_protocol::dir_lookup, &es_rg, &extent_server_dist::dir_lookup);
+    server.reg(extent_protocol::dir_insert, &es_rg, &extent_server_dist::dir_insert);
+    server.reg(extent_protocol::dir_remove, &es_rg, &extent_server_dist::dir_remove);
+    server.reg(extent_protocol::readdir, &es_rg, &extent_server_dist::readdir);
+    server.reg(extent_protocol::create_in_dir, &es_rg, &extent_server_dist::create_in_dir);
+    server.reg(extent_protocol::unlink_from_dir, &es_rg, &extent_server_dist::unlink_from_dir);
 
     while (1)
         sleep(1000);
@@ -9,13 +9,40 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 
-extent_server::extent_server() 
+extent_server::extent_server() : batch_owner(std::thread::id())
 {
   im = new inode_manager();
 }
 
+std::unique_lock<std::shared_mutex> extent_server::write_lock()
+{
+  if (batch_owner == std::this_thread::get_id())
+    return std::unique_lock<std::shared_mutex>(mtx, std::defer_lock);
+  return std::unique_lock<std::shared_mutex>(mtx);
+}
+
+std::shared_lock<std::shared_mutex> extent_server::read_lock()
+{
+  if (batch_owner == std::this_thread::get_id())
+    return std::shared_lock<std::shared_mutex>(mtx, std::defer_lock);
+  return std::shared_lock<std::shared_mutex>(mtx);
+}
+
+extent_server::batch::batch(extent_server &_es) : es(_es)
+{
+  es.mtx.lock();
+  es.batch_owner = std::this_thread::get_id();
+}
+
+extent_server::batch::~batch()
+{
+  es.batch_owner = std::thread::id();
+  es.mtx.unlock();
+}
+
 int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
 {
+  std::unique_lock<std::shared_mutex> lock = write_lock();
   // alloc a new inode and return inum
   printf("extent_server: create inode\n");
   id = im->alloc_inode(type);
@@ -23,22 +50,31 @@ int extent_server::create(uint32_t type, extent_protocol::extentid_t &id)
   return extent_protocol::OK;
 }
 
-int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &)
+// put and write_range reply with the inode's new version so a caching
+// client can tell whether anyone else changed the file in between.
+int extent_server::put(extent_protocol::extentid_t id, std::string buf, int &version)
 {
-  id &= 0x7fffffff;
+  std::unique_lock<std::shared_mutex> lock = write_lock();
+  id = inum_local(id);
   
   const char * cbuf = buf.c_str();
   int size = buf.size();
   im->write_file(id, cbuf, size);
+
+  extent_protocol::attr a;
+  memset(&a, 0, sizeof(a));
+  im->get_attr(id, a);
+  version = a.version;
   
   return extent_protocol::OK;
 }
 
 int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
 {
+  std::shared_lock<std::shared_mutex> lock = read_lock();
   printf("extent_server: get %lld\n", id);
 
-  id &= 0x7fffffff;
+  id = inum_local(id);
 
   int size = 0;
   char *cbuf = NULL;
@@ -54,11 +90,48 @@ int extent_server::get(extent_protocol::extentid_t id, std::string &buf)
   return extent_protocol::OK;
 }
 
+int extent_server::read_range(extent_protocol::extentid_t id, unsigned int off,
+                              unsigned int len, std::string &buf)
+{
+  std::shared_lock<std::shared_mutex> lock = read_lock();
+  id = inum_local(id);
+
+  int size = 0;
+  char *cbuf = NULL;
+
+  im->read_file_range(id, off, len, &cbuf, &size);
+  if (size == 0)
+    buf = "";
+  else {
+    buf.assign(cbuf, size);
+    free(cbuf);
+  }
+
+  return extent_protocol::OK;
+}
+
+int extent_server::write_range(extent_protocol::extentid_t id, unsigned int off,
+                               std::string buf, int &version)
+{
+  std::unique_lock<std::shared_mutex> lock = write_lock();
+  id = inum_local(id);
+
+  im->write_file_range(id, off, buf.data(), buf.size());
+
+  extent_protocol::attr a;
+  memset(&a, 0, sizeof(a));
+  im->get_attr(id, a);
+  version = a.version;
+
+  return extent_protocol::OK;
+}
+
 int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a)
 {
+  std::shared_lock<std::shared_mutex> lock = read_lock();
   printf("extent_server: getattr %lld\n", id);
 
-  id &= 0x7fffffff;
+  id = inum_local(id);
   
   extent_protocol::attr attr;
   memset(&attr, 0, sizeof(attr));
@@ -70,11 +143,149 @@ int extent_server::getattr(extent_protocol::extentid_t id, extent_protocol::attr
 
 int extent_server::remove(extent_protocol::extentid_t id, int &)
 {
+  std::unique_lock<std::shared_mutex> lock = write_lock();
   printf("extent_server: write %lld\n", id);
 
-  id &= 0x7fffffff;
+  id = inum_local(id);
   im->remove_file(id);
  
   return extent_protocol::OK;
 }
 
+
+int extent_server::dir_lookup(extent_protocol::extentid_t dir, std::string name,
+                              extent_protocol::extentid_t &ino)
+{
+  std::shared_lock<std::shared_mutex> lock = read_lock();
+  dir = inum_local(dir);
+
+  uint32_t inum = 0;
+  int r = im->dir_lookup(dir, name.c_str(), &inum);
+  ino = inum;
+
+  return r;
+}
+
+// Replies with the directory's new version, like put.
+int extent_server::dir_insert(extent_protocol::extentid_t dir, std::string name,
+                              extent_protocol::extentid_t ino, int &version)
+{
+  std::unique_lock<std::shared_mutex> lock = write_lock();
+  dir = inum_local(dir);
+
+  int r = im->dir_insert(dir, name.c_str(), ino);
+
+  extent_protocol::attr a;
+  memset(&a, 0, sizeof(a));
+  im->get_attr(dir, a);
+  version = a.version;
+
+  return r;
+}
+
+int extent_server::dir_remove(extent_protocol::extentid_t dir, std::string name,
+                              extent_protocol::extentid_t &ino)
+{
+  std::unique_lock<std::shared_mutex> lock = write_lock();
+  dir = inum_local(dir);
+
+  uint32_t inum = 0;
+  int r = im->dir_remove(dir, name.c_str(), &inum);
+  ino = inum;
+
+  return r;
+}
+
+int extent_server::readdir(extent_protocol::extentid_t dir,
+                           std::map<std::string, extent_protocol::extentid_t> &ents)
+{
+  std::shared_lock<std::shared_mutex> lock = read_lock();
+  dir = inum_local(dir);
+
+  std::map<std::string, uint32_t> m;
+  int r = im->dir_list(dir, m);
+  ents.clear();
+  for (std::map<std::string, uint32_t>::iterator it = m.begin(); it != m.end(); ++it)
+    ents[it->first] = it->second;
+
+  return r;
+}
+
+// Allocate an inode and link it into dir in one step, so a concurrent
+// create of the same name can't slip in between.
+int extent_server::create_in_dir(extent_protocol::extentid_t dir, std::string name,
+                                 uint32_t type, extent_protocol::extentid_t &ino)
+{
+  std::unique_lock<std::shared_mutex> lock = write_lock();
+  int shard = inum_shard(dir);
+  dir = inum_local(dir);
+
+  uint32_t inum;
+  if (im->dir_lookup(dir, name.c_str(), &inum) == extent_protocol::OK)
+    return extent_protocol::EXIST;
+
+  inum = im->alloc_inode(type);
+  int r = im->dir_insert(dir, name.c_str(), inum_make(shard, inum));
+  if (r != extent_protocol::OK) {
+    im->free_inode(inum);
+    return r;
+  }
+  ino = inum_make(shard, inum);
+
+  return extent_protocol::OK;
+}
+
+int extent_server::unlink_from_dir(extent_protocol::extentid_t dir, std::string name, int &)
+{
+  extent_protocol::extentid_t ino;
+  return unlink_entry(dir, name, ino);
+}
+
+// Removes the entry, and the file too if it lives in dir's shard;
+// otherwise its owner has to remove it. Returns the file's inum in ino.
+int extent_server::unlink_entry(extent_protocol::extentid_t dir, std::string name,
+                                extent_protocol::extentid_t &ino)
+{
+  std::unique_lock<std::shared_mutex> lock = write_lock();
+  int shard = inum_shard(dir);
+  dir = inum_local(dir);
+
+  uint32_t inum;
+  int r = im->dir_remove(dir, name.c_str(), &inum);
+  if (r != extent_protocol::OK)
+    return r;
+  ino = inum;
+  if (inum_shard(inum) == shard)
+    im->remove_file(inum_local(inum));
+
+  return extent_protocol::OK;
+}
+
+// Readers may run alongside a snapshot; writers may not.
+void extent_server::snapshot(std::vector<char> &out)
+{
+  std::shared_lock<std::shared_mutex> lock = read_lock();
+  im->snapshot(out);
+}
+
+bool extent_server::restore(const char *buf, uint32_t size)
+{
+  std::unique_lock<std::shared_mutex> lock = write_lock();
+  return im->restore(buf, size);
+}
+
+void extent_server::freeze()
+{
+  std::unique_lock<std::shared_mutex> lock = write_lock();
+  im->freeze();
+}
+
+void extent_server::snapshot_frozen(std::vector<char> &out)
+{
+  im->snapshot_frozen(out);
+}
+
+void extent_server::thaw()
+{
+  im->thaw();
+}
@@ -5,9 +5,33 @@
 
 #include <string>
 #include <map>
+#include <vector>
+#include <atomic>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
 #include "extent_protocol.h"
 #include "inode_manager.h"
 
+// An inode number is (shard << CHFS_SHARD_SHIFT) | the inode's number in
+// its shard's inode_manager, so numbers stay unique across the raft groups
+// extent_server_dist splits the filesystem into. One extent_server holds
+// one shard, and takes it from the inode a call names. Directory entries
+// hold full numbers. A lone server is shard 0, where the two coincide.
+#define CHFS_SHARD_SHIFT 16
+
+inline uint32_t inum_local(extent_protocol::extentid_t id) {
+  return id & ((1 << CHFS_SHARD_SHIFT) - 1);
+}
+
+inline int inum_shard(extent_protocol::extentid_t id) {
+  return (id & 0x7fffffff) >> CHFS_SHARD_SHIFT;
+}
+
+inline extent_protocol::extentid_t inum_make(int shard, uint32_t local) {
+  return ((extent_protocol::extentid_t) shard << CHFS_SHARD_SHIFT) | local;
+}
+
 class extent_server {
  protected:
 #if 0
@@ -18,15 +42,56 @@ class extent_server {
   std::map <extent_protocol::extentid_t, extent_t> extents;
 #endif
   inode_manager *im;
+  std::shared_mutex mtx;  // inode_manager itself is not thread-safe
+  std::atomic<std::thread::id> batch_owner;
+
+  // mtx, unless this thread already holds it for a batch
+  std::unique_lock<std::shared_mutex> write_lock();
+  std::shared_lock<std::shared_mutex> read_lock();
 
  public:
   extent_server();
 
+  // Holds the lock across several calls, e.g. a batch of raft commands.
+  // Calls made meanwhile from the same thread don't take it again.
+  class batch {
+   public:
+    batch(extent_server &es);
+    ~batch();
+   private:
+    extent_server &es;
+  };
+
   int create(uint32_t type, extent_protocol::extentid_t &id);
   int put(extent_protocol::extentid_t id, std::string, int &);
   int get(extent_protocol::extentid_t id, std::string &);
+  int read_range(extent_protocol::extentid_t id, unsigned int off,
+                 unsigned int len, std::string &);
+  int write_range(extent_protocol::extentid_t id, unsigned int off,
+                  std::string, int &);
   int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
   int remove(extent_protocol::extentid_t id, int &);
+  int dir_lookup(extent_protocol::extentid_t dir, std::string name,
+                 extent_protocol::extentid_t &ino);
+  int dir_insert(extent_protocol::extentid_t dir, std::string name,
+                 extent_protocol::extentid_t ino, int &);
+  int dir_remove(extent_protocol::extentid_t dir, std::string name,
+                 extent_protocol::extentid_t &ino);
+  int readdir(extent_protocol::extentid_t dir,
+              std::map<std::string, extent_protocol::extentid_t> &);
+  int create_in_dir(extent_protocol::extentid_t dir, std::string name,
+                    uint32_t type, extent_protocol::extentid_t &ino);
+  int unlink_from_dir(extent_protocol::extentid_t dir, std::string name, int &);
+  int unlink_entry(extent_protocol::extentid_t dir, std::string name,
+                   extent_protocol::extentid_t &ino);
+
+  void snapshot(std::vector<char> &);
+  bool restore(const char *buf, uint32_t size);
+  // Copy-on-write snapshot: after freeze(), snapshot_frozen() serializes
+  // the state as of the freeze while other calls go on; thaw() ends it.
+  void freeze();
+  void snapshot_frozen(std::vector<char> &);
+  void thaw();
 };
 
 #endif 
@@ -1,92 +1,275 @@
 #include "extent_server_dist.h"
 
-chfs_raft *extent_server_dist::leader() const {
-    int leader = this->raft_group->check_exact_one_leader();
-    if (leader < 0) {
-        return this->raft_group->nodes[0];
-    } else {
-        return this->raft_group->nodes[leader];
+chfs_raft *extent_server_dist::leader(int shard) const {
+    return this->raft_groups[shard]->nodes[leader_hints[shard]];
+}
+
+int extent_server_dist::shard_of(extent_protocol::extentid_t id) const {
+    int shard = inum_shard(id);
+    return shard < (int) this->raft_groups.size() ? shard : 0;
+}
+
+// The shard a new entry goes to. Files stay with their directory, so
+// creating and unlinking them is one command in one group; directories
+// are hashed over the groups, so separate subtrees proceed in parallel.
+int extent_server_dist::place(extent_protocol::extentid_t dir, const std::string &name, uint32_t type) const {
+    if (type != extent_protocol::T_DIR) {
+        return shard_of(dir);
     }
+    return (std::hash<std::string>()(name) + dir) % this->raft_groups.size();
 }
 
-int extent_server_dist::create(uint32_t type, extent_protocol::extentid_t &id) {
-    int leader = this->raft_group->check_exact_one_leader();
+// Serve a read-only command from the leader's state machine after a
+// ReadIndex check, so it costs no log entry. Returns false if leadership
+// couldn't be confirmed; the caller then falls back to the log.
+bool extent_server_dist::read_locally(int shard, chfs_command_raft &cmd) {
+    chfs_raft_group *group = this->raft_groups[shard];
+    int leader = leader_hints[shard];
     int term, index;
-    chfs_command_raft cmd(chfs_command_raft::CMD_CRT, type, 0, "");
-    ASSERT(this->raft_group->nodes[leader]->new_command(cmd, term, index), "Leader should not change");
-    {
-        std::unique_lock<std::mutex> lock(cmd.res->mtx);
-        if (!(cmd.res)->done) {
-            ASSERT((cmd.res)->cv.wait_until(lock, std::chrono::system_clock::now() + std::chrono::milliseconds(2500))
-                == std::cv_status::no_timeout, "create command timeout");
-        }
-        id = (cmd.res)->id;
+    if (!group->nodes[leader]->read_index(term, index)) {
+        return false;
     }
-    return extent_protocol::OK;
+    group->states[leader]->read(cmd);
+    return true;
+}
+
+void extent_server_dist::tag(chfs_command_raft &cmd) {
+    std::lock_guard<std::mutex> lock(seq_mtx);
+    cmd.client_id = client_id;
+    cmd.seq = ++next_seq;
+    unanswered.insert(cmd.seq);
+    cmd.acked = *unanswered.begin();
 }
 
-int extent_server_dist::put(extent_protocol::extentid_t id, std::string buf, int &) {
-    int leader = this->raft_group->check_exact_one_leader();
+// Once no copy of cmd is waited on, the state machines may forget it.
+void extent_server_dist::answered(const chfs_command_raft &cmd) {
+    std::lock_guard<std::mutex> lock(seq_mtx);
+    unanswered.erase(cmd.seq);
+}
+
+// Commit cmd in shard's group and wait until it is applied. Starts at the
+// cached leader and follows the nodes' hints when it has moved. If the
+// command sits uncommitted for too long we look for it in the new
+// leader's log, and propose it again if it isn't there. Each node fills in
+// its own copy of the result as it applies the entry, so the result is
+// taken from the node that reported the entry at (index, term) committed,
+// not from the one that took the command, which may have been cut off.
+// A command that changes the filesystem is tagged first, so that if both
+// copies commit, the second only repeats the first one's result.
+// Returns nullptr if that doesn't succeed within CHFS_REQUEST_TIMEOUT_MS.
+std::shared_ptr<chfs_command_raft::result> extent_server_dist::submit(int shard, chfs_command_raft cmd, const char *what) {
+    chfs_raft_group *group = this->raft_groups[shard];
+    int num_nodes = group->nodes.size();
+    std::chrono::system_clock::time_point deadline =
+        std::chrono::system_clock::now() + std::chrono::milliseconds(CHFS_REQUEST_TIMEOUT_MS);
+    std::shared_ptr<chfs_command_raft::result> res = cmd.res;
+    std::shared_ptr<chfs_command_raft> entry;
+    if (!cmd.read_only()) {
+        tag(cmd);
+    }
+
+    int node = leader_hints[shard];
+    int misses = 0;
+    bool proposed = false;
     int term, index;
-    chfs_command_raft cmd(chfs_command_raft::CMD_PUT, 0, id, buf);
-    ASSERT(this->raft_group->nodes[leader]->new_command(cmd, term, index), "Leader should not change");
-    {
-        std::unique_lock<std::mutex> lock(cmd.res->mtx);
-        if (!(cmd.res)->done) {
-            ASSERT((cmd.res)->cv.wait_until(lock, std::chrono::system_clock::now() + std::chrono::milliseconds(2500))
-                == std::cv_status::no_timeout, "put command timeout");
+    while (std::chrono::system_clock::now() < deadline) {
+        if (!proposed) {
+            if (!group->nodes[node]->new_command(cmd, term, index)) {
+                int hint = group->nodes[node]->leader_hint();
+                node = hint >= 0 && hint != node ? hint : (node + 1) % num_nodes;
+                if (++misses % num_nodes == 0) {
+                    mssleep(20);    // no one leads yet; let the election finish
+                }
+                continue;
+            }
+            proposed = true;
+            leader_hints[shard] = node;
+        }
+
+        std::chrono::system_clock::time_point wait = std::min(deadline,
+            std::chrono::system_clock::now() + std::chrono::milliseconds(CHFS_COMMIT_WAIT_MS));
+        entry.reset();
+        chfs_raft::entry_status status = group->nodes[node]->wait_committed(index, term, wait, &entry);
+        if (status == chfs_raft::entry_committed) {
+            // The node has no copy only if it already applied the entry and
+            // compacted it away; then all that is left is our own result,
+            // filled in if the node that took the command applies it too.
+            std::shared_ptr<chfs_command_raft::result> r = entry ? entry->res : res;
+            std::unique_lock<std::mutex> lock(r->mtx);
+            if (r->cv.wait_until(lock, deadline, [&r] { return r->done; })) {
+                answered(cmd);
+                return r;
+            }
+            break;
+        }
+        if (status == chfs_raft::entry_lost) {
+            proposed = false;
+        } else {
+            int hint = group->nodes[node]->leader_hint();
+            node = hint >= 0 && hint != node ? hint : (node + 1) % num_nodes;
         }
     }
+    printf("extent_server_dist: %s failed in shard %d\n", what, shard);
+    answered(cmd);
+    return nullptr;
+}
+
+std::shared_ptr<chfs_command_raft::result> extent_server_dist::query(int shard, chfs_command_raft cmd, const char *what) {
+    if (read_locally(shard, cmd)) {
+        return cmd.res;
+    }
+    return submit(shard, std::move(cmd), what);
+}
+
+int extent_server_dist::create(uint32_t type, extent_protocol::extentid_t &id) {
+    int shard = next_shard++ % this->raft_groups.size();
+    auto res = submit(shard, chfs_command_raft(chfs_command_raft::CMD_CRT, type, inum_make(shard, 0), ""), "create");
+    if (!res) {
+        return extent_protocol::IOERR;
+    }
+    id = res->id;
+    return extent_protocol::OK;
+}
+
+int extent_server_dist::put(extent_protocol::extentid_t id, std::string buf, int &version) {
+    auto res = submit(shard_of(id), chfs_command_raft(chfs_command_raft::CMD_PUT, 0, id, std::move(buf)), "put");
+    if (!res) {
+        return extent_protocol::IOERR;
+    }
+    version = res->version;
     return extent_protocol::OK;
 }
 
 int extent_server_dist::get(extent_protocol::extentid_t id, std::string &buf) {
-    int leader = this->raft_group->check_exact_one_leader();
-    int term, index;
-    chfs_command_raft cmd(chfs_command_raft::CMD_GET, 0, id, "");
-    ASSERT(this->raft_group->nodes[leader]->new_command(cmd, term, index), "Leader should not change");
-    {
-        std::unique_lock<std::mutex> lock(cmd.res->mtx);
-        if (!(cmd.res)->done) {
-            ASSERT((cmd.res)->cv.wait_until(lock, std::chrono::system_clock::now() + std::chrono::milliseconds(2500))
-                == std::cv_status::no_timeout, "get command timeout");
-        }
-        buf = (cmd.res)->buf;
+    auto res = query(shard_of(id), chfs_command_raft(chfs_command_raft::CMD_GET, 0, id, ""), "get");
+    if (!res) {
+        return extent_protocol::IOERR;
+    }
+    buf = res->buf;
+    return extent_protocol::OK;
+}
+
+int extent_server_dist::read_range(extent_protocol::extentid_t id, unsigned int off, unsigned int len, std::string &buf) {
+    auto res = query(shard_of(id), chfs_command_raft(chfs_command_raft::CMD_READ, 0, id, "", off, len), "read_range");
+    if (!res) {
+        return extent_protocol::IOERR;
     }
+    buf = res->buf;
+    return extent_protocol::OK;
+}
+
+int extent_server_dist::write_range(extent_protocol::extentid_t id, unsigned int off, std::string buf, int &version) {
+    auto res = submit(shard_of(id), chfs_command_raft(chfs_command_raft::CMD_WRITE, 0, id, std::move(buf), off), "write_range");
+    if (!res) {
+        return extent_protocol::IOERR;
+    }
+    version = res->version;
     return extent_protocol::OK;
 }
 
 int extent_server_dist::getattr(extent_protocol::extentid_t id, extent_protocol::attr &a) {
-    int leader = this->raft_group->check_exact_one_leader();
-    int term, index;
-    chfs_command_raft cmd(chfs_command_raft::CMD_GETA, 0, id, "");
-    ASSERT(this->raft_group->nodes[leader]->new_command(cmd, term, index), "Leader should not change");
-    {
-        std::unique_lock<std::mutex> lock(cmd.res->mtx);
-        if (!(cmd.res)->done) {
-            ASSERT((cmd.res)->cv.wait_until(lock, std::chrono::system_clock::now() + std::chrono::milliseconds(2500))
-                == std::cv_status::no_timeout, "getattr command timeout");
-        }
-        a = (cmd.res)->attr;
+    auto res = query(shard_of(id), chfs_command_raft(chfs_command_raft::CMD_GETA, 0, id, ""), "getattr");
+    if (!res) {
+        return extent_protocol::IOERR;
     }
+    a = res->attr;
     return extent_protocol::OK;
 }
 
 int extent_server_dist::remove(extent_protocol::extentid_t id, int &) {
-    int leader = this->raft_group->check_exact_one_leader();
-    int term, index;
-    chfs_command_raft cmd(chfs_command_raft::CMD_RMV, 0, id, "");
-    ASSERT(this->raft_group->nodes[leader]->new_command(cmd, term, index), "Leader should not change");
-    {
-        std::unique_lock<std::mutex> lock(cmd.res->mtx);
-        if (!(cmd.res)->done) {
-            ASSERT((cmd.res)->cv.wait_until(lock, std::chrono::system_clock::now() + std::chrono::milliseconds(2500))
-                == std::cv_status::no_timeout, "remove command timeout");
+    if (!submit(shard_of(id), chfs_command_raft(chfs_command_raft::CMD_RMV, 0, id, ""), "remove")) {
+        return extent_protocol::IOERR;
+    }
+    return extent_protocol::OK;
+}
+
+int extent_server_dist::dir_lookup(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t &ino) {
+    auto res = query(shard_of(dir), chfs_command_raft(chfs_command_raft::CMD_DLOOKUP, 0, dir, name), "dir_lookup");
+    if (!res) {
+        return extent_protocol::IOERR;
+    }
+    ino = res->id;
+    return res->status;
+}
+
+int extent_server_dist::dir_insert(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t ino, int &version) {
+    auto res = submit(shard_of(dir), chfs_command_raft(chfs_command_raft::CMD_DINSERT, 0, dir, name, 0, 0, ino), "dir_insert");
+    if (!res) {
+        return extent_protocol::IOERR;
+    }
+    version = res->version;
+    return res->status;
+}
+
+int extent_server_dist::dir_remove(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t &ino) {
+    auto res = submit(shard_of(dir), chfs_command_raft(chfs_command_raft::CMD_DREMOVE, 0, dir, name), "dir_remove");
+    if (!res) {
+        return extent_protocol::IOERR;
+    }
+    ino = res->id;
+    return res->status;
+}
+
+int extent_server_dist::readdir(extent_protocol::extentid_t dir, std::map<std::string, extent_protocol::extentid_t> &ents) {
+    auto res = query(shard_of(dir), chfs_command_raft(chfs_command_raft::CMD_READDIR, 0, dir, ""), "readdir");
+    if (!res) {
+        return extent_protocol::IOERR;
+    }
+    ents = res->entries;
+    return res->status;
+}
+
+// Within one shard this is a single atomic command. Across shards the
+// file is created first and linked second, and unlinked if the name turns
+// out to be taken: a crash in between leaves an unreachable inode behind,
+// never an entry naming a missing one.
+int extent_server_dist::create_in_dir(extent_protocol::extentid_t dir, std::string name, uint32_t type, extent_protocol::extentid_t &ino) {
+    int dir_shard = shard_of(dir);
+    int shard = place(dir, name, type);
+    if (shard == dir_shard) {
+        auto res = submit(shard, chfs_command_raft(chfs_command_raft::CMD_CRTDIR, type, dir, name), "create_in_dir");
+        if (!res) {
+            return extent_protocol::IOERR;
         }
+        ino = res->id;
+        return res->status;
+    }
+
+    auto found = query(dir_shard, chfs_command_raft(chfs_command_raft::CMD_DLOOKUP, 0, dir, name), "dir_lookup");
+    if (!found) {
+        return extent_protocol::IOERR;
+    }
+    if (found->status == extent_protocol::OK) {
+        return extent_protocol::EXIST;
+    }
+    auto created = submit(shard, chfs_command_raft(chfs_command_raft::CMD_CRT, type, inum_make(shard, 0), ""), "create");
+    if (!created) {
+        return extent_protocol::IOERR;
+    }
+    auto linked = submit(dir_shard, chfs_command_raft(chfs_command_raft::CMD_DINSERT, 0, dir, name, 0, 0, created->id), "dir_insert");
+    if (!linked || linked->status != extent_protocol::OK) {
+        submit(shard, chfs_command_raft(chfs_command_raft::CMD_RMV, 0, created->id, ""), "remove");
+        return linked ? linked->status : extent_protocol::IOERR;
     }
+    ino = created->id;
     return extent_protocol::OK;
 }
 
+// The directory's group drops the entry, and the file with it if it owns
+// the file; otherwise the file's own group removes it next.
+int extent_server_dist::unlink_from_dir(extent_protocol::extentid_t dir, std::string name, int &) {
+    int dir_shard = shard_of(dir);
+    auto res = submit(dir_shard, chfs_command_raft(chfs_command_raft::CMD_UNLINK, 0, dir, name), "unlink_from_dir");
+    if (!res) {
+        return extent_protocol::IOERR;
+    }
+    if (res->status == extent_protocol::OK && shard_of(res->id) != dir_shard) {
+        submit(shard_of(res->id), chfs_command_raft(chfs_command_raft::CMD_RMV, 0, res->id, ""), "remove");
+    }
+    return res->status;
+}
+
 extent_server_dist::~extent_server_dist() {
-    delete this->raft_group;
+    for (chfs_raft_group *group : this->raft_groups)
+        delete group;
 }
@@ -5,7 +5,11 @@
 
 #include "extent_protocol.h"
 #include <map>
+#include <set>
 #include <string>
+#include <atomic>
+#include <mutex>
+#include <random>
 #include "raft.h"
 #include "extent_server.h"
 #include "raft_test_utils.h"
@@ -14,22 +18,79 @@
 using chfs_raft = raft<chfs_state_machine, chfs_command_raft>;
 using chfs_raft_group = raft_group<chfs_state_machine, chfs_command_raft>;
 
+// Log entries between automatic snapshots of the filesystem.
+#define CHFS_SNAPSHOT_ENTRIES 4096
+
+// Raft groups the inode space is split across.
+#define CHFS_SHARDS 4
+
+// How long a request may spend finding a leader and waiting for its
+// command to commit before it fails with IOERR.
+#define CHFS_REQUEST_TIMEOUT_MS 10000
+// How long the node holding a command may leave it uncommitted before we
+// suspect it has been cut off and look for a newer leader.
+#define CHFS_COMMIT_WAIT_MS 1000
+
+// The filesystem is split into shards by inode number (see inum_shard()),
+// each served by its own raft group with its own leader and log. A call
+// goes to the group owning the inode it names. Files are created in their
+// directory's shard and directories are spread over the shards; linking a
+// directory into a parent in another shard, or unlinking it, is
+// coordinated across the two groups by create_in_dir and unlink_from_dir.
 class extent_server_dist {
 public:
-    chfs_raft_group *raft_group;
-    extent_server_dist(const int num_raft_nodes = 3) {
-        raft_group = new chfs_raft_group(num_raft_nodes);
+    std::vector<chfs_raft_group *> raft_groups;
+    extent_server_dist(const int num_raft_nodes = 3, const int num_shards = CHFS_SHARDS):
+        next_shard(0), leader_hints(new std::atomic<int>[num_shards]), next_seq(0) {
+        std::random_device rd;
+        client_id = ((uint64_t) rd() << 32 | rd()) | 1;   // never 0
+        for (int i = 0; i < num_shards; i++) {
+            leader_hints[i] = 0;
+            std::string dir = i == 0 ? "raft_temp" : "raft_temp_" + std::to_string(i);
+            chfs_raft_group *group = new chfs_raft_group(num_raft_nodes, dir.c_str());
+            for (chfs_raft *node : group->nodes)
+                node->set_snapshot_threshold(CHFS_SNAPSHOT_ENTRIES);
+            raft_groups.push_back(group);
+        }
     };
 
-    chfs_raft *leader() const;
+    chfs_raft *leader(int shard) const;
 
     int create(uint32_t type, extent_protocol::extentid_t &id);
     int put(extent_protocol::extentid_t id, std::string, int &);
     int get(extent_protocol::extentid_t id, std::string &);
+    int read_range(extent_protocol::extentid_t id, unsigned int off, unsigned int len, std::string &);
+    int write_range(extent_protocol::extentid_t id, unsigned int off, std::string, int &);
     int getattr(extent_protocol::extentid_t id, extent_protocol::attr &);
     int remove(extent_protocol::extentid_t id, int &);
+    int dir_lookup(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t &ino);
+    int dir_insert(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t ino, int &);
+    int dir_remove(extent_protocol::extentid_t dir, std::string name, extent_protocol::extentid_t &ino);
+    int readdir(extent_protocol::extentid_t dir, std::map<std::string, extent_protocol::extentid_t> &);
+    int create_in_dir(extent_protocol::extentid_t dir, std::string name, uint32_t type, extent_protocol::extentid_t &ino);
+    int unlink_from_dir(extent_protocol::extentid_t dir, std::string name, int &);
 
     ~extent_server_dist();
+
+private:
+    std::atomic<unsigned> next_shard;   // where create puts the next inode
+    // per shard, the node that last accepted a command
+    std::unique_ptr<std::atomic<int>[]> leader_hints;
+
+    // Tags for the commands that change the filesystem; see
+    // chfs_command_raft::client_id.
+    uint64_t client_id;
+    std::mutex seq_mtx;
+    uint64_t next_seq;
+    std::set<uint64_t> unanswered;
+    void tag(chfs_command_raft &cmd);
+    void answered(const chfs_command_raft &cmd);
+
+    int shard_of(extent_protocol::extentid_t id) const;
+    int place(extent_protocol::extentid_t dir, const std::string &name, uint32_t type) const;
+    bool read_locally(int shard, chfs_command_raft &cmd);
+    std::shared_ptr<chfs_command_raft::result> submit(int shard, chfs_command_raft cmd, const char *what);
+    std::shared_ptr<chfs_command_raft::result> query(int shard, chfs_command_raft cmd, const char *what);
 };
 
 #endif
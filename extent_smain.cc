@@ -30,6 +30,14 @@ main(int argc, char *argv[])
   server.reg(extent_protocol::getattr, &ls, &extent_server::getattr);
   server.reg(extent_protocol::put, &ls, &extent_server::put);
   server.reg(extent_protocol::remove, &ls, &extent_server::remove);
+  server.reg(extent_protocol::read_range, &ls, &extent_server::read_range);
+  server.reg(extent_protocol::write_range, &ls, &extent_server::write_range);
+  server.reg(extent_protocol::dir_lookup, &ls, &extent_server::dir_lookup);
+  server.reg(extent_protocol::dir_insert, &ls, &extent_server::dir_insert);
+  server.reg(extent_protocol::dir_remove, &ls, &extent_server::dir_remove);
+  server.reg(extent_protocol::readdir, &ls, &extent_server::readdir);
+  server.reg(extent_protocol::create_in_dir, &ls, &extent_server::create_in_dir);
+  server.reg(extent_protocol::unlink_from_dir, &ls, &extent_server::unlink_from_dir);
 
   while(1)
     sleep(1000);
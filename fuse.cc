@@ -141,7 +141,10 @@ fuseserver_setattr(fuse_req_t req, fuse_ino_t ino, struct stat *attr,
 
 #if 1
     bool flag = to_set & FUSE_SET_ATTR_SIZE;
-    if (flag) chfs->setattr(ino, attr->st_size);
+    if (flag && chfs->setattr(ino, attr->st_size) != chfs_client::OK) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
     getattr(ino, st);
     fuse_reply_attr(req, &st, 0);
 #else
@@ -175,7 +178,7 @@ fuseserver_read(fuse_req_t req, fuse_ino_t ino, size_t size,
     if (r == chfs_client::OK) {
         fuse_reply_buf(req, buf.data(), buf.size());
     } else {
-        fuse_reply_err(req, ENOENT);
+        fuse_reply_err(req, r == chfs_client::IOERR ? EIO : ENOENT);
     }
 #else
     fuse_reply_err(req, ENOSYS);
@@ -208,7 +211,7 @@ fuseserver_write(fuse_req_t req, fuse_ino_t ino,
     if (r == chfs_client::OK) {
         fuse_reply_write(req, size);
     } else {
-        fuse_reply_err(req, ENOENT);
+        fuse_reply_err(req, r == chfs_client::IOERR ? EIO : ENOENT);
     }
 #else
     fuse_reply_err(req, ENOSYS);
@@ -305,7 +308,10 @@ fuseserver_lookup(fuse_req_t req, fuse_ino_t parent, const char *name)
     bool found = false;
 
      chfs_client::inum ino;
-     chfs->lookup(parent, name, found, ino);
+     if (chfs->lookup(parent, name, found, ino) != chfs_client::OK) {
+         fuse_reply_err(req, EIO);
+         return;
+     }
 
     if (found) {
         e.ino = ino;
@@ -371,7 +377,10 @@ fuseserver_readdir(fuse_req_t req, fuse_ino_t ino, size_t size,
     memset(&b, 0, sizeof(b));
 
     std::list<chfs_client::dirent> entries;
-    chfs->readdir(inum, entries);
+    if (chfs->readdir(inum, entries) != chfs_client::OK) {
+        fuse_reply_err(req, EIO);
+        return;
+    }
     for (std::list<chfs_client::dirent>::iterator it = entries.begin(); it != entries.end(); ++it) {
         dirbuf_add(&b, it->name.c_str(), (fuse_ino_t) it->inum);
     }
@@ -479,6 +488,8 @@ fuseserver_unlink(fuse_req_t req, fuse_ino_t parent, const char *name)
     } else {
         if (r == chfs_client::NOENT) {
             fuse_reply_err(req, ENOENT);
+        } else if (r == chfs_client::IOERR) {
+            fuse_reply_err(req, EIO);
         } else {
             fuse_reply_err(req, ENOTEMPTY);
         }
@@ -597,8 +608,9 @@ main(int argc, char *argv[])
     }
 
     fuse_session_add_chan(se, ch);
-    // err = fuse_session_loop_mt(se);   // FK: wheelfs does this; why?
-    err = fuse_session_loop(se);
+    // chfs_client locks per inode, so requests on different files run
+    // in parallel
+    err = fuse_session_loop_mt(se);
 
     fuse_session_destroy(se);
     close(fd);
@@ -5,6 +5,64 @@
 disk::disk()
 {
   bzero(blocks, sizeof(blocks));
+  frozen = false;
+  bzero(preimage, sizeof(preimage));
+}
+
+disk::~disk()
+{
+  for (uint32_t i = 0; i < BLOCK_NUM; i++)
+    free(preimage[i]);
+}
+
+// Save the old contents of blocks [id, id+n) that were not saved since
+// freeze(). Called before every write; cow_mtx is only taken while a
+// snapshot is active.
+void
+disk::preserve(blockid_t id, uint32_t n)
+{
+  if (!frozen.load(std::memory_order_acquire))
+    return;
+  std::lock_guard<std::mutex> lock(cow_mtx);
+  if (!frozen)   // thawed meanwhile
+    return;
+  for (uint32_t i = id; i < id + n; i++) {
+    if (preimage[i] == NULL) {
+      preimage[i] = (char *) malloc(BLOCK_SIZE);
+      memcpy(preimage[i], blocks[i], BLOCK_SIZE);
+    }
+  }
+}
+
+void
+disk::freeze()
+{
+  std::lock_guard<std::mutex> lock(cow_mtx);
+  frozen = true;
+}
+
+void
+disk::thaw()
+{
+  std::lock_guard<std::mutex> lock(cow_mtx);
+  frozen = false;
+  for (uint32_t i = 0; i < BLOCK_NUM; i++) {
+    free(preimage[i]);
+    preimage[i] = NULL;
+  }
+}
+
+// A block as it was at freeze(). A writer saves the old contents under
+// cow_mtx before touching a block, so reading the live block under
+// cow_mtx when nothing was saved is safe.
+void
+disk::read_frozen(blockid_t id, char *buf)
+{
+  std::lock_guard<std::mutex> lock(cow_mtx);
+  if (preimage[id] != NULL)
+    memcpy(buf, preimage[id], BLOCK_SIZE);
+  else
+    memcpy(buf, blocks[id], BLOCK_SIZE);
 }
 
 void
@@ -16,30 +74,267 @@ disk::read_block(blockid_t id, char *buf)
 void
 disk::write_block(blockid_t id, const char *buf)
 {
+  preserve(id, 1);
   memcpy(blocks[id], buf, BLOCK_SIZE);
 }
 
+void
+disk::read_blocks(blockid_t id, uint32_t n, char *buf)
+{
+  memcpy(buf, blocks[id], n * BLOCK_SIZE);
+}
+
+void
+disk::write_blocks(blockid_t id, uint32_t n, const char *buf)
+{
+  preserve(id, n);
+  memcpy(blocks[id], buf, n * BLOCK_SIZE);
+}
+
+void
+disk::clear()
+{
+  preserve(0, BLOCK_NUM);
+  bzero(blocks, sizeof(blocks));
+}
+
 // block layer -----------------------------------------
 
+#define BITMAP_WORDS (BLOCK_SIZE / sizeof(uint64_t))
+
+// Set the bitmap bit of block id. Only used while formatting the disk.
+void
+block_manager::mark_block(uint32_t id)
+{
+  uint64_t map[BITMAP_WORDS];
+  uint32_t bit = id % BPB;
+
+  d->read_block(BBLOCK(id), (char *) map);
+  map[bit / 64] |= (uint64_t) 1 << (bit % 64);
+  d->write_block(BBLOCK(id), (const char *) map);
+  nfree[id / BPB]--;
+}
+
+// Next-fit allocation: scan the bitmap a word at a time starting from the
+// cursor, skipping bitmap blocks whose free count is zero.
 blockid_t
 block_manager::alloc_block()
 {
-  int min = IBLOCK(INODE_NUM, sb.nblocks) + 1;
-  for (int i=min; i<BLOCK_NUM; ++i) {
-    if (using_blocks[i] == 0) {  // allocate the corresponding block
-      using_blocks[i] = 1;
-      return i;
+  uint64_t map[BITMAP_WORDS];
+
+  // one extra round revisits the bits below the cursor in its own block
+  for (uint32_t n = 0; n <= NBITMAP; ++n) {
+    uint32_t bno = cursor / BPB;
+    if (nfree[bno] != 0) {
+      d->read_block(BBLOCK(cursor), (char *) map);
+      uint32_t first = (cursor % BPB) / 64;
+      for (uint32_t w = first; w < BITMAP_WORDS; ++w) {
+        uint64_t word = map[w];
+        if (w == first)  // bits below the cursor count as used in this pass
+          word |= ((uint64_t) 1 << (cursor % 64)) - 1;
+        if (~word == 0)
+          continue;
+        uint32_t bit = w * 64 + __builtin_ctzll(~word);
+        map[bit / 64] |= (uint64_t) 1 << (bit % 64);
+        d->write_block(BBLOCK(cursor), (const char *) map);
+        nfree[bno]--;
+        blockid_t id = bno * BPB + bit;
+        cursor = (id + 1) % BLOCK_NUM;
+        return id;
+      }
     }
+    cursor = ((bno + 1) % NBITMAP) * BPB;
   }
 
   printf("ERROR: no more blocks\n");
   return 0;
 }
 
+// Allocate a run of at most want contiguous blocks, starting at goal when
+// it is free so that a growing file can extend its last extent. Returns
+// the first block of the run and its length in *got, or 0 if the disk is
+// full.
+blockid_t
+block_manager::alloc_blocks(blockid_t goal, uint32_t want, uint32_t *got)
+{
+  uint64_t map[BITMAP_WORDS];
+  blockid_t start = 0;
+
+  *got = 0;
+  if (want == 0)
+    return 0;
+  if (goal > 0 && goal < BLOCK_NUM) {
+    uint32_t bit = goal % BPB;
+    d->read_block(BBLOCK(goal), (char *) map);
+    if (!(map[bit / 64] & ((uint64_t) 1 << (bit % 64)))) {
+      map[bit / 64] |= (uint64_t) 1 << (bit % 64);
+      d->write_block(BBLOCK(goal), (const char *) map);
+      nfree[goal / BPB]--;
+      start = goal;
+    }
+  }
+  if (start == 0 && (start = alloc_block()) == 0)
+    return 0;
+
+  // claim the free blocks right after start, a word at a time when aligned
+  uint32_t n = 1;
+  d->read_block(BBLOCK(start), (char *) map);
+  while (n < want && start + n < BLOCK_NUM) {
+    blockid_t id = start + n;
+    uint32_t bit = id % BPB;
+    if (bit == 0)
+      d->read_block(BBLOCK(id), (char *) map);
+    uint32_t claim;
+    if (bit % 64 == 0 && want - n >= 64 && map[bit / 64] == 0) {
+      map[bit / 64] = ~(uint64_t) 0;
+      claim = 64;
+    } else if (!(map[bit / 64] & ((uint64_t) 1 << (bit % 64)))) {
+      map[bit / 64] |= (uint64_t) 1 << (bit % 64);
+      claim = 1;
+    } else {
+      break;
+    }
+    nfree[id / BPB] -= claim;
+    n += claim;
+    if ((id + claim) % BPB == 0)
+      d->write_block(BBLOCK(id), (const char *) map);
+  }
+  if ((start + n) % BPB != 0)
+    d->write_block(BBLOCK(start + n - 1), (const char *) map);
+
+  cursor = (start + n) % BLOCK_NUM;
+  *got = n;
+  return start;
+}
+
 void
 block_manager::free_block(uint32_t id)
 {
-  using_blocks[id] = 0;
+  uint64_t map[BITMAP_WORDS];
+  uint32_t bit = id % BPB;
+
+  if (id >= BLOCK_NUM) {
+    printf("ERROR: free block %u out of range\n", id);
+    return;
+  }
+  d->read_block(BBLOCK(id), (char *) map);
+  if (!(map[bit / 64] & ((uint64_t) 1 << (bit % 64)))) {
+    printf("ERROR: block %u is already free\n", id);
+    return;
+  }
+  map[bit / 64] &= ~((uint64_t) 1 << (bit % 64));
+  d->write_block(BBLOCK(id), (const char *) map);
+  nfree[id / BPB]++;
+}
+
+// A snapshot of the disk is the allocation cursor followed by the blocks
+// that are allocated and not all zeros, as runs of {uint32 start,
+// uint32 count, count blocks}, so its size follows the live data rather
+// than the disk size.
+void
+block_manager::snapshot(std::vector<char> &out)
+{
+  serialize(out, false);
+}
+
+void
+block_manager::freeze()
+{
+  d->freeze();
+  frozen_cursor = cursor;
+}
+
+void
+block_manager::thaw()
+{
+  d->thaw();
+}
+
+// The disk snapshot as of freeze().
+void
+block_manager::snapshot_frozen(std::vector<char> &out)
+{
+  serialize(out, true);
+}
+
+void
+block_manager::serialize(std::vector<char> &out, bool frozen)
+{
+  uint64_t map[BITMAP_WORDS];
+  static const char zero[BLOCK_SIZE] = {0};
+  char buf[BLOCK_SIZE];
+  size_t hdr = 0;    // where the current run's header is
+  bool in_run = false;
+
+  uint32_t c = frozen ? frozen_cursor : cursor;
+  out.insert(out.end(), (char *) &c, (char *) (&c + 1));
+
+  for (blockid_t id = 0; id < BLOCK_NUM; ++id) {
+    uint32_t bit = id % BPB;
+    if (bit == 0) {
+      if (frozen)
+        d->read_frozen(BBLOCK(id), (char *) map);
+      else
+        d->read_block(BBLOCK(id), (char *) map);
+    }
+    bool live = false;
+    if (map[bit / 64] & ((uint64_t) 1 << (bit % 64))) {
+      if (frozen)
+        d->read_frozen(id, buf);
+      else
+        d->read_block(id, buf);
+      live = memcmp(buf, zero, BLOCK_SIZE) != 0;
+    }
+    if (!live) {
+      in_run = false;
+      continue;
+    }
+    if (!in_run) {
+      in_run = true;
+      hdr = out.size();
+      uint32_t run[2] = {id, 0};
+      out.insert(out.end(), (char *) run, (char *) (run + 2));
+    }
+    ((uint32_t *) &out[hdr])[1]++;
+    out.insert(out.end(), buf, buf + BLOCK_SIZE);
+  }
+}
+
+// Replace the disk with a snapshot; the free counts are rebuilt from the
+// restored bitmap.
+bool
+block_manager::restore(const char *buf, uint32_t size)
+{
+  uint64_t map[BITMAP_WORDS];
+  uint32_t off = sizeof(uint32_t);
+
+  if (size < sizeof(uint32_t)) {
+    printf("\tim: snapshot too short\n");
+    return false;
+  }
+  memcpy(&cursor, buf, sizeof(uint32_t));
+  cursor %= BLOCK_NUM;
+  d->clear();
+  while (off + 2 * sizeof(uint32_t) <= size) {
+    uint32_t run[2];
+    memcpy(run, buf + off, sizeof(run));
+    off += sizeof(run);
+    if (run[0] >= BLOCK_NUM || run[1] > BLOCK_NUM - run[0] ||
+        run[1] > (size - off) / BLOCK_SIZE) {
+      printf("\tim: corrupt snapshot run %u+%u\n", run[0], run[1]);
+      return false;
+    }
+    d->write_blocks(run[0], run[1], buf + off);
+    off += run[1] * BLOCK_SIZE;
+  }
+
+  for (uint32_t i = 0; i < NBITMAP; i++) {
+    d->read_block(BBLOCK(i * BPB), (char *) map);
+    nfree[i] = BPB;
+    for (uint32_t w = 0; w < BITMAP_WORDS; w++)
+      nfree[i] -= __builtin_popcountll(map[w]);
+  }
+  return off == size;
 }
 
 // The layout of disk should be like this:
@@ -47,11 +342,24 @@ block_manager::free_block(uint32_t id)
 block_manager::block_manager()
 {
   d = new disk();
-  for (uint32_t i=0; i<IBLOCK(INODE_NUM, sb.nblocks); i++)
-    using_blocks[i] = 1;
   sb.size = BLOCK_SIZE * BLOCK_NUM;
   sb.nblocks = BLOCK_NUM;
   sb.ninodes = INODE_NUM;
+
+  for (uint32_t i=0; i<NBITMAP; i++)
+    nfree[i] = BPB;
+  // bits past the end of the disk in the last bitmap block are never free
+  for (uint32_t i=BLOCK_NUM; i<NBITMAP*BPB; i++)
+    mark_block(i);
+  // superblock, bitmap and inode table
+  for (uint32_t i=0; i<=IBLOCK(INODE_NUM, sb.nblocks); i++)
+    mark_block(i);
+  cursor = IBLOCK(INODE_NUM, sb.nblocks) + 1;
+}
+
+block_manager::~block_manager()
+{
+  delete d;
 }
 
 void
@@ -66,6 +374,18 @@ block_manager::write_block(uint32_t id, const char *buf)
   d->write_block(id, buf);
 }
 
+void
+block_manager::read_blocks(uint32_t id, uint32_t n, char *buf)
+{
+  d->read_blocks(id, n, buf);
+}
+
+void
+block_manager::write_blocks(uint32_t id, uint32_t n, const char *buf)
+{
+  d->write_blocks(id, n, buf);
+}
+
 // inode layer -----------------------------------------
 
 inode_manager::inode_manager()
@@ -79,6 +399,11 @@ inode_manager::inode_manager()
   }
 }
 
+inode_manager::~inode_manager()
+{
+  delete bm;
+}
+
 uint32_t
 inode_manager::alloc_inode(uint32_t type)
 {
@@ -87,9 +412,15 @@ inode_manager::alloc_inode(uint32_t type)
     inumber = (inumber + 1) % INODE_NUM;
     inode_t * ino = get_inode(inumber);
     if (ino == NULL) {
+      // keep counting versions from the previous owner of this slot so a
+      // stale cached copy of the old file never matches the new one
+      char buf[BLOCK_SIZE];
+      bm->read_block(IBLOCK(inumber, bm->sb.nblocks), buf);
+      unsigned int version = ((inode_t *) buf + inumber%IPB)->version;
       ino = (inode_t *) malloc(sizeof(inode_t));
       bzero(ino, sizeof(inode_t));
       ino->type = type;
+      ino->version = version + 1;
       ino->atime = (unsigned int) time(NULL);
       ino->mtime = (unsigned int) time(NULL);
       ino->ctime = (unsigned int) time(NULL);
@@ -108,6 +439,7 @@ inode_manager::free_inode(uint32_t inum)
   inode_t * ino = get_inode(inum);
   if (ino) {
     ino->type = 0;
+    ino->version++;
     put_inode(inum, ino);
     free(ino);
   }
@@ -152,31 +484,290 @@ inode_manager::put_inode(uint32_t inum, struct inode *ino)
 
 #define MIN(a,b) ((a)<(b) ? (a) : (b))
 
+// Number of blocks backing a file of the given size.
+#define NBLOCKS(size) (((size) + BLOCK_SIZE - 1) / BLOCK_SIZE)
+
+static_assert(sizeof(inode_t) <= BLOCK_SIZE / IPB, "inode does not fit");
+
+// An extent tree block: a header followed by NPERBLOCK entries.
+union tree_block {
+  char raw[BLOCK_SIZE];
+  struct {
+    extent_header_t eh;
+    extent_t ent[NPERBLOCK];
+  } node;
+};
+
+// Find the disk block holding file block lblk. *run is set to the number
+// of contiguous blocks, lblk included, that follow it on disk.
+blockid_t
+inode_manager::map_block(inode_t *ino, uint32_t lblk, uint32_t *run)
+{
+  union tree_block tb;
+  extent_header_t *eh = &ino->eh;
+  extent_t *ent = ino->ext;
+
+  while (true) {
+    if (eh->nentries == 0) {
+      *run = 0;
+      return 0;
+    }
+    // last entry with ent[i].lblk <= lblk
+    int lo = 0, hi = eh->nentries - 1;
+    while (lo < hi) {
+      int mid = (lo + hi + 1) / 2;
+      if (ent[mid].lblk <= lblk)
+        lo = mid;
+      else
+        hi = mid - 1;
+    }
+    if (eh->depth == 0) {
+      extent_t &e = ent[lo];
+      if (lblk < e.lblk || lblk >= e.lblk + e.len) {
+        *run = 0;
+        return 0;
+      }
+      *run = e.len - (lblk - e.lblk);
+      return e.start + (lblk - e.lblk);
+    }
+    bm->read_block(ent[lo].start, tb.raw);
+    eh = &tb.node.eh;
+    ent = tb.node.ent;
+  }
+}
+
+// Build a path of depth interior nodes down to a leaf holding only e.
+// Returns the top block, or 0 if the disk is full.
 blockid_t
-inode_manager::get_nth_blockid(inode_t *ino, uint32_t num) {
-  blockid_t ret = 0;
-  if (num < NDIRECT)
-    ret = ino->blocks[num];
-  else {
-    char buf[BLOCK_SIZE];
-    bm->read_block(ino->blocks[NDIRECT], buf);
-    ret = ((blockid_t *) buf)[num - NDIRECT];
+inode_manager::new_branch(uint32_t depth, const extent_t &e)
+{
+  union tree_block tb;
+  blockid_t b = bm->alloc_block();
+  if (b == 0)
+    return 0;
+
+  bzero(&tb, sizeof(tb));
+  tb.node.eh.depth = depth;
+  tb.node.eh.nentries = 1;
+  tb.node.ent[0] = e;
+  if (depth > 0) {
+    tb.node.ent[0].len = 0;
+    tb.node.ent[0].start = new_branch(depth - 1, e);
+    if (tb.node.ent[0].start == 0) {
+      bm->free_block(b);
+      return 0;
+    }
+  }
+  bm->write_block(b, tb.raw);
+  return b;
+}
+
+// Append e behind the last extent of the subtree rooted at (eh, ent).
+// Files never have holes, so new extents only ever go to the right edge of
+// the tree. Returns false if the node has no room left.
+bool
+inode_manager::tail_insert(extent_header_t *eh, extent_t *ent, uint32_t cap,
+    const extent_t &e)
+{
+  if (eh->depth == 0) {
+    if (eh->nentries > 0) {
+      extent_t &last = ent[eh->nentries - 1];
+      if (last.start + last.len == e.start && last.lblk + last.len == e.lblk) {
+        last.len += e.len;
+        return true;
+      }
+    }
+    if (eh->nentries == cap)
+      return false;
+    ent[eh->nentries++] = e;
+    return true;
+  }
+
+  union tree_block tb;
+  blockid_t child = ent[eh->nentries - 1].start;
+  bm->read_block(child, tb.raw);
+  if (tail_insert(&tb.node.eh, tb.node.ent, NPERBLOCK, e)) {
+    bm->write_block(child, tb.raw);
+    return true;
+  }
+  if (eh->nentries == cap)
+    return false;
+  blockid_t b = new_branch(eh->depth - 1, e);
+  if (b == 0)
+    return false;
+  ent[eh->nentries].lblk = e.lblk;
+  ent[eh->nentries].start = b;
+  ent[eh->nentries].len = 0;
+  eh->nentries++;
+  return true;
+}
+
+bool
+inode_manager::add_extent(inode_t *ino, const extent_t &e)
+{
+  if (tail_insert(&ino->eh, ino->ext, NROOT, e))
+    return true;
+
+  // The root is full: move it into a new block and grow the tree a level.
+  union tree_block tb;
+  blockid_t b = bm->alloc_block();
+  if (b == 0)
+    return false;
+  bzero(&tb, sizeof(tb));
+  tb.node.eh = ino->eh;
+  memcpy(tb.node.ent, ino->ext, ino->eh.nentries * sizeof(extent_t));
+  bm->write_block(b, tb.raw);
+
+  ino->eh.depth++;
+  ino->eh.nentries = 1;
+  ino->ext[0].lblk = 0;
+  ino->ext[0].start = b;
+  ino->ext[0].len = 0;
+  return tail_insert(&ino->eh, ino->ext, NROOT, e);
+}
+
+// Allocate n more blocks for a file that currently has from blocks,
+// in as few runs as the allocator can find. Returns the number added.
+uint32_t
+inode_manager::grow_blocks(inode_t *ino, uint32_t from, uint32_t n)
+{
+  uint32_t added = 0;
+  blockid_t goal = 0;
+  uint32_t run;
+
+  if (from > 0)
+    goal = map_block(ino, from - 1, &run) + 1;
+  while (added < n) {
+    extent_t e;
+    uint32_t got;
+    e.start = bm->alloc_blocks(goal, n - added, &got);
+    if (e.start == 0)
+      break;
+    e.lblk = from + added;
+    e.len = got;
+    if (!add_extent(ino, e)) {
+      for (uint32_t i = 0; i < got; ++i)
+        bm->free_block(e.start + i);
+      break;
+    }
+    added += got;
+    goal = e.start + got;
   }
-  return ret;
+  if (added < n)
+    printf("ERROR: no more blocks, file truncated\n");
+  return added;
 }
 
+// Free every file block at or past n in the subtree rooted at (eh, ent),
+// together with the tree blocks that become empty.
 void
-inode_manager::alloc_nth_block(inode_t *ino, uint32_t num) {
-  if (num < NDIRECT) {
-    ino->blocks[num] = bm->alloc_block();
-  } else {
-    if (!ino->blocks[NDIRECT]) {
-      ino->blocks[NDIRECT] = bm->alloc_block();
+inode_manager::tail_truncate(extent_header_t *eh, extent_t *ent, uint32_t n)
+{
+  while (eh->nentries > 0) {
+    extent_t &last = ent[eh->nentries - 1];
+    if (eh->depth == 0) {
+      uint32_t keep = last.lblk >= n ? 0 : MIN(n - last.lblk, last.len);
+      for (uint32_t i = keep; i < last.len; ++i)
+        bm->free_block(last.start + i);
+      last.len = keep;
+      if (keep > 0)
+        return;
+      eh->nentries--;
+      continue;
+    }
+
+    union tree_block tb;
+    bm->read_block(last.start, tb.raw);
+    tail_truncate(&tb.node.eh, tb.node.ent, n);
+    if (tb.node.eh.nentries > 0) {
+      bm->write_block(last.start, tb.raw);
+      return;
+    }
+    bm->free_block(last.start);
+    eh->nentries--;
+  }
+}
+
+void
+inode_manager::truncate_blocks(inode_t *ino, uint32_t n)
+{
+  tail_truncate(&ino->eh, ino->ext, n);
+
+  // pull the only child back into the inode while it fits
+  while (ino->eh.depth > 0 && ino->eh.nentries <= 1) {
+    if (ino->eh.nentries == 0) {
+      ino->eh.depth = 0;
+      break;
+    }
+    union tree_block tb;
+    blockid_t child = ino->ext[0].start;
+    bm->read_block(child, tb.raw);
+    if (tb.node.eh.nentries > NROOT)
+      break;
+    ino->eh = tb.node.eh;
+    memcpy(ino->ext, tb.node.ent, tb.node.eh.nentries * sizeof(extent_t));
+    bm->free_block(child);
+  }
+}
+
+// Copy len bytes starting at byte off of the file into buf. Whole blocks
+// are copied an extent at a time; only the blocks at either end of the
+// range go through a bounce buffer.
+void
+inode_manager::copy_out(inode_t *ino, uint32_t off, uint32_t len, char *buf)
+{
+  char tmp[BLOCK_SIZE];
+  uint32_t end = off + len;
+  uint32_t run;
+
+  while (off < end) {
+    uint32_t lblk = off / BLOCK_SIZE, boff = off % BLOCK_SIZE;
+    blockid_t b = map_block(ino, lblk, &run);
+    if (boff == 0 && end - off >= BLOCK_SIZE) {
+      run = MIN(run, (end - off) / BLOCK_SIZE);
+      bm->read_blocks(b, run, buf);
+      buf += run * BLOCK_SIZE;
+      off += run * BLOCK_SIZE;
+    } else {
+      uint32_t n = MIN(BLOCK_SIZE - boff, end - off);
+      bm->read_block(b, tmp);
+      memcpy(buf, tmp + boff, n);
+      buf += n;
+      off += n;
+    }
+  }
+}
+
+// Copy len bytes from buf into the file at byte off; the blocks must
+// already be allocated. A NULL buf writes zeros.
+void
+inode_manager::copy_in(inode_t *ino, uint32_t off, uint32_t len, const char *buf)
+{
+  char tmp[BLOCK_SIZE];
+  uint32_t end = off + len;
+  uint32_t run;
+
+  while (off < end) {
+    uint32_t lblk = off / BLOCK_SIZE, boff = off % BLOCK_SIZE;
+    blockid_t b = map_block(ino, lblk, &run);
+    if (boff == 0 && end - off >= BLOCK_SIZE && buf) {
+      run = MIN(run, (end - off) / BLOCK_SIZE);
+      bm->write_blocks(b, run, buf);
+      buf += run * BLOCK_SIZE;
+      off += run * BLOCK_SIZE;
+    } else {
+      uint32_t n = MIN(BLOCK_SIZE - boff, end - off);
+      if (n < BLOCK_SIZE)
+        bm->read_block(b, tmp);
+      if (buf) {
+        memcpy(tmp + boff, buf, n);
+        buf += n;
+      } else {
+        bzero(tmp + boff, n);
+      }
+      bm->write_block(b, tmp);
+      off += n;
     }
-    char tmp[BLOCK_SIZE];
-    bm->read_block(ino->blocks[NDIRECT], tmp);
-    ((blockid_t *)tmp)[num - NDIRECT] = bm->alloc_block();
-    bm->write_block(ino->blocks[NDIRECT], tmp);
   }
 }
 
@@ -184,21 +775,10 @@ void
 inode_manager::read_file(uint32_t inum, char **buf_out, int *size)
 {
   inode_t * ino = get_inode(inum);
-  char buf[BLOCK_SIZE];
-  int i;
   if (ino) {
     *size = ino->size;
     *buf_out = (char *) malloc(ino->size);
-    int block_num = ino->size / BLOCK_SIZE;
-    int remain_num = ino->size % BLOCK_SIZE;
-    for (i=0; i<block_num; ++i) {
-      bm->read_block(get_nth_blockid(ino, i), buf);
-      memcpy(*buf_out + i*BLOCK_SIZE, buf, BLOCK_SIZE);
-    }
-    if (remain_num != 0) {
-      bm->read_block(get_nth_blockid(ino, i), buf);
-      memcpy(*buf_out + i*BLOCK_SIZE, buf, remain_num);
-    }
+    copy_out(ino, 0, ino->size, *buf_out);
     free(ino);
   }
 }
@@ -207,30 +787,21 @@ void
 inode_manager::write_file(uint32_t inum, const char *buf, int size)
 {
   inode_t * ino = get_inode(inum);
-  int i;
   if (ino) {
-    int old_num = 0, new_num = 0;
-    if (ino->size != 0)
-      old_num = (ino->size - 1) / BLOCK_SIZE + 1;
-    if (size != 0)
-      new_num = (size - 1) / BLOCK_SIZE + 1;
+    uint32_t old_num = NBLOCKS(ino->size);
+    uint32_t new_num = NBLOCKS((uint32_t) size);
     if (old_num < new_num) {
-      for (int j=old_num; j<new_num; ++j)
-        alloc_nth_block(ino, j);
+      uint32_t added = grow_blocks(ino, old_num, new_num - old_num);
+      if (added < new_num - old_num) {
+        new_num = old_num + added;
+        size = new_num * BLOCK_SIZE;
+      }
     } else if (old_num > new_num) {
-      for (int j=new_num; j<old_num; ++j)
-        bm->free_block(get_nth_blockid(ino, j));
-    }
-    int block_num = size / BLOCK_SIZE;
-    int remain_num = size % BLOCK_SIZE;
-    for (i=0; i<block_num; ++i)
-      bm->write_block(get_nth_blockid(ino, i), buf + i*BLOCK_SIZE);
-    if (remain_num != 0) {
-      char tmp[BLOCK_SIZE];
-      memcpy(tmp, buf + i*BLOCK_SIZE, remain_num);
-      bm->write_block(get_nth_blockid(ino, i), tmp);
+      truncate_blocks(ino, new_num);
     }
+    copy_in(ino, 0, size, buf);
     ino->size = size;
+    ino->version++;
     ino->atime = (unsigned int) time(NULL);
     ino->mtime = (unsigned int) time(NULL);
     ino->ctime = (unsigned int) time(NULL);
@@ -239,6 +810,55 @@ inode_manager::write_file(uint32_t inum, const char *buf, int size)
   }
 }
 
+// Read at most len bytes at byte off; reads past the end of the file are
+// cut short.
+void
+inode_manager::read_file_range(uint32_t inum, uint32_t off, uint32_t len,
+    char **buf_out, int *size)
+{
+  inode_t * ino = get_inode(inum);
+  *size = 0;
+  if (ino) {
+    if (off < ino->size) {
+      *size = MIN(len, ino->size - off);
+      *buf_out = (char *) malloc(*size);
+      copy_out(ino, off, *size, *buf_out);
+    }
+    free(ino);
+  }
+}
+
+// Write size bytes at byte off, growing the file as needed. A gap between
+// the old end of file and off reads back as zeros. Only the blocks covered
+// by the range are touched.
+void
+inode_manager::write_file_range(uint32_t inum, uint32_t off, const char *buf,
+    int size)
+{
+  inode_t * ino = get_inode(inum);
+  if (ino) {
+    uint32_t end = off + size;
+    uint32_t old_num = NBLOCKS(ino->size);
+    uint32_t new_num = NBLOCKS(end);
+    if (old_num < new_num) {
+      uint32_t added = grow_blocks(ino, old_num, new_num - old_num);
+      if (added < new_num - old_num)
+        end = MIN(end, (old_num + added) * BLOCK_SIZE);
+    }
+    if (off > ino->size)
+      copy_in(ino, ino->size, MIN(off, end) - ino->size, NULL);
+    if (off < end)
+      copy_in(ino, off, end - off, buf);
+    if (end > ino->size)
+      ino->size = end;
+    ino->version++;
+    ino->mtime = (unsigned int) time(NULL);
+    ino->ctime = (unsigned int) time(NULL);
+    put_inode(inum, ino);
+    free(ino);
+  }
+}
+
 void
 inode_manager::get_attr(uint32_t inum, extent_protocol::attr &a)
 {
@@ -249,6 +869,7 @@ inode_manager::get_attr(uint32_t inum, extent_protocol::attr &a)
   a.ctime = ino->ctime;
   a.type = ino->type;
   a.size = ino->size;
+  a.version = ino->version;
   free(ino);
 }
 
@@ -256,14 +877,364 @@ void
 inode_manager::remove_file(uint32_t inum)
 {
   inode_t * ino = get_inode(inum);
-  int block_num = 0;
-  if (ino->size != 0)
-    block_num = (ino->size - 1) / BLOCK_SIZE + 1;
-  for (int i=0; i<block_num; ++i)
-    bm->free_block(get_nth_blockid(ino, i));
-  if (block_num > NDIRECT)
-    bm->free_block(ino->blocks[NDIRECT]);
+  if (ino == NULL) return;
+  truncate_blocks(ino, 0);
+  put_inode(inum, ino);
 
   free_inode(inum);
   free(ino);
 }
+
+/* directory layer */
+
+static uint32_t
+dir_hash(const char *name)
+{
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (; *name; name++) {
+    h ^= (unsigned char) *name;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Reset the directory to a header plus nbuckets empty buckets.
+bool
+inode_manager::dir_init(inode_t *ino, dir_header_t *h, uint32_t nbuckets)
+{
+  uint32_t n = 1 + nbuckets;
+
+  truncate_blocks(ino, 0);
+  ino->size = 0;
+  if (grow_blocks(ino, 0, n) < n) {
+    truncate_blocks(ino, 0);
+    return false;
+  }
+  copy_in(ino, 0, n * BLOCK_SIZE, NULL);
+  ino->size = n * BLOCK_SIZE;
+
+  h->magic = DIR_MAGIC;
+  h->nbuckets = nbuckets;
+  h->nentries = 0;
+  h->nblocks = n;
+  return true;
+}
+
+// Read the header of a non-empty directory, failing if it is not one.
+bool
+inode_manager::dir_read_header(inode_t *ino, dir_header_t *h)
+{
+  copy_out(ino, 0, sizeof(*h), (char *) h);
+  if (h->magic != DIR_MAGIC || h->nbuckets == 0 ||
+      (h->nbuckets & (h->nbuckets - 1)) != 0) {
+    printf("\tim: bad directory header\n");
+    return false;
+  }
+  return true;
+}
+
+// Search name's bucket chain. On success *lblk and b hold the block with
+// the entry and *pos is its offset in b->data; otherwise they hold the
+// last block of the chain.
+bool
+inode_manager::dir_find(inode_t *ino, const dir_header_t *h, const char *name,
+    uint32_t *lblk, dir_block_t *b, uint32_t *pos)
+{
+  uint32_t len = strlen(name);
+
+  *lblk = 1 + (dir_hash(name) & (h->nbuckets - 1));
+  for (;;) {
+    copy_out(ino, *lblk * BLOCK_SIZE, BLOCK_SIZE, (char *) b);
+    for (uint32_t p = 0; p < b->used; ) {
+      uint8_t namelen = (uint8_t) b->data[p + sizeof(uint32_t)];
+      if (namelen == len && memcmp(b->data + p + DIRENT_HDR, name, len) == 0) {
+        *pos = p;
+        return true;
+      }
+      p += DIRENT_HDR + namelen;
+    }
+    if (b->next == 0)
+      return false;
+    *lblk = b->next;
+  }
+}
+
+// Append an entry to name's bucket, chaining a new overflow block when the
+// bucket is full. Does not check for duplicates or write the header.
+bool
+inode_manager::dir_add(inode_t *ino, dir_header_t *h, const char *name,
+    uint32_t inum)
+{
+  dir_block_t b;
+  uint32_t len = strlen(name);
+  uint32_t need = DIRENT_HDR + len;
+  uint32_t lblk = 1 + (dir_hash(name) & (h->nbuckets - 1));
+
+  for (;;) {
+    copy_out(ino, lblk * BLOCK_SIZE, BLOCK_SIZE, (char *) &b);
+    if (sizeof(b.data) - b.used >= need)
+      break;
+    if (b.next == 0) {
+      if (grow_blocks(ino, h->nblocks, 1) != 1)
+        return false;
+      b.next = h->nblocks++;
+      ino->size = h->nblocks * BLOCK_SIZE;
+      copy_in(ino, lblk * BLOCK_SIZE, BLOCK_SIZE, (char *) &b);
+      lblk = b.next;
+      bzero(&b, sizeof(b));
+      break;
+    }
+    lblk = b.next;
+  }
+
+  memcpy(b.data + b.used, &inum, sizeof(uint32_t));
+  b.data[b.used + sizeof(uint32_t)] = (char) len;
+  memcpy(b.data + b.used + DIRENT_HDR, name, len);
+  b.used += need;
+  b.count++;
+  copy_in(ino, lblk * BLOCK_SIZE, BLOCK_SIZE, (char *) &b);
+  h->nentries++;
+  return true;
+}
+
+// Rebuild the table with nbuckets buckets. The new table goes into blocks
+// of its own and replaces the old one only once every entry is in, so
+// if the disk can't hold it the directory is left as it was.
+bool
+inode_manager::dir_rehash(inode_t *ino, dir_header_t *h, uint32_t nbuckets)
+{
+  std::map<std::string, uint32_t> ents;
+  dir_header_t nh;
+  inode_t tmp;
+
+  dir_entries(ino, h, ents);
+  bzero(&tmp, sizeof(tmp));
+  if (!dir_init(&tmp, &nh, nbuckets))
+    return false;
+  for (std::map<std::string, uint32_t>::iterator it = ents.begin();
+       it != ents.end(); ++it) {
+    if (!dir_add(&tmp, &nh, it->first.c_str(), it->second)) {
+      truncate_blocks(&tmp, 0);
+      return false;
+    }
+  }
+
+  truncate_blocks(ino, 0);
+  ino->size = tmp.size;
+  ino->eh = tmp.eh;
+  memcpy(ino->ext, tmp.ext, sizeof(ino->ext));
+  *h = nh;
+  return true;
+}
+
+void
+inode_manager::dir_entries(inode_t *ino, const dir_header_t *h,
+    std::map<std::string, uint32_t> &ents)
+{
+  dir_block_t b;
+
+  for (uint32_t i = 1; i <= h->nbuckets; i++) {
+    uint32_t lblk = i;
+    do {
+      copy_out(ino, lblk * BLOCK_SIZE, BLOCK_SIZE, (char *) &b);
+      for (uint32_t p = 0; p < b.used; ) {
+        uint32_t inum;
+        uint8_t namelen = (uint8_t) b.data[p + sizeof(uint32_t)];
+        memcpy(&inum, b.data + p, sizeof(uint32_t));
+        ents[std::string(b.data + p + DIRENT_HDR, namelen)] = inum;
+        p += DIRENT_HDR + namelen;
+      }
+      lblk = b.next;
+    } while (lblk != 0);
+  }
+}
+
+int
+inode_manager::dir_lookup(uint32_t dir, const char *name, uint32_t *inum)
+{
+  dir_header_t h;
+  dir_block_t b;
+  uint32_t lblk, pos;
+  int r = extent_protocol::NOENT;
+
+  inode_t * ino = get_inode(dir);
+  if (ino == NULL)
+    return extent_protocol::NOENT;
+  if (ino->size > 0) {
+    if (!dir_read_header(ino, &h)) {
+      r = extent_protocol::IOERR;
+    } else if (dir_find(ino, &h, name, &lblk, &b, &pos)) {
+      memcpy(inum, b.data + pos, sizeof(uint32_t));
+      r = extent_protocol::OK;
+    }
+  }
+  free(ino);
+  return r;
+}
+
+int
+inode_manager::dir_insert(uint32_t dir, const char *name, uint32_t inum)
+{
+  dir_header_t h;
+  dir_block_t b;
+  uint32_t lblk, pos;
+  uint32_t len = strlen(name);
+
+  if (len == 0 || len > DIR_NAMELEN)
+    return extent_protocol::IOERR;
+  inode_t * ino = get_inode(dir);
+  if (ino == NULL)
+    return extent_protocol::NOENT;
+
+  if (ino->size == 0) {
+    if (!dir_init(ino, &h, 1)) {
+      put_inode(dir, ino);
+      free(ino);
+      return extent_protocol::IOERR;
+    }
+  } else {
+    if (!dir_read_header(ino, &h)) {
+      free(ino);
+      return extent_protocol::IOERR;
+    }
+    if (dir_find(ino, &h, name, &lblk, &b, &pos)) {
+      free(ino);
+      return extent_protocol::EXIST;
+    }
+  }
+
+  int r = extent_protocol::OK;
+  if (!dir_add(ino, &h, name, inum)) {
+    r = extent_protocol::IOERR;
+  } else if (h.nentries > h.nbuckets * DIR_LOAD) {
+    // if the disk can't hold the doubled table, the old one just gets
+    // longer chains until the next insert tries again
+    dir_rehash(ino, &h, h.nbuckets * 2);
+  }
+  copy_in(ino, 0, sizeof(h), (char *) &h);
+
+  ino->version++;
+  ino->mtime = (unsigned int) time(NULL);
+  ino->ctime = (unsigned int) time(NULL);
+  put_inode(dir, ino);
+  free(ino);
+  return r;
+}
+
+int
+inode_manager::dir_remove(uint32_t dir, const char *name, uint32_t *inum)
+{
+  dir_header_t h;
+  dir_block_t b;
+  uint32_t lblk, pos;
+
+  inode_t * ino = get_inode(dir);
+  if (ino == NULL)
+    return extent_protocol::NOENT;
+  if (ino->size == 0) {
+    free(ino);
+    return extent_protocol::NOENT;
+  }
+  if (!dir_read_header(ino, &h)) {
+    free(ino);
+    return extent_protocol::IOERR;
+  }
+  if (!dir_find(ino, &h, name, &lblk, &b, &pos)) {
+    free(ino);
+    return extent_protocol::NOENT;
+  }
+
+  uint32_t entlen = DIRENT_HDR + (uint8_t) b.data[pos + sizeof(uint32_t)];
+  memcpy(inum, b.data + pos, sizeof(uint32_t));
+  memmove(b.data + pos, b.data + pos + entlen, b.used - pos - entlen);
+  b.used -= entlen;
+  b.count--;
+  copy_in(ino, lblk * BLOCK_SIZE, BLOCK_SIZE, (char *) &b);
+
+  // overflow blocks stay chained until the directory empties or rehashes
+  if (--h.nentries == 0) {
+    truncate_blocks(ino, 0);
+    ino->size = 0;
+  } else {
+    copy_in(ino, 0, sizeof(h), (char *) &h);
+  }
+
+  ino->version++;
+  ino->mtime = (unsigned int) time(NULL);
+  ino->ctime = (unsigned int) time(NULL);
+  put_inode(dir, ino);
+  free(ino);
+  return extent_protocol::OK;
+}
+
+int
+inode_manager::dir_list(uint32_t dir, std::map<std::string, uint32_t> &ents)
+{
+  dir_header_t h;
+  int r = extent_protocol::OK;
+
+  inode_t * ino = get_inode(dir);
+  if (ino == NULL)
+    return extent_protocol::NOENT;
+  if (ino->size > 0) {
+    if (dir_read_header(ino, &h))
+      dir_entries(ino, &h, ents);
+    else
+      r = extent_protocol::IOERR;
+  }
+  free(ino);
+  return r;
+}
+
+#define SNAPSHOT_MAGIC 0x534e4843  // "CHNS"
+
+// inode_manager snapshot: {magic, inumber} followed by the disk snapshot.
+void
+inode_manager::snapshot(std::vector<char> &out)
+{
+  uint32_t hdr[2] = {SNAPSHOT_MAGIC, (uint32_t) inumber};
+
+  out.insert(out.end(), (char *) hdr, (char *) (hdr + 2));
+  bm->snapshot(out);
+}
+
+void
+inode_manager::freeze()
+{
+  frozen_inumber = inumber;
+  bm->freeze();
+}
+
+void
+inode_manager::snapshot_frozen(std::vector<char> &out)
+{
+  uint32_t hdr[2] = {SNAPSHOT_MAGIC, frozen_inumber};
+
+  out.insert(out.end(), (char *) hdr, (char *) (hdr + 2));
+  bm->snapshot_frozen(out);
+}
+
+void
+inode_manager::thaw()
+{
+  bm->thaw();
+}
+
+bool
+inode_manager::restore(const char *buf, uint32_t size)
+{
+  uint32_t hdr[2];
+
+  if (size < sizeof(hdr)) {
+    printf("\tim: snapshot too short\n");
+    return false;
+  }
+  memcpy(hdr, buf, sizeof(hdr));
+  if (hdr[0] != SNAPSHOT_MAGIC || hdr[1] >= INODE_NUM) {
+    printf("\tim: bad snapshot header\n");
+    return false;
+  }
+  inumber = hdr[1];
+  return bm->restore(buf + sizeof(hdr), size - sizeof(hdr));
+}
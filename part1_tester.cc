@@ -0,0 +1,569 @@
+// Unit tests for the inode layer. Run all of them, or name some:
+//   ./part1_tester [test ...]
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+#include "inode_manager.h"
+
+#define CHECK(cond, ...)                                                \
+  do {                                                                  \
+    if (!(cond)) {                                                      \
+      fprintf(stderr, "Check `%s` failed in %s:%d: ", #cond, __FILE__,  \
+              __LINE__);                                                \
+      fprintf(stderr, __VA_ARGS__);                                     \
+      fprintf(stderr, "\n");                                            \
+      exit(1);                                                          \
+    }                                                                   \
+  } while (0)
+
+// The first block after the superblock, bitmap and inode table.
+#define FIRST_DATA (IBLOCK(INODE_NUM, BLOCK_NUM) + 1)
+
+// block layer -----------------------------------------
+
+static bool
+block_used(block_manager *bm, blockid_t id)
+{
+  uint64_t map[BLOCK_SIZE / sizeof(uint64_t)];
+  uint32_t bit = id % BPB;
+
+  bm->read_block(BBLOCK(id), (char *) map);
+  return map[bit / 64] & ((uint64_t) 1 << (bit % 64));
+}
+
+// Blocks come out in order, and a freed block is not handed out again
+// until the search wraps around to it.
+static void
+test_alloc_next_fit()
+{
+  block_manager *bm = new block_manager();
+
+  blockid_t a = bm->alloc_block();
+  CHECK(a == FIRST_DATA, "first block %u, expected %u", a, FIRST_DATA);
+  blockid_t b = bm->alloc_block();
+  CHECK(b == a + 1, "second block %u, expected %u", b, a + 1);
+  CHECK(block_used(bm, a) && block_used(bm, b), "bits not set");
+
+  bm->free_block(a);
+  CHECK(!block_used(bm, a), "bit of freed block %u still set", a);
+  blockid_t c = bm->alloc_block();
+  CHECK(c == b + 1, "got %u after a free, expected next-fit %u", c, b + 1);
+  delete bm;
+}
+
+// Filling the disk hands out every data block once; afterwards only
+// freed blocks come back, wherever they are.
+static void
+test_alloc_full_disk()
+{
+  block_manager *bm = new block_manager();
+  blockid_t prev = 0;
+  uint32_t n = 0;
+  blockid_t id;
+
+  while ((id = bm->alloc_block()) != 0) {
+    CHECK(id > prev, "block %u after %u", id, prev);
+    prev = id;
+    n++;
+  }
+  CHECK(n == BLOCK_NUM - FIRST_DATA, "allocated %u blocks, expected %u",
+        n, BLOCK_NUM - FIRST_DATA);
+
+  std::set<blockid_t> freed = { FIRST_DATA + 5, 2 * BPB + 17, BLOCK_NUM - 1 };
+  for (blockid_t f : freed)
+    bm->free_block(f);
+  std::set<blockid_t> got;
+  for (size_t i = 0; i < freed.size(); i++)
+    got.insert(bm->alloc_block());
+  CHECK(got == freed, "did not get the freed blocks back");
+  CHECK(bm->alloc_block() == 0, "allocated from a full disk");
+  delete bm;
+}
+
+// A run starts at the goal when it is free, may cross bitmap words and
+// bitmap blocks, and stops at the first block in use.
+static void
+test_alloc_runs()
+{
+  block_manager *bm = new block_manager();
+  uint32_t got;
+
+  blockid_t s = bm->alloc_blocks(0, 300, &got);
+  CHECK(s == FIRST_DATA && got == 300, "run %u+%u", s, got);
+  for (blockid_t id = s; id < s + got; id++)
+    CHECK(block_used(bm, id), "block %u of the run is free", id);
+
+  bm->free_block(s + 100);
+  blockid_t t = bm->alloc_blocks(s + 100, 10, &got);
+  CHECK(t == s + 100 && got == 1, "run %u+%u at a one-block hole", t, got);
+
+  // the goal is in use: next-fit from the end of the last run
+  t = bm->alloc_blocks(s, 5, &got);
+  CHECK(t == s + 300 && got == 5, "run %u+%u for a used goal", t, got);
+
+  blockid_t goal = 2 * BPB - 70;
+  t = bm->alloc_blocks(goal, 200, &got);
+  CHECK(t == goal && got == 200, "run %u+%u across bitmap blocks", t, got);
+  for (blockid_t id = goal; id < goal + got; id++)
+    CHECK(block_used(bm, id), "block %u of the run is free", id);
+  CHECK(!block_used(bm, goal - 1) && !block_used(bm, goal + got),
+        "run spilled past its ends");
+
+  CHECK(bm->alloc_block() == goal + got, "cursor not past the last run");
+  delete bm;
+}
+
+// A restored block manager goes on allocating where the original would.
+static void
+test_alloc_restore()
+{
+  block_manager *bm = new block_manager();
+  uint32_t got;
+
+  bm->alloc_blocks(0, 1000, &got);
+  for (blockid_t id = FIRST_DATA; id < FIRST_DATA + 1000; id += 3)
+    bm->free_block(id);
+  bm->alloc_block();
+  std::vector<char> snap;
+  bm->snapshot(snap);
+
+  block_manager *copy = new block_manager();
+  CHECK(copy->restore(snap.data(), snap.size()), "restore failed");
+  for (int i = 0; i < 500; i++) {
+    blockid_t a = bm->alloc_block(), b = copy->alloc_block();
+    CHECK(a == b, "original allocated %u, restored copy %u", a, b);
+  }
+  delete bm;
+  delete copy;
+}
+
+// inode layer -----------------------------------------
+
+// The tests look at an inode_manager's disk directly.
+class part1_tester {
+ public:
+  static block_manager *disk(inode_manager *im) { return im->bm; }
+};
+
+static inode_t
+inode_of(inode_manager *im, uint32_t inum)
+{
+  char buf[BLOCK_SIZE];
+
+  part1_tester::disk(im)->read_block(IBLOCK(inum, BLOCK_NUM), buf);
+  return *(inode_t *) buf;
+}
+
+static uint32_t
+blocks_in_use(inode_manager *im)
+{
+  uint32_t n = 0;
+
+  for (blockid_t id = 0; id < BLOCK_NUM; id++)
+    n += block_used(part1_tester::disk(im), id);
+  return n;
+}
+
+// Block i of a test file is filled with a byte of its own.
+static void
+fill_block(char *buf, uint32_t inum, uint32_t i)
+{
+  memset(buf, (char) (inum * 31 + i * 7 + 1), BLOCK_SIZE);
+}
+
+static std::string
+file_data(uint32_t inum, uint32_t nblocks)
+{
+  std::string data(nblocks * BLOCK_SIZE, 0);
+
+  for (uint32_t i = 0; i < nblocks; i++)
+    fill_block(&data[i * BLOCK_SIZE], inum, i);
+  return data;
+}
+
+static void
+check_file(inode_manager *im, uint32_t inum, uint32_t nblocks)
+{
+  std::string want = file_data(inum, nblocks);
+  char *buf = NULL;
+  int size = 0;
+
+  im->read_file(inum, &buf, &size);
+  CHECK(size == (int) want.size(), "file %u has %d bytes, expected %zu",
+        inum, size, want.size());
+  for (uint32_t i = 0; i < nblocks; i++)
+    CHECK(memcmp(buf + i * BLOCK_SIZE, &want[i * BLOCK_SIZE], BLOCK_SIZE) == 0,
+          "block %u of file %u differs", i, inum);
+  free(buf);
+}
+
+// Grows two files a block at a time in turn, up to nblocks each. Each new
+// block lands next to the other file's, so it gets an extent of its own.
+static void
+grow_interleaved(inode_manager *im, uint32_t a, uint32_t b, uint32_t from,
+    uint32_t nblocks)
+{
+  std::string da = file_data(a, nblocks), db = file_data(b, nblocks);
+
+  for (uint32_t i = from + 1; i <= nblocks; i++) {
+    im->write_file(a, da.data(), i * BLOCK_SIZE);
+    im->write_file(b, db.data(), i * BLOCK_SIZE);
+  }
+}
+
+// Growing a file on a quiet disk extends its last extent.
+static void
+test_extent_merge()
+{
+  inode_manager *im = new inode_manager();
+  uint32_t inum = im->alloc_inode(extent_protocol::T_FILE);
+  uint32_t n = 3 * NROOT;
+  std::string data = file_data(inum, n);
+
+  for (uint32_t i = 1; i <= n; i++)
+    im->write_file(inum, data.data(), i * BLOCK_SIZE);
+  inode_t ino = inode_of(im, inum);
+  CHECK(ino.eh.depth == 0 && ino.eh.nentries == 1,
+        "depth %u, %u extents for one contiguous run", ino.eh.depth,
+        ino.eh.nentries);
+  CHECK(ino.ext[0].len == n, "extent of %u blocks", ino.ext[0].len);
+  check_file(im, inum, n);
+  delete im;
+}
+
+// The extent tree grows past the extents kept in the inode, then past
+// one level of tree blocks.
+static void
+test_extent_grow()
+{
+  inode_manager *im = new inode_manager();
+  uint32_t a = im->alloc_inode(extent_protocol::T_FILE);
+  uint32_t b = im->alloc_inode(extent_protocol::T_FILE);
+  uint32_t n = NROOT * NPERBLOCK + 1;
+
+  grow_interleaved(im, a, b, 0, NROOT);
+  inode_t ino = inode_of(im, a);
+  CHECK(ino.eh.depth == 0 && ino.eh.nentries == NROOT,
+        "depth %u, %u extents with a full inode", ino.eh.depth,
+        ino.eh.nentries);
+
+  grow_interleaved(im, a, b, NROOT, NROOT + 1);
+  ino = inode_of(im, a);
+  CHECK(ino.eh.depth == 1 && ino.eh.nentries == 1,
+        "depth %u, %u entries past NROOT extents", ino.eh.depth,
+        ino.eh.nentries);
+  check_file(im, a, NROOT + 1);
+
+  grow_interleaved(im, a, b, NROOT + 1, n);
+  ino = inode_of(im, a);
+  CHECK(ino.eh.depth == 2, "depth %u with %u extents", ino.eh.depth, n);
+  check_file(im, a, n);
+  check_file(im, b, n);
+
+  // a range spanning many extents, both ends partial
+  char *buf = NULL;
+  int size = 0;
+  uint32_t off = 100 * BLOCK_SIZE + 5;
+  std::string want = file_data(a, n);
+  im->read_file_range(a, off, 50 * BLOCK_SIZE, &buf, &size);
+  CHECK(size == 50 * BLOCK_SIZE && memcmp(buf, &want[off], size) == 0,
+        "range of %d bytes differs", size);
+  free(buf);
+  delete im;
+}
+
+// Shrinking frees the blocks past the new end and the tree blocks that
+// empty, and pulls the tree back into the inode once it fits.
+static void
+test_extent_truncate()
+{
+  inode_manager *im = new inode_manager();
+  uint32_t used = blocks_in_use(im);
+  uint32_t a = im->alloc_inode(extent_protocol::T_FILE);
+  uint32_t b = im->alloc_inode(extent_protocol::T_FILE);
+  uint32_t n = NROOT * NPERBLOCK + 1;
+
+  grow_interleaved(im, a, b, 0, n);
+  CHECK(inode_of(im, a).eh.depth == 2, "tree not two levels deep");
+
+  std::string data = file_data(a, n);
+  uint32_t size = (NROOT - 1) * BLOCK_SIZE + 7;
+  im->write_file(a, data.data(), size);
+  inode_t ino = inode_of(im, a);
+  CHECK(ino.eh.depth == 0 && ino.eh.nentries == NROOT,
+        "depth %u, %u extents after truncating to %zu blocks", ino.eh.depth,
+        ino.eh.nentries, NROOT);
+  CHECK(ino.size == size, "size %u", ino.size);
+
+  // what is left in use is a's blocks alone
+  im->remove_file(b);
+  CHECK(blocks_in_use(im) == used + NROOT, "blocks leaked by the truncate");
+
+  // cut a single extent in its middle
+  uint32_t c = im->alloc_inode(extent_protocol::T_FILE);
+  std::string cdata(100 * BLOCK_SIZE, 'c');
+  im->write_file(c, cdata.data(), cdata.size());
+  im->write_file(c, cdata.data(), 50 * BLOCK_SIZE + 1);
+  ino = inode_of(im, c);
+  CHECK(ino.eh.nentries == 1 && ino.ext[0].len == 51,
+        "%u extents, the last of %u blocks", ino.eh.nentries,
+        ino.ext[ino.eh.nentries - 1].len);
+
+  im->remove_file(a);
+  im->remove_file(c);
+  CHECK(blocks_in_use(im) == used, "blocks leaked removing everything");
+  delete im;
+}
+
+// directory layer -----------------------------------------
+
+static dir_header_t
+dir_header_of(inode_manager *im, uint32_t dir)
+{
+  dir_header_t h;
+  char *buf = NULL;
+  int size = 0;
+
+  im->read_file_range(dir, 0, sizeof(h), &buf, &size);
+  CHECK(size == sizeof(h), "directory %u has no header", dir);
+  memcpy(&h, buf, sizeof(h));
+  free(buf);
+  CHECK(h.magic == DIR_MAGIC, "bad directory magic %x", h.magic);
+  return h;
+}
+
+static std::string
+dir_name(uint32_t i, uint32_t len = 0)
+{
+  char buf[16];
+  snprintf(buf, sizeof(buf), "f%u", i);
+  std::string name(buf);
+  if (name.size() < len)
+    name.append(len - name.size(), 'x');
+  return name;
+}
+
+static void
+check_lookup(inode_manager *im, uint32_t dir, const std::string &name,
+    uint32_t want)
+{
+  uint32_t inum = 0;
+  int r = im->dir_lookup(dir, name.c_str(), &inum);
+  CHECK(r == extent_protocol::OK && inum == want, "lookup %s: %d, inum %u, "
+        "expected %u", name.c_str(), r, inum, want);
+}
+
+// The table doubles once there are more than DIR_LOAD entries per bucket,
+// and every entry stays reachable.
+static void
+test_dir_rehash()
+{
+  inode_manager *im = new inode_manager();
+  uint32_t dir = im->alloc_inode(extent_protocol::T_DIR);
+  uint32_t n = 1000;
+
+  for (uint32_t i = 0; i < DIR_LOAD; i++)
+    CHECK(im->dir_insert(dir, dir_name(i).c_str(), i + 2) ==
+          extent_protocol::OK, "insert %u", i);
+  dir_header_t h = dir_header_of(im, dir);
+  CHECK(h.nbuckets == 1 && h.nentries == DIR_LOAD, "%u buckets, %u entries",
+        h.nbuckets, h.nentries);
+  im->dir_insert(dir, dir_name(DIR_LOAD).c_str(), DIR_LOAD + 2);
+  h = dir_header_of(im, dir);
+  CHECK(h.nbuckets == 2, "%u buckets past the load factor", h.nbuckets);
+
+  for (uint32_t i = DIR_LOAD + 1; i < n; i++)
+    CHECK(im->dir_insert(dir, dir_name(i).c_str(), i + 2) ==
+          extent_protocol::OK, "insert %u", i);
+  h = dir_header_of(im, dir);
+  CHECK(h.nentries == n && h.nentries <= h.nbuckets * DIR_LOAD &&
+        h.nentries > h.nbuckets / 2 * DIR_LOAD, "%u buckets for %u entries",
+        h.nbuckets, h.nentries);
+
+  for (uint32_t i = 0; i < n; i++)
+    check_lookup(im, dir, dir_name(i), i + 2);
+  std::map<std::string, uint32_t> ents;
+  im->dir_list(dir, ents);
+  CHECK(ents.size() == n, "listed %zu entries", ents.size());
+  for (uint32_t i = 0; i < n; i++)
+    CHECK(ents[dir_name(i)] == i + 2, "listed %s wrong", dir_name(i).c_str());
+  delete im;
+}
+
+// Names that do not fit in their bucket chain overflow blocks at the end
+// of the directory file.
+static void
+test_dir_overflow()
+{
+  inode_manager *im = new inode_manager();
+  uint32_t dir = im->alloc_inode(extent_protocol::T_DIR);
+  uint32_t inum;
+
+  // one entry of the longest name per block
+  for (uint32_t i = 0; i < DIR_LOAD; i++)
+    CHECK(im->dir_insert(dir, dir_name(i, DIR_NAMELEN).c_str(), i + 2) ==
+          extent_protocol::OK, "insert %u", i);
+  dir_header_t h = dir_header_of(im, dir);
+  CHECK(h.nbuckets == 1 && h.nblocks == 1 + DIR_LOAD,
+        "%u buckets in %u blocks", h.nbuckets, h.nblocks);
+  extent_protocol::attr a;
+  im->get_attr(dir, a);
+  CHECK(a.size == h.nblocks * BLOCK_SIZE, "directory of %u bytes", a.size);
+  for (uint32_t i = 0; i < DIR_LOAD; i++)
+    check_lookup(im, dir, dir_name(i, DIR_NAMELEN), i + 2);
+
+  CHECK(im->dir_insert(dir, dir_name(3, DIR_NAMELEN).c_str(), 99) ==
+        extent_protocol::EXIST, "duplicate name inserted");
+  check_lookup(im, dir, dir_name(3, DIR_NAMELEN), 5);
+  CHECK(im->dir_insert(dir, dir_name(0, DIR_NAMELEN + 1).c_str(), 99) ==
+        extent_protocol::IOERR, "name longer than DIR_NAMELEN inserted");
+  CHECK(im->dir_insert(dir, "", 99) == extent_protocol::IOERR,
+        "empty name inserted");
+  CHECK(im->dir_lookup(dir, dir_name(DIR_LOAD, DIR_NAMELEN).c_str(), &inum) ==
+        extent_protocol::NOENT, "found a name never inserted");
+  delete im;
+}
+
+// Removing an entry leaves the rest of its chain in place, and removing
+// the last one frees the whole directory.
+static void
+test_dir_remove()
+{
+  inode_manager *im = new inode_manager();
+  uint32_t used = blocks_in_use(im);
+  uint32_t dir = im->alloc_inode(extent_protocol::T_DIR);
+  uint32_t n = 3 * DIR_LOAD;
+  uint32_t inum;
+
+  for (uint32_t i = 0; i < n; i++)
+    im->dir_insert(dir, dir_name(i, 100).c_str(), i + 2);
+
+  CHECK(im->dir_remove(dir, dir_name(7, 100).c_str(), &inum) ==
+        extent_protocol::OK && inum == 9, "remove returned inum %u", inum);
+  CHECK(im->dir_lookup(dir, dir_name(7, 100).c_str(), &inum) ==
+        extent_protocol::NOENT, "removed name still found");
+  CHECK(im->dir_remove(dir, dir_name(7, 100).c_str(), &inum) ==
+        extent_protocol::NOENT, "removed a name twice");
+  for (uint32_t i = 0; i < n; i++)
+    if (i != 7)
+      check_lookup(im, dir, dir_name(i, 100), i + 2);
+  CHECK(dir_header_of(im, dir).nentries == n - 1, "entry count not updated");
+
+  CHECK(im->dir_insert(dir, dir_name(7, 100).c_str(), 1000) ==
+        extent_protocol::OK, "cannot insert a removed name again");
+  check_lookup(im, dir, dir_name(7, 100), 1000);
+
+  for (uint32_t i = 0; i < n; i++)
+    CHECK(im->dir_remove(dir, dir_name(i, 100).c_str(), &inum) ==
+          extent_protocol::OK, "remove %u", i);
+  extent_protocol::attr a;
+  im->get_attr(dir, a);
+  CHECK(a.size == 0, "empty directory of %u bytes", a.size);
+  std::map<std::string, uint32_t> ents;
+  im->dir_list(dir, ents);
+  CHECK(ents.empty(), "empty directory lists %zu entries", ents.size());
+  CHECK(blocks_in_use(im) == used, "empty directory keeps blocks");
+  delete im;
+}
+
+// A rehash the disk can't hold leaves the old table, and the entry that
+// triggered it, in place.
+static void
+test_dir_rehash_full()
+{
+  inode_manager *im = new inode_manager();
+  block_manager *bm = part1_tester::disk(im);
+  uint32_t dir = im->alloc_inode(extent_protocol::T_DIR);
+
+  // one entry per block, and room left for just one more
+  for (uint32_t i = 0; i < DIR_LOAD; i++)
+    im->dir_insert(dir, dir_name(i, DIR_NAMELEN).c_str(), i + 2);
+  blockid_t id, last = 0;
+  while ((id = bm->alloc_block()) != 0)
+    last = id;
+  bm->free_block(last);
+
+  CHECK(im->dir_insert(dir, dir_name(DIR_LOAD, DIR_NAMELEN).c_str(),
+        DIR_LOAD + 2) == extent_protocol::OK, "insert into the last block");
+  dir_header_t h = dir_header_of(im, dir);
+  CHECK(h.nbuckets == 1 && h.nentries == DIR_LOAD + 1 &&
+        h.nblocks == DIR_LOAD + 2, "%u buckets, %u entries in %u blocks "
+        "after a failed rehash", h.nbuckets, h.nentries, h.nblocks);
+  for (uint32_t i = 0; i <= DIR_LOAD; i++)
+    check_lookup(im, dir, dir_name(i, DIR_NAMELEN), i + 2);
+  CHECK(bm->alloc_block() == 0, "a failed rehash leaked or freed blocks");
+  delete im;
+}
+
+// A directory whose header is not one fails with IOERR instead of being
+// walked.
+static void
+test_dir_bad_magic()
+{
+  inode_manager *im = new inode_manager();
+  uint32_t dir = im->alloc_inode(extent_protocol::T_DIR);
+  uint32_t inum;
+
+  im->dir_insert(dir, "a", 2);
+  dir_header_t h = dir_header_of(im, dir);
+  h.magic = ~DIR_MAGIC;
+  im->write_file_range(dir, 0, (const char *) &h, sizeof(h));
+
+  CHECK(im->dir_lookup(dir, "a", &inum) == extent_protocol::IOERR,
+        "lookup in a corrupt directory");
+  CHECK(im->dir_insert(dir, "b", 3) == extent_protocol::IOERR,
+        "insert into a corrupt directory");
+  CHECK(im->dir_remove(dir, "a", &inum) == extent_protocol::IOERR,
+        "remove from a corrupt directory");
+  std::map<std::string, uint32_t> ents;
+  CHECK(im->dir_list(dir, ents) == extent_protocol::IOERR && ents.empty(),
+        "listed a corrupt directory");
+  delete im;
+}
+
+// runner -----------------------------------------
+
+struct test {
+  const char *name;
+  void (*fn)();
+};
+
+static const test tests[] = {
+  { "alloc_next_fit", test_alloc_next_fit },
+  { "alloc_full_disk", test_alloc_full_disk },
+  { "alloc_runs", test_alloc_runs },
+  { "alloc_restore", test_alloc_restore },
+  { "extent_merge", test_extent_merge },
+  { "extent_grow", test_extent_grow },
+  { "extent_truncate", test_extent_truncate },
+  { "dir_rehash", test_dir_rehash },
+  { "dir_overflow", test_dir_overflow },
+  { "dir_remove", test_dir_remove },
+  { "dir_rehash_full", test_dir_rehash_full },
+  { "dir_bad_magic", test_dir_bad_magic },
+};
+
+int
+main(int argc, char *argv[])
+{
+  int run = 0;
+
+  for (const test &t : tests) {
+    bool want = argc == 1;
+    for (int i = 1; i < argc; i++)
+      want = want || strcmp(argv[i], t.name) == 0;
+    if (!want)
+      continue;
+    printf("Test (%s)\n", t.name);
+    t.fn();
+    printf("Pass (%s)\n", t.name);
+    run++;
+  }
+  printf("Pass %d/%d tests\n", run, run);
+  return 0;
+}
@@ -3,6 +3,7 @@
 
 #include <atomic>
 #include <mutex>
+#include <condition_variable>
 #include <chrono>
 #include <thread>
 #include <ctime>
@@ -12,6 +13,7 @@
 #include <time.h> 
 #include <set>
 #include <vector>
+#include <deque>
 
 #include "rpc.h"
 #include "raft_storage.h"
@@ -21,7 +23,7 @@
 template<typename command>
 class log_with_snapshot {
 private:
-    std::vector<log_entry<command>> in_mem_log;
+    std::deque<log_entry<command>> in_mem_log;
     size_t start_idx;
     raft_storage<command> *storage;
     log_entry<command> last_included;
@@ -55,37 +57,46 @@ public:
         return in_mem_log.size() + start_idx;
     }
 
-    void append(log_entry<command> &entry) {
+    // The update methods return the WAL position to storage->sync() on
+    // before the change may be acknowledged.
+    size_t append(log_entry<command> &entry) {
         in_mem_log.push_back(entry);
-        storage->append_log(in_mem_log.size(), entry);
+        return storage->append_log(size() - 1, entry);
     }
 
     std::vector<log_entry<command>> sub_vector(size_t start) {
-        assert(start >= start_idx);
-        auto start_iter = in_mem_log.end();
-        start_iter -= (in_mem_log.size() + start_idx - start);
-        return std::vector<log_entry<command>>(start_iter, in_mem_log.end());
+        return sub_vector(start, size());
+    }
+
+    // entries [start, end)
+    std::vector<log_entry<command>> sub_vector(size_t start, size_t end) {
+        assert(start >= start_idx && end <= size());
+        auto start_iter = in_mem_log.begin() + (start - start_idx);
+        auto end_iter = in_mem_log.begin() + (end - start_idx);
+        return std::vector<log_entry<command>>(start_iter, end_iter);
     }
 
-    void delete_after(size_t start) {
+    size_t delete_after(size_t start) {
         assert(start >= start_idx);
         auto start_iter = in_mem_log.begin();
         start_iter += (start - start_idx);
         in_mem_log.erase(start_iter, in_mem_log.end());
-        storage->persist_log(start_idx, last_included.term, in_mem_log);
+        return storage->truncate_log(start);
     }
 
-    void append(const std::vector<log_entry<command>> &entries) {
+    size_t append(const std::vector<log_entry<command>> &entries) {
+        size_t idx = size();
         in_mem_log.insert(in_mem_log.end(), entries.begin(), entries.end());
-        storage->persist_log(start_idx, last_included.term, in_mem_log);
+        return storage->append_log(idx, entries);
     }
 
     void snapshot(int last_idx, int last_term) {
         if (in_mem_log.size() + start_idx - 1 > (size_t)last_idx) {
-            in_mem_log = sub_vector(last_idx + 1);
+            assert((size_t) last_idx + 1 >= start_idx);
+            in_mem_log.erase(in_mem_log.begin(), in_mem_log.begin() + (last_idx + 1 - start_idx));
             last_included.term = last_term;
             start_idx = last_idx + 1;
-            storage->persist_log(start_idx, last_term, in_mem_log);
+            storage->compact_log(start_idx, last_term);
         } else {
             clean_snapshot(last_idx, last_term);
         }
@@ -95,7 +106,7 @@ public:
         in_mem_log.clear();
         last_included.term = last_term;
         start_idx = last_idx + 1;
-        storage->persist_log(start_idx, last_term, in_mem_log);
+        storage->reset_log(start_idx, last_term);
     }
 };
 
@@ -148,9 +159,39 @@ public:
     // returns whether this node is the leader, you should also set the current term;
     bool is_leader(int &term);
 
-    // save a snapshot of the state machine and compact the log.
+    // Save a snapshot of the state machine and compact the log. The state
+    // is frozen at once, but serializing and storing it happen on a
+    // background thread, so this returns before the log is compacted.
     bool save_snapshot();
 
+    // Snapshot automatically once this many applied entries have piled up
+    // in the log since the last snapshot. 0 (the default) never does.
+    void set_snapshot_threshold(int entries);
+
+    // ReadIndex: confirm with a quorum that this node is still the leader,
+    // then wait until the state machine has applied everything that was
+    // committed when the call was made. Returns false if leadership can't
+    // be confirmed; the caller should then go through the log instead.
+    bool read_index(int &term, int &index);
+
+    // The node this one last heard from as leader of its current term, or
+    // -1 if none yet. Where to retry after new_command fails here.
+    int leader_hint();
+
+    enum entry_status {
+        entry_committed,
+        entry_lost,     // this node's log dropped it for a newer leader's
+        entry_pending   // still undecided at the deadline
+    };
+
+    // Waits for the entry new_command put at (index, term) to commit, or
+    // to be dropped from this node's log. A dropped entry can in rare
+    // cases still be committed by a later leader that holds a copy.
+    // While this node's log still holds the entry, entry is set to its
+    // copy of the command, the one this node's state machine applies.
+    entry_status wait_committed(int index, int term, std::chrono::system_clock::time_point deadline,
+                                std::shared_ptr<command> *entry = nullptr);
+
 private:
     std::mutex mtx;                     // A big lock to protect the whole data structure
     ThrPool* thread_pool;
@@ -169,14 +210,17 @@ private:
         leader
     };
     raft_role role;
+    int leader_id;                  // leader of current_term if known, else -1
 
     std::thread* background_election;
     std::thread* background_ping;
     std::thread* background_commit;
     std::thread* background_apply;
+    std::thread* background_snapshot;
 
     int heartbeat_timeout;
     int election_timeout;
+    int snapshot_threshold;
 
     // persistent states
     // current candidate it is voting for, -1 means null
@@ -187,6 +231,12 @@ private:
     // violate states
     int commit_idx;
     int last_applied;
+    // The apply thread runs committed entries through the state machine
+    // outside mtx, up to max_apply_batch at a time. Anyone else touching
+    // the state machine waits for applying to clear first.
+    bool applying;
+    std::condition_variable apply_idle_cv;
+    static const int max_apply_batch = 1024;
     std::set<int> vote_for_me;
     // confirmed_sets confirm_append;
     std::chrono::system_clock::time_point last_received_heartbeat_time;
@@ -195,6 +245,38 @@ private:
     // violate states for leader
     std::vector<int> next_idx;
     std::vector<int> match_idx;
+    // Replication is pipelined: next_idx moves past a batch as soon as it
+    // is sent, and up to max_in_flight batches of at most max_batch_bytes
+    // may be unanswered per peer. A rejection or a lost RPC resets the
+    // peer's pipeline; replies sent under an older epoch no longer count
+    // against the window.
+    std::vector<int> in_flight;
+    std::vector<int> repl_epoch;
+    std::vector<int> window_start;      // where the current epoch began sending
+    std::vector<std::chrono::system_clock::time_point> last_progress;
+    static const int max_in_flight = 4;
+    static const size_t max_batch_bytes = 256 << 10;
+    // ReadIndex confirms leadership in heartbeat rounds. Every
+    // AppendEntries carries the round in progress when it was sent;
+    // acked_round is the latest round each peer acknowledged this term.
+    // A round is in flight until a quorum acknowledges it, and read_wanted
+    // is the latest round a reader waits for.
+    std::vector<int> acked_round;
+    int read_round;
+    int read_wanted;
+    // a snapshot is streaming to this peer; at most one chunk is in flight
+    std::vector<bool> snapshot_sending;
+    static const size_t snapshot_chunk_bytes = 256 << 10;
+    std::condition_variable read_cv;    // signalled on acks, applies and truncations
+    std::condition_variable replicate_cv; // new entries to send
+    std::condition_variable apply_cv;   // commit_idx moved
+
+    // the frozen view background_snapshot is to store, if any
+    std::unique_ptr<raft_snapshot_view> pending_view;
+    int pending_idx;
+    int pending_term;
+    bool snapshot_busy;                 // a snapshot is pending or being stored
+    std::condition_variable snapshot_cv;
 
 private:
     // RPC handlers
@@ -208,11 +290,18 @@ private:
     void send_request_vote(int target, request_vote_args arg);
     void handle_request_vote_reply(int target, const request_vote_args& arg, const request_vote_reply& reply);
 
-    void send_append_entries(int target, append_entries_args<command> arg);
-    void handle_append_entries_reply(int target, const append_entries_args<command>& arg, const append_entries_reply& reply);
+    void send_append_entries(int target, append_entries_args<command> arg, int epoch, int round);
+    void handle_append_entries_reply(int target, const append_entries_args<command>& arg, const append_entries_reply& reply, int epoch);
+    void replicate(int target, bool heartbeat);
+    void reset_pipeline(int target, int n_idx);
+
+    void record_ack(int target, int term, int round);
 
     void send_install_snapshot(int target, install_snapshot_args arg);
-    void handle_install_snapshot_reply(int target, const install_snapshot_args& arg, const install_snapshot_reply& reply);
+    bool handle_install_snapshot_reply(int target, install_snapshot_args& arg, const install_snapshot_reply& reply);
+    void start_snapshot_transfer(int target);
+    bool begin_snapshot();
+    void wait_apply_idle(std::unique_lock<std::mutex> &lock);
 
 private:
     bool is_stopped();
@@ -223,6 +312,13 @@ private:
     void run_background_election();
     void run_background_commit();
     void run_background_apply();
+    void run_background_snapshot();
+
+    void broadcast_append_entries();
+    void advance_commit_idx();
+    void set_commit_idx(int idx);
+    int quorum_round();
+    void start_read_round();
 
     void set_current_term(int);
     void set_vote_for(int);
@@ -237,18 +333,33 @@ raft<state_machine, command>::raft(rpcs* server, std::vector<rpcc*> clients, int
     my_id(idx),
     stopped(false),
     role(follower),
+    leader_id(-1),
     background_election(nullptr),
     background_ping(nullptr),
     background_commit(nullptr),
     background_apply(nullptr),
+    background_snapshot(nullptr),
     heartbeat_timeout(500),
+    snapshot_threshold(0),
     vote_for(-1),
     current_term(0),
     log(storage),
     commit_idx(0),
     last_applied(0),
+    applying(false),
     next_idx(clients.size(), 1),
-    match_idx(clients.size(), 0)
+    match_idx(clients.size(), 0),
+    in_flight(clients.size(), 0),
+    repl_epoch(clients.size(), 0),
+    window_start(clients.size(), 1),
+    last_progress(clients.size()),
+    acked_round(clients.size(), 0),
+    read_round(0),
+    read_wanted(0),
+    snapshot_sending(clients.size(), false),
+    pending_idx(0),
+    pending_term(0),
+    snapshot_busy(false)
 {
     thread_pool = new ThrPool(32);
 
@@ -262,12 +373,21 @@ raft<state_machine, command>::raft(rpcs* server, std::vector<rpcc*> clients, int
     current_term = storage->read_current_term();
     vote_for = storage->read_vote_for();
 
+    int snapshot_idx, snapshot_term;
     std::vector<char> snapshot_data;
-    storage->read_snapshot(snapshot_data);
+    storage->read_snapshot(snapshot_idx, snapshot_term, snapshot_data);
 
     if (snapshot_data.size() > 0) {
         state->apply_snapshot(snapshot_data);
     }
+    // the snapshot is stored before the log is compacted; finish the
+    // compaction if we crashed in between
+    if (snapshot_idx > log.get_last_included_idx()) {
+        log.snapshot(snapshot_idx, snapshot_term);
+    }
+    // everything the snapshot covers was committed and is now applied;
+    // the log no longer holds those entries to start from 0
+    commit_idx = last_applied = std::max(0, log.get_last_included_idx());
 
     // generate seperately between 300 to 500
     election_timeout = 300 + (200 / rpc_clients.size()) * my_id;
@@ -288,6 +408,9 @@ raft<state_machine, command>::~raft() {
     if (background_apply) {
         delete background_apply;
     }
+    if (background_snapshot) {
+        delete background_snapshot;
+    }
     delete thread_pool;
 }
 
@@ -300,10 +423,17 @@ raft<state_machine, command>::~raft() {
 template <typename state_machine, typename command>
 void raft<state_machine, command>::stop() {
     stopped.store(true);
+    mtx.lock();
+    replicate_cv.notify_all();
+    apply_cv.notify_all();
+    snapshot_cv.notify_all();
+    read_cv.notify_all();
+    mtx.unlock();
     background_ping->join();
     background_election->join();
     background_commit->join();
     background_apply->join();
+    background_snapshot->join();
     thread_pool->destroy();
 }
 
@@ -321,6 +451,38 @@ bool raft<state_machine, command>::is_leader(int &term) {
     return is_leader;
 }
 
+template <typename state_machine, typename command>
+int raft<state_machine, command>::leader_hint() {
+    std::unique_lock<std::mutex> lock(mtx);
+    return leader_id;
+}
+
+template <typename state_machine, typename command>
+typename raft<state_machine, command>::entry_status
+raft<state_machine, command>::wait_committed(int index, int term, std::chrono::system_clock::time_point deadline,
+                                             std::shared_ptr<command> *entry) {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (!is_stopped()) {
+        // only committed entries are compacted
+        if (index <= log.get_last_included_idx()) {
+            return entry_committed;
+        }
+        if (index >= (int) log.size() || log[index].term != term) {
+            return entry_lost;
+        }
+        if (entry) {
+            *entry = log[index].cmd;
+        }
+        if (commit_idx >= index) {
+            return entry_committed;
+        }
+        if (read_cv.wait_until(lock, deadline) == std::cv_status::timeout) {
+            break;
+        }
+    }
+    return entry_pending;
+}
+
 template<typename state_machine, typename command>
 void raft<state_machine, command>::start() {
     last_received_heartbeat_time = std::chrono::system_clock::now();
@@ -329,6 +491,7 @@ void raft<state_machine, command>::start() {
     this->background_ping = new std::thread(&raft::run_background_ping, this);
     this->background_commit = new std::thread(&raft::run_background_commit, this);
     this->background_apply = new std::thread(&raft::run_background_apply, this);
+    this->background_snapshot = new std::thread(&raft::run_background_snapshot, this);
 }
 
 template<typename state_machine, typename command>
@@ -344,10 +507,21 @@ bool raft<state_machine, command>::new_command(command cmd, int &term, int &inde
     int entry_idx = log.size();
     RAFT_LOG("log[%d] is appended", entry_idx);
 
-    log_entry<command> entry(current_term, cmd);
-    log.append(entry);
-    match_idx[my_id] = entry_idx;
+    log_entry<command> entry(current_term, std::move(cmd));
+    size_t pos = log.append(entry);
     index = entry_idx;
+    replicate_cv.notify_one();
+    mtx.unlock();
+
+    // Followers replicate while we wait; concurrent proposals share one
+    // fdatasync. The leader counts itself only once the entry is durable.
+    storage->sync(pos);
+
+    mtx.lock();
+    if (role == raft_role::leader && current_term == term) {
+        match_idx[my_id] = std::max(match_idx[my_id], entry_idx);
+        advance_commit_idx();   // a single node is its own majority
+    }
     mtx.unlock();
 
     return true;
@@ -355,36 +529,82 @@ bool raft<state_machine, command>::new_command(command cmd, int &term, int &inde
 
 template <typename state_machine, typename command>
 bool raft<state_machine, command>::save_snapshot() {
-    int server_number = rpc_clients.size();
-
-    mtx.lock();
-    
-    int last_included_idx = last_applied;
-    int last_included_term = log[last_included_idx].term;
-    RAFT_LOG("last_included_idx: %d, last_included_term: %d", last_included_idx, last_included_term);
-
-    std::vector<char> snapshot_data = state->snapshot();
-    log.snapshot(last_included_idx, last_included_term);
-
-    if (role == raft_role::leader) {
-        install_snapshot_args snapshot_args(current_term, my_id, last_included_idx, last_included_term, snapshot_data);
-        install_snapshot_args simple_args(current_term, my_id, last_included_idx, last_included_term);
-
-        for (int i = 0; i < server_number; ++i) {
-            if (i != my_id) {
-                if (match_idx[i] >= last_included_idx) {
-                    thread_pool->addObjJob(this, &raft::send_install_snapshot, i, simple_args);
-                } else {
-                    thread_pool->addObjJob(this, &raft::send_install_snapshot, i, snapshot_args);
-                }
-            }
+    std::unique_lock<std::mutex> lock(mtx);
+    // one snapshot at a time, taken between apply batches
+    do {
+        snapshot_cv.wait(lock, [this] { return is_stopped() || !snapshot_busy; });
+        if (is_stopped()) {
+            return false;
         }
+        wait_apply_idle(lock);
+    } while (snapshot_busy);
+    return begin_snapshot();
+}
+
+template <typename state_machine, typename command>
+void raft<state_machine, command>::wait_apply_idle(std::unique_lock<std::mutex> &lock) {
+    apply_idle_cv.wait(lock, [this] { return !applying; });
+}
+
+// Freezes the state machine at last_applied and hands the view to the
+// snapshot thread. Must be called with mtx held, no snapshot busy and no
+// apply batch running.
+template <typename state_machine, typename command>
+bool raft<state_machine, command>::begin_snapshot() {
+    pending_idx = last_applied;
+    pending_term = log[last_applied].term;
+    RAFT_LOG("last_included_idx: %d, last_included_term: %d", pending_idx, pending_term);
+
+    pending_view = state->snapshot_view();
+    snapshot_busy = true;
+    snapshot_cv.notify_all();
+    return true;
+}
+
+template <typename state_machine, typename command>
+void raft<state_machine, command>::set_snapshot_threshold(int entries) {
+    std::lock_guard<std::mutex> lock(mtx);
+    snapshot_threshold = entries;
+}
+
+template <typename state_machine, typename command>
+bool raft<state_machine, command>::read_index(int &term, int &index) {
+    std::unique_lock<std::mutex> lock(mtx);
+    term = current_term;
+
+    // Until it commits an entry of its own term a new leader may not know
+    // the true commit index.
+    if (role != raft_role::leader || log[commit_idx].term != current_term) {
+        return false;
     }
 
-    mtx.unlock();
+    int read_idx = commit_idx;
+    std::chrono::system_clock::time_point deadline =
+        std::chrono::system_clock::now() + std::chrono::milliseconds(heartbeat_timeout);
+
+    // Only a round started after this call proves we still lead. If one
+    // is in flight, it may have gone out before read_idx was taken, so
+    // wait for the next; record_ack starts it once this one completes.
+    // Every read arriving meanwhile shares it.
+    int round = read_round + 1;
+    if (quorum_round() == read_round) {
+        start_read_round();
+    }
+    read_wanted = std::max(read_wanted, round);
+    while (quorum_round() < round) {
+        if (read_cv.wait_until(lock, deadline) == std::cv_status::timeout
+            || role != raft_role::leader || current_term != term) {
+            return false;
+        }
+    }
 
-    storage->persist_snapshot(snapshot_data);
+    while (last_applied < read_idx) {
+        if (read_cv.wait_until(lock, deadline) == std::cv_status::timeout) {
+            return false;
+        }
+    }
 
+    index = read_idx;
     return true;
 }
 
@@ -461,9 +681,16 @@ void raft<state_machine, command>::handle_request_vote_reply(int target, const r
         vote_for_me.insert(target);
         if (vote_for_me.size() > rpc_clients.size() / 2) {
             role = raft_role::leader;
+            leader_id = my_id;
             int n_idx = log.size();
             fill(next_idx.begin(), next_idx.end(), n_idx);
             fill(match_idx.begin(), match_idx.end(), 0);
+            for (int i = 0; i < (int) rpc_clients.size(); ++i) {
+                reset_pipeline(i, n_idx);
+            }
+            fill(acked_round.begin(), acked_round.end(), 0);
+            read_round = 0;
+            read_wanted = 0;
         }
     }
     mtx.unlock();
@@ -484,7 +711,6 @@ int raft<state_machine, command>::append_entries(append_entries_args<command> ar
     last_received_heartbeat_time = std::chrono::system_clock::now();
     if (arg.leader_id != my_id) {
         role = raft_role::follower;
-        set_vote_for(-1);
     }
 
     if (arg.term > current_term) {
@@ -492,6 +718,7 @@ int raft<state_machine, command>::append_entries(append_entries_args<command> ar
         role = raft_role::follower;
         set_vote_for(-1);
     }
+    leader_id = arg.leader_id;
 
     if (arg.prev_log_idx > int(log.size() - 1)) {
         mtx.unlock();
@@ -499,144 +726,194 @@ int raft<state_machine, command>::append_entries(append_entries_args<command> ar
         return 0;
     }
 
+    // Entries up to our snapshot are committed and so match the leader's;
+    // a batch the leader rewound to before them starts at the snapshot.
+    int last_included_idx = log.get_last_included_idx();
+    if (arg.prev_log_idx < last_included_idx) {
+        size_t skip = std::min((size_t) (last_included_idx - arg.prev_log_idx), arg.entries.size());
+        arg.entries.erase(arg.entries.begin(), arg.entries.begin() + skip);
+        arg.prev_log_idx = last_included_idx;
+        arg.prev_log_term = log.get_last_included_term();
+    }
+
     if (log[arg.prev_log_idx].term != arg.prev_log_term) {
         log.delete_after(arg.prev_log_idx);
+        read_cv.notify_all();   // for wait_committed
+        // nothing is acknowledged, so no need to wait for the disk
         mtx.unlock();
         reply.success = false;
         return 0;
     }
 
-    log.delete_after(arg.prev_log_idx + 1);
-
-    if (!arg.entries.empty()) {
-        log.append(arg.entries);
+    // Skip entries we already hold and truncate only at the first real
+    // conflict, so a stale AppendEntries arriving late can't shorten a log
+    // that a newer one already extended.
+    size_t i = 0, pos = 0;
+    for (; i < arg.entries.size() && arg.prev_log_idx + 1 + i < log.size(); ++i) {
+        if (log[arg.prev_log_idx + 1 + i].term != arg.entries[i].term) {
+            log.delete_after(arg.prev_log_idx + 1 + i);
+            read_cv.notify_all();
+            break;
+        }
+    }
+    if (i < arg.entries.size()) {
+        pos = log.append(std::vector<log_entry<command>>(arg.entries.begin() + i, arg.entries.end()));
     }
 
-    commit_idx = arg.leader_commit > commit_idx ? arg.leader_commit : commit_idx;
+    set_commit_idx(std::min(arg.leader_commit, arg.prev_log_idx + (int) arg.entries.size()));
     mtx.unlock();
+
+    // the leader may count these entries only once they are on our disk
+    storage->sync(pos);
     reply.success = true;
 
     return 0;
 }
 
 template<typename state_machine, typename command>
-void raft<state_machine, command>::handle_append_entries_reply(int target, const append_entries_args<command>& arg, const append_entries_reply& reply) {
-    if (reply.success) {
-        mtx.lock();
-        match_idx[target] = arg.prev_log_idx + arg.entries.size();
-        next_idx[target] = match_idx[target] + 1;
-        mtx.unlock();
-    } else {
-        mtx.lock();
-        if (reply.term > arg.term) {
-            if (reply.term > current_term) {
-                set_current_term(reply.term);
-            }
-            last_received_heartbeat_time = std::chrono::system_clock::now();
-            role = raft_role::follower;
+void raft<state_machine, command>::handle_append_entries_reply(int target, const append_entries_args<command>& arg, const append_entries_reply& reply, int epoch) {
+    mtx.lock();
+    if (reply.term > arg.term) {
+        if (reply.term > current_term) {
+            set_current_term(reply.term);
             set_vote_for(-1);
-            mtx.unlock();
-            return;
         }
-
-        int last_log_idx = log.size() - 1;
-        int n_idx = next_idx[target] > 1 ? next_idx[target] - 1 : 1;
-        int prev_log_idx = n_idx - 1;
-        int last_included_idx = log.get_last_included_idx();
-        if (prev_log_idx < last_included_idx) {
-            std::vector<char> snapshot_data;
-            storage->read_snapshot(snapshot_data);
-            install_snapshot_args snapshot_args(current_term, my_id, last_included_idx, log.get_last_included_term(), snapshot_data);
-            mtx.unlock();
-            send_install_snapshot(target, snapshot_args);
-            return;
-        }
-        int prev_log_term = log[prev_log_idx].term;
-        next_idx[target] = n_idx;
-        std::vector<log_entry<command>> entries = n_idx > last_log_idx ? std::vector<log_entry<command>>() : log.sub_vector(n_idx);
-
+        last_received_heartbeat_time = std::chrono::system_clock::now();
+        role = raft_role::follower;
         mtx.unlock();
-        append_entries_args<command> args(current_term, my_id, prev_log_idx, prev_log_term, commit_idx, entries);
-        send_append_entries(target, args);
+        return;
+    }
+    if (role != raft_role::leader || arg.term != current_term) {
+        mtx.unlock();
+        return;
+    }
+
+    bool current = epoch == repl_epoch[target];
+    if (current) {
+        --in_flight[target];
+        last_progress[target] = std::chrono::system_clock::now();
+    }
+    if (reply.success) {
+        // replies can arrive out of order; never move backwards
+        match_idx[target] = std::max(match_idx[target], arg.prev_log_idx + (int) arg.entries.size());
+        next_idx[target] = std::max(next_idx[target], match_idx[target] + 1);
+        window_start[target] = std::max(window_start[target], match_idx[target] + 1);
+        advance_commit_idx();
+    } else if (current) {
+        // The follower lacks the entry before this batch: back up past it.
+        // Later batches in the window fail the same way, so start over.
+        reset_pipeline(target, std::max(match_idx[target] + 1, std::min(next_idx[target], arg.prev_log_idx)));
     }
+    if (current || reply.success) {
+        replicate(target, false);
+    }
+    mtx.unlock();
 }
 
 template <typename state_machine, typename command>
 int raft<state_machine, command>::install_snapshot(install_snapshot_args args, install_snapshot_reply& reply) {
-    mtx.lock();
+    std::unique_lock<std::mutex> lock(mtx);
+    // it may touch the state machine
+    wait_apply_idle(lock);
 
+    reply.term = current_term;
     if (args.term < current_term) {
-        reply.term = current_term;
-        mtx.unlock();
         return 0;
     }
 
     if (args.leader_id != my_id) {
         role = raft_role::follower;
-        set_vote_for(-1);
     }
+    if (args.term > current_term) {
+        set_current_term(args.term);
+    }
+    leader_id = args.leader_id;
+    reply.term = current_term;
+    last_received_heartbeat_time = std::chrono::system_clock::now();
 
-    current_term = args.term;
-    reply.term = args.term;
-
-    int last_log_idx = log.size() - 1;
-    
     if (log.get_last_included_idx() >= args.last_included_idx) {
-        last_received_heartbeat_time = std::chrono::system_clock::now();
-        mtx.unlock();
+        reply.done = true;
         return 0;
     }
 
+    int last_log_idx = log.size() - 1;
     if (last_log_idx >= args.last_included_idx
         && log[args.last_included_idx].term == args.last_included_term) {
-        
-        if (args.last_included_idx > commit_idx) {
-            commit_idx = args.last_included_idx;
+        // We hold every entry the snapshot covers: snapshot our own state
+        // instead of taking the leader's.
+        set_commit_idx(args.last_included_idx);
+        for (int i = last_applied + 1; i <= commit_idx; ++i) {
+            state->apply_log(*log[i].cmd);
         }
+        last_applied = std::max(last_applied, commit_idx);
+        read_cv.notify_all();
 
-        if (commit_idx > last_applied) {
-            for (int i = last_applied + 1; i <= commit_idx; ++i) {
-                assert((size_t)i < log.size());
-                state->apply_log(log[i].cmd);
-            }
-            last_applied = commit_idx;
+        if (!snapshot_busy) {
+            begin_snapshot();
         }
+        reply.done = true;
+        return 0;
+    }
+    lock.unlock();
 
-        log.snapshot(args.last_included_idx, args.last_included_term);
-        storage->persist_snapshot(state->snapshot());
-    } else {
-        state->apply_snapshot(args.data);
-        storage->persist_snapshot(args.data);
-        log.clean_snapshot(args.last_included_idx, args.last_included_term);
-        if (args.last_included_idx > commit_idx) {
-            commit_idx = args.last_included_idx;
-        }
+    // Chunks go straight to disk; only a complete snapshot is loaded.
+    reply.next_offset = storage->receive_snapshot_chunk(args.last_included_idx, args.last_included_term, args.offset, args.data);
+    if (!args.done || reply.next_offset != args.offset + args.data.size()) {
+        return 0;
+    }
 
-        if (args.last_included_idx > last_applied) {
-            last_applied = args.last_included_idx;
-        }
+    std::vector<char> data;
+    if (!storage->install_received_snapshot(args.last_included_idx, args.last_included_term, data)) {
+        return 0;
     }
-    
-    last_received_heartbeat_time = std::chrono::system_clock::now();
-    mtx.unlock();
 
+    lock.lock();
+    wait_apply_idle(lock);
+    if (args.last_included_idx > log.get_last_included_idx() && args.last_included_idx > last_applied) {
+        state->apply_snapshot(data);
+        log.clean_snapshot(args.last_included_idx, args.last_included_term);
+        set_commit_idx(args.last_included_idx);
+        last_applied = args.last_included_idx;
+        read_cv.notify_all();
+    }
+    reply.done = true;
     return 0;
 }
 
+// Fills arg with the next chunk to send, or returns false when the
+// transfer is over, either way.
 template <typename state_machine, typename command>
-void raft<state_machine, command>::handle_install_snapshot_reply(int target, const install_snapshot_args& arg, const install_snapshot_reply& reply) {
+bool raft<state_machine, command>::handle_install_snapshot_reply(int target, install_snapshot_args& arg, const install_snapshot_reply& reply) {
     mtx.lock();
     if (reply.term > current_term) {
+        set_current_term(reply.term);
         role = raft_role::follower;
         set_vote_for(-1);
+    }
+    if (role != raft_role::leader || current_term != arg.term || reply.done) {
+        if (reply.done && current_term == arg.term) {
+            match_idx[target] = std::max(match_idx[target], arg.last_included_idx);
+            reset_pipeline(target, std::max(next_idx[target], match_idx[target] + 1));
+        }
+        snapshot_sending[target] = false;
         mtx.unlock();
-        return;
+        return false;
     }
-
-    match_idx[target] = arg.last_included_idx;
-    next_idx[target] = log.size();
-
     mtx.unlock();
+
+    // The stored snapshot may have been replaced since the last chunk; the
+    // follower then starts over and tells us to send from 0.
+    size_t total;
+    if (!storage->read_snapshot_chunk(reply.next_offset, snapshot_chunk_bytes,
+                                      arg.last_included_idx, arg.last_included_term, total, arg.data)) {
+        mtx.lock();
+        snapshot_sending[target] = false;
+        mtx.unlock();
+        return false;
+    }
+    arg.offset = std::min((size_t) reply.next_offset, total);
+    arg.done = arg.offset + arg.data.size() == total;
+    return true;
 }
 
 template <typename state_machine, typename command>
@@ -650,23 +927,123 @@ void raft<state_machine, command>::send_request_vote(int target, request_vote_ar
 }
 
 template <typename state_machine, typename command>
-void raft<state_machine, command>::send_append_entries(int target, append_entries_args<command> arg) {
+void raft<state_machine, command>::record_ack(int target, int term, int round) {
+    mtx.lock();
+    if (role == raft_role::leader && current_term == term && round > acked_round[target]) {
+        acked_round[target] = round;
+        int done = quorum_round();
+        if (done == read_round && read_wanted > done) {
+            start_read_round();
+        }
+        read_cv.notify_all();
+    }
+    mtx.unlock();
+}
+
+template <typename state_machine, typename command>
+void raft<state_machine, command>::send_append_entries(int target, append_entries_args<command> arg, int epoch, int round) {
     append_entries_reply reply;
     if (rpc_clients[target]->call(raft_rpc_opcodes::op_append_entries, arg, reply) == 0) {
-        handle_append_entries_reply(target, arg, reply);
-    } else {
-        // RPC fails
+        // any reply not carrying a newer term accepts us as leader
+        if (reply.term <= arg.term) {
+            record_ack(target, arg.term, round);
+        }
+        handle_append_entries_reply(target, arg, reply, epoch);
+    } else if (epoch >= 0) {
+        // The batch may not have arrived, even if the window has moved on
+        // since: resend from it. The commit thread retries on its next tick.
+        mtx.lock();
+        if (role == raft_role::leader && current_term == arg.term
+            && (epoch == repl_epoch[target] || arg.prev_log_idx + 1 < next_idx[target])) {
+            int n_idx = std::min(next_idx[target], arg.prev_log_idx + 1);
+            reset_pipeline(target, std::max(match_idx[target] + 1, n_idx));
+        }
+        mtx.unlock();
     }
 }
 
+// Sends target as many batches as its window allows. On a heartbeat, an
+// idle peer gets an empty probe and a busy one a keepalive outside the
+// window. Must be called with mtx held, as leader.
+template <typename state_machine, typename command>
+void raft<state_machine, command>::replicate(int target, bool heartbeat) {
+    int last_log_idx = log.size() - 1;
+    bool sent = false;
+    while (in_flight[target] < max_in_flight) {
+        int n_idx = next_idx[target];
+        if (n_idx <= log.get_last_included_idx()) {
+            start_snapshot_transfer(target);
+            return;
+        }
+        if (n_idx > last_log_idx && (!heartbeat || sent || in_flight[target] > 0)) {
+            return;
+        }
+
+        int end = n_idx;
+        size_t bytes = 0;
+        while (end <= last_log_idx && (end == n_idx || bytes + log[end].cmd->size() <= max_batch_bytes)) {
+            bytes += log[end].cmd->size();
+            ++end;
+        }
+        std::vector<log_entry<command>> entries = log.sub_vector(n_idx, end);
+        append_entries_args<command> args(current_term, my_id, n_idx - 1, log[n_idx - 1].term, commit_idx, entries);
+        next_idx[target] = end;
+        ++in_flight[target];
+        sent = true;
+        thread_pool->addObjJob(this, &raft::send_append_entries, target, args, repl_epoch[target], read_round);
+    }
+    if (heartbeat && !sent) {
+        // the window is full; keep the follower's timer and read_index's
+        // acks going without disturbing it
+        int prev_log_idx = std::max(match_idx[target], log.get_last_included_idx());
+        append_entries_args<command> args(current_term, my_id, prev_log_idx, log[prev_log_idx].term, commit_idx);
+        thread_pool->addObjJob(this, &raft::send_append_entries, target, args, -1, read_round);
+    }
+}
+
+// Forgets the batches in flight to target and sends from n_idx next.
+// Must be called with mtx held.
+template <typename state_machine, typename command>
+void raft<state_machine, command>::reset_pipeline(int target, int n_idx) {
+    next_idx[target] = n_idx;
+    window_start[target] = n_idx;
+    in_flight[target] = 0;
+    ++repl_epoch[target];
+    last_progress[target] = std::chrono::system_clock::now();
+}
+
+// Streams the stored snapshot to target one chunk at a time. arg starts
+// out as the probe.
 template <typename state_machine, typename command>
 void raft<state_machine, command>::send_install_snapshot(int target, install_snapshot_args arg) {
-    install_snapshot_reply reply;
-    if (rpc_clients[target]->call(raft_rpc_opcodes::op_install_snapshot, arg, reply) == 0) {
-        handle_install_snapshot_reply(target, arg, reply);
-    } else {
-        // RPC fails
+    size_t total;
+    bool ok = storage->read_snapshot_chunk(0, 0, arg.last_included_idx, arg.last_included_term, total, arg.data);
+    while (ok && !is_stopped()) {
+        install_snapshot_reply reply;
+        if (rpc_clients[target]->call(raft_rpc_opcodes::op_install_snapshot, arg, reply) != 0) {
+            // a later heartbeat restarts the transfer, which resumes from
+            // what the follower already has
+            break;
+        }
+        if (!handle_install_snapshot_reply(target, arg, reply)) {
+            return;
+        }
     }
+    mtx.lock();
+    snapshot_sending[target] = false;
+    mtx.unlock();
+}
+
+// Starts streaming the snapshot to target unless that is already under way.
+// Must be called with mtx held.
+template <typename state_machine, typename command>
+void raft<state_machine, command>::start_snapshot_transfer(int target) {
+    if (snapshot_sending[target]) {
+        return;
+    }
+    snapshot_sending[target] = true;
+    install_snapshot_args probe(current_term, my_id, log.get_last_included_idx(), log.get_last_included_term());
+    thread_pool->addObjJob(this, &raft::send_install_snapshot, target, probe);
 }
 
 /******************************************************************
@@ -723,87 +1100,121 @@ void raft<state_machine, command>::run_background_election() {
 
 template<typename state_machine, typename command>
 void raft<state_machine, command>::run_background_commit() {
+    std::unique_lock<std::mutex> lock(mtx);
     while (true) {
+        // new_command wakes us at once; the timeout only paces retries to
+        // followers whose pipeline was reset
+        replicate_cv.wait_for(lock, std::chrono::milliseconds(10));
         if (is_stopped()) return;
-        mtx.lock();
         if (role == raft_role::leader) {
-            int last_log_idx = log.size() - 1;
+            std::chrono::system_clock::time_point now = std::chrono::system_clock::now();
             int server_number = rpc_clients.size();
             for (int i = 0; i < server_number; ++i) {
-                int n_idx = next_idx[i];
-                if (last_log_idx >= n_idx && n_idx > log.get_last_included_idx() && i != my_id) {
-                    int prev_log_idx = n_idx - 1;
-                    int prev_log_term = log[prev_log_idx].term;
-                    std::vector<log_entry<command>> entries = log.sub_vector(n_idx);
-                    append_entries_args<command> args(current_term, my_id, prev_log_idx, prev_log_term, commit_idx, entries);
-                    thread_pool->addObjJob(this, &raft::send_append_entries, i, args);
+                if (i == my_id) {
+                    continue;
                 }
-            }
-            std::vector<int> commit(match_idx);
-            mtx.unlock();
-
-            sort(commit.begin(), commit.end());
-            int max_possible_commit_idx = commit[server_number / 2];
-
-            mtx.lock();
-            if (role == raft_role::leader) {
-                for (int i = max_possible_commit_idx; i > 0; --i) {
-                    if (log[i].term < current_term) {
-                        break;
-                    } else if (log[i].term == current_term) {
-                        commit_idx = i;
-                        break;
-                    }
+                // an RPC stuck in the transport must not hold the window
+                if (in_flight[i] > 0 && now - last_progress[i] > std::chrono::milliseconds(heartbeat_timeout)) {
+                    reset_pipeline(i, window_start[i]);
                 }
+                replicate(i, false);
             }
         }
-        
-        mtx.unlock();
-        
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
     }
 }
 
 template <typename state_machine, typename command>
 void raft<state_machine, command>::run_background_apply() {
+    std::unique_lock<std::mutex> lock(mtx);
     while (true) {
         if (is_stopped()) return;
-        mtx.lock();
 
         if (log.get_last_included_idx() > last_applied) {
             last_applied = log.get_last_included_idx();
         }
 
         if (commit_idx > last_applied) {
-            for (int i = last_applied + 1; i <= commit_idx; ++i) {
-                state->apply_log(log[i].cmd);
+            // The entries are shared, so the batch stays valid even if the
+            // log is compacted or truncated past it meanwhile.
+            int end = std::min(commit_idx, last_applied + max_apply_batch);
+            std::vector<std::shared_ptr<command>> batch;
+            batch.reserve(end - last_applied);
+            for (int i = last_applied + 1; i <= end; ++i) {
+                batch.push_back(log[i].cmd);
+            }
+            applying = true;
+            lock.unlock();
+
+            std::vector<raft_command *> cmds;
+            cmds.reserve(batch.size());
+            for (const std::shared_ptr<command> &cmd : batch) {
+                cmds.push_back(cmd.get());
+            }
+            state->apply_logs(cmds.data(), cmds.data() + cmds.size());
+
+            lock.lock();
+            applying = false;
+            apply_idle_cv.notify_all();
+            last_applied = std::max(last_applied, end);
+            read_cv.notify_all();
+
+            if (snapshot_threshold > 0 && !snapshot_busy
+                && last_applied - log.get_last_included_idx() >= snapshot_threshold) {
+                begin_snapshot();
             }
-            last_applied = commit_idx;
         }
-        mtx.unlock();
-        
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+
+        apply_cv.wait(lock, [this] { return is_stopped() || commit_idx > last_applied; });
     }    
 }
 
+// Serializes and stores frozen snapshots, then compacts the log, all
+// without holding mtx while the bytes are produced or written.
+template <typename state_machine, typename command>
+void raft<state_machine, command>::run_background_snapshot() {
+    std::unique_lock<std::mutex> lock(mtx);
+    while (true) {
+        snapshot_cv.wait(lock, [this] { return is_stopped() || pending_view; });
+        if (is_stopped()) {
+            pending_view.reset();
+            return;
+        }
+
+        std::unique_ptr<raft_snapshot_view> view = std::move(pending_view);
+        int last_included_idx = pending_idx;
+        int last_included_term = pending_term;
+        lock.unlock();
+
+        std::vector<char> snapshot_data = view->serialize();
+        view.reset();
+        // store the snapshot before compacting, so the log never starts
+        // past the stored snapshot
+        storage->persist_snapshot(last_included_idx, last_included_term, snapshot_data);
+
+        lock.lock();
+        if (last_included_idx > log.get_last_included_idx()) {
+            log.snapshot(last_included_idx, last_included_term);
+        }
+        if (role == raft_role::leader) {
+            // followers that already hold the entries just compact their logs
+            for (int i = 0; i < (int) rpc_clients.size(); ++i) {
+                if (i != my_id) {
+                    start_snapshot_transfer(i);
+                }
+            }
+        }
+        snapshot_busy = false;
+        snapshot_cv.notify_all();
+    }
+}
+
 template <typename state_machine, typename command>
 void raft<state_machine, command>::run_background_ping() {
     while (true) {
         if (is_stopped()) return;
         mtx.lock();
         if (role == raft_role::leader) {
-            int last_log_idx = log.size() - 1;
-            int server_number = rpc_clients.size();
-            for (int i = 0; i < server_number; ++i) {
-                int n_idx = next_idx[i];
-                if (n_idx > log.get_last_included_idx() && i != my_id) {
-                    int prev_log_idx = n_idx - 1;
-                    int prev_log_term = log[prev_log_idx].term;
-                    std::vector<log_entry<command>> entries = n_idx > last_log_idx ? std::vector<log_entry<command>>() : log.sub_vector(n_idx);
-                    append_entries_args<command> args(current_term, my_id, prev_log_idx, prev_log_term, commit_idx, entries);
-                    thread_pool->addObjJob(this, &raft::send_append_entries, i, args);
-                }
-            }
+            broadcast_append_entries();
         }
         mtx.unlock();
         
@@ -811,6 +1222,63 @@ void raft<state_machine, command>::run_background_ping() {
     }    
 }
 
+// Send AppendEntries (a heartbeat if there is nothing new) to every peer.
+// Must be called with mtx held.
+template <typename state_machine, typename command>
+void raft<state_machine, command>::broadcast_append_entries() {
+    int server_number = rpc_clients.size();
+    for (int i = 0; i < server_number; ++i) {
+        if (i != my_id) {
+            replicate(i, true);
+        }
+    }
+}
+
+// Commit the highest index stored on a majority, if it is from the
+// current term. Must be called with mtx held, as leader.
+template <typename state_machine, typename command>
+void raft<state_machine, command>::advance_commit_idx() {
+    std::vector<int> commit(match_idx);
+    sort(commit.begin(), commit.end());
+    int max_possible_commit_idx = commit[(commit.size() - 1) / 2];
+
+    for (int i = max_possible_commit_idx; i > commit_idx; --i) {
+        if (log[i].term < current_term) {
+            break;
+        } else if (log[i].term == current_term) {
+            set_commit_idx(i);
+            break;
+        }
+    }
+}
+
+// Must be called with mtx held.
+template <typename state_machine, typename command>
+void raft<state_machine, command>::set_commit_idx(int idx) {
+    if (idx > commit_idx) {
+        commit_idx = idx;
+        apply_cv.notify_one();
+    }
+}
+
+// The latest heartbeat round a majority, counting this node, has
+// acknowledged. Must be called with mtx held, as leader.
+template <typename state_machine, typename command>
+int raft<state_machine, command>::quorum_round() {
+    std::vector<int> acked(acked_round);
+    acked[my_id] = read_round;
+    sort(acked.begin(), acked.end());
+    return acked[(acked.size() - 1) / 2];
+}
+
+// Opens the next heartbeat round and sends it to every peer. Must be
+// called with mtx held, as leader.
+template <typename state_machine, typename command>
+void raft<state_machine, command>::start_read_round() {
+    ++read_round;
+    broadcast_append_entries();
+}
+
 /******************************************************************
 
                         Other functions
@@ -819,12 +1287,19 @@ void raft<state_machine, command>::run_background_ping() {
 
 template<typename state_machine, typename command>
 void raft<state_machine, command>::set_current_term(int _current_term) {
+    if (current_term == _current_term) {
+        return;     // every heartbeat lands here; don't fdatasync for nothing
+    }
     current_term = _current_term;
+    leader_id = -1;
     storage->persist_current_term(_current_term);
 }
 
 template<typename state_machine, typename command>
 void raft<state_machine, command>::set_vote_for(int _vote_for) {
+    if (vote_for == _vote_for) {
+        return;
+    }
     vote_for = _vote_for;
     storage->persist_vote_for(_vote_for);
 }
@@ -31,21 +31,23 @@ unmarshall &operator>>(unmarshall &m, append_entries_reply &args) {
 }
 
 marshall &operator<<(marshall &m, const install_snapshot_args &args) {
-    m << args.term << args.leader_id << args.last_included_idx << args.last_included_term << args.data;
+    m << args.term << args.leader_id << args.last_included_idx << args.last_included_term
+      << args.offset << args.data << args.done;
     return m;
 }
 
 unmarshall &operator>>(unmarshall &u, install_snapshot_args &args) {
-    u >> args.term >> args.leader_id >> args.last_included_idx >> args.last_included_term >> args.data;
+    u >> args.term >> args.leader_id >> args.last_included_idx >> args.last_included_term
+      >> args.offset >> args.data >> args.done;
     return u;
 }
 
 marshall &operator<<(marshall &m, const install_snapshot_reply &reply) {
-    m << reply.term;
+    m << reply.term << reply.done << reply.next_offset;
     return m;
 }
 
 unmarshall &operator>>(unmarshall &u, install_snapshot_reply &reply) {
-    u >> reply.term;
+    u >> reply.term >> reply.done >> reply.next_offset;
     return u;
 }
\ No newline at end of file
@@ -42,25 +42,29 @@ public:
 marshall &operator<<(marshall &m, const request_vote_reply &reply);
 unmarshall &operator>>(unmarshall &u, request_vote_reply &reply);
 
+// The command is shared rather than copied: the in-memory log, the
+// AppendEntries batches and the thread pool jobs sending them all hold
+// the same object, which must not change once it is in the log.
 template <typename command>
 class log_entry {
 public:
     int term;
-    command cmd;
+    std::shared_ptr<command> cmd;
 
-    log_entry(): term(0) {}
-    log_entry(int _term, command _cmd): term(_term), cmd(_cmd) {}
+    log_entry(): term(0), cmd(std::make_shared<command>()) {}
+    log_entry(int _term, command _cmd): term(_term), cmd(std::make_shared<command>(std::move(_cmd))) {}
 };
 
 template <typename command>
 marshall &operator<<(marshall &m, const log_entry<command> &entry) {
-    m << entry.term << entry.cmd;
+    m << entry.term << *entry.cmd;
     return m;
 }
 
 template <typename command>
 unmarshall &operator>>(unmarshall &u, log_entry<command> &entry) {
-    u >> entry.term >> entry.cmd;
+    entry.cmd = std::make_shared<command>();
+    u >> entry.term >> *entry.cmd;
     return u;
 }
 
@@ -115,23 +119,26 @@ public:
 marshall &operator<<(marshall &m, const append_entries_reply &reply);
 unmarshall &operator>>(unmarshall &m, append_entries_reply &reply);
 
+// One chunk of a snapshot, sent one at a time: the leader sends the next
+// chunk from the offset the follower's reply asks for. An empty chunk at
+// offset 0 is a probe that learns how much of this snapshot the follower
+// already holds, so a transfer cut off by a dropped connection resumes
+// where it stopped.
 class install_snapshot_args {
 public:
     int term;
     int leader_id;
     int last_included_idx;
     int last_included_term;
-    std::vector<char> data;
+    unsigned long long offset;  // of data within the snapshot
+    std::string data;
+    bool done;                  // data ends the snapshot
 
-    install_snapshot_args() {}
-    install_snapshot_args(int _term, int _leader_id, int _last_included_idx,
-        int _last_included_term, const std::vector<char> &_data):
+    install_snapshot_args(): offset(0), done(false) {}
+    install_snapshot_args(int _term, int _leader_id, int _last_included_idx, int _last_included_term,
+        unsigned long long _offset = 0, const std::string &_data = std::string(), bool _done = false):
         term(_term), leader_id(_leader_id), last_included_idx(_last_included_idx),
-        last_included_term(_last_included_term), data(_data) {}
-    
-    install_snapshot_args(int _term, int _leader_id, int _last_included_idx, int _last_included_term):
-        term(_term), leader_id(_leader_id), last_included_idx(_last_included_idx),
-        last_included_term(_last_included_term) {}
+        last_included_term(_last_included_term), offset(_offset), data(_data), done(_done) {}
 };
 
 marshall &operator<<(marshall &m, const install_snapshot_args &args);
@@ -140,9 +147,11 @@ unmarshall &operator>>(unmarshall &m, install_snapshot_args &args);
 class install_snapshot_reply {
 public:
     int term;
+    bool done;                      // the follower has this snapshot or a newer one
+    unsigned long long next_offset; // otherwise, where to send from next
 
-    install_snapshot_reply() {}
-    install_snapshot_reply(int _term): term(_term) {}
+    install_snapshot_reply(): term(0), done(false), next_offset(0) {}
+    install_snapshot_reply(int _term): term(_term), done(false), next_offset(0) {}
 };
 
 marshall &operator<<(marshall &m, const install_snapshot_reply &reply);
@@ -21,6 +21,17 @@ public:
     virtual void deserialize(const char *buf, int size) = 0;
 };
 
+// A frozen, point-in-time view of a state machine. serialize() may run on
+// another thread while apply_log() keeps changing the live state; the view
+// is released by destroying it.
+class raft_snapshot_view {
+public:
+    virtual ~raft_snapshot_view() {
+    }
+
+    virtual std::vector<char> serialize() = 0;
+};
+
 class raft_state_machine {
 public:
     virtual ~raft_state_machine() {
@@ -29,10 +40,38 @@ public:
     // Apply a log to the state machine.
     virtual void apply_log(raft_command &) = 0;
 
+    // Apply consecutive committed logs, in order. raft calls this without
+    // holding its own lock, so a state machine can take its locks once per
+    // batch and hold back wakeups until the whole batch is in.
+    virtual void apply_logs(raft_command *const *begin, raft_command *const *end) {
+        for (raft_command *const *it = begin; it != end; ++it) {
+            apply_log(**it);
+        }
+    }
+
     // Generate a snapshot of the current state.
     virtual std::vector<char> snapshot() = 0;
     // Apply the snapshot to the state machine.
     virtual void apply_snapshot(const std::vector<char> &) = 0;
+
+    // Freeze the current state for a background snapshot. Called with no
+    // apply_log() in progress, so it should be cheap, e.g. by starting to
+    // copy on write. The default just takes the whole snapshot here.
+    virtual std::unique_ptr<raft_snapshot_view> snapshot_view() {
+        return std::unique_ptr<raft_snapshot_view>(new copied_view(snapshot()));
+    }
+
+private:
+    class copied_view : public raft_snapshot_view {
+    public:
+        copied_view(std::vector<char> &&_data): data(std::move(_data)) {
+        }
+        virtual std::vector<char> serialize() override {
+            return std::move(data);
+        }
+    private:
+        std::vector<char> data;
+    };
 };
 
 #endif // raft_state_machine_h
\ No newline at end of file
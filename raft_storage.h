@@ -7,289 +7,757 @@
 #include <fstream>
 #include <sstream>
 #include <vector>
+#include <deque>
+
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <cstring>
+#include <algorithm>
+#include <condition_variable>
+
+// How the log reaches the disk.
+//   durable_sync:  sync() returns only once the entries are fdatasync'ed;
+//                  concurrent callers share one fdatasync (group commit).
+//   durable_async: sync() returns once the entries are in the page cache
+//                  and a flusher thread fdatasyncs them every
+//                  wal_flush_interval. Survives a process crash, but a
+//                  machine crash can lose the last interval.
+// The term and vote are fdatasync'ed before returning in either mode: a
+// node that forgot them after a crash could vote twice in one term.
+enum raft_durability {
+    durable_sync,
+    durable_async
+};
+
+// CRC-32 (IEEE 802.3), continuing from crc.
+inline uint32_t log_crc32(uint32_t crc, const char *data, size_t len) {
+    static const std::vector<uint32_t> table = [] {
+        std::vector<uint32_t> t(256);
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k) {
+                c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+            }
+            t[i] = c;
+        }
+        return t;
+    }();
+    crc = ~crc;
+    for (size_t i = 0; i < len; ++i) {
+        crc = table[(crc ^ (unsigned char) data[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
 
-#define init_buf_size 16
+// The log lives in segment files log_<first idx>.rft holding consecutive
+// entries as
+//
+//     [int term][int cmd_size][u32 crc][cmd_size bytes of cmd]
+//
+// where crc is the CRC-32 of the term, the size and the command, so
+// replay can tell a complete record from a torn or corrupted one.
+//
+// and log.rft, which holds only {size_t start_idx, int last_included_term}.
+// A segment is appended to until it reaches log_segment_bytes, then sealed
+// (fdatasync'ed) and a new one started. Each segment keeps an in-memory
+// offset index, so
+//   - truncating the log ftruncates one segment and unlinks those after it,
+//   - compacting it rewrites log.rft and unlinks the segments the snapshot
+//     covers entirely,
+// and neither depends on how long the log is. On startup the segments are
+// mmap'ed and replayed in one sequential pass; a torn or corrupted record
+// or a gap between segments ends the log there.
+//
+// snapshot.rft is {size_t size, int last_included_idx, int
+// last_included_term} followed by the snapshot; it is replaced with a
+// rename, never rewritten in place, and never by an older snapshot. A
+// leader streams it to followers in chunks straight from the file; a
+// follower spools incoming chunks into snapshot.rft.part and renames that
+// into place once the last chunk is in.
 
 template <typename command>
 class raft_storage {
 public:
-    raft_storage(const std::string &file_dir);
+    raft_storage(const std::string &file_dir, raft_durability mode = durable_sync);
     ~raft_storage();
 
     void persist_current_term(int);
     void persist_vote_for(int);
-    void persist_log(size_t start_idx, int last_included_term, const std::vector<log_entry<command>> &log_entries);
-    void append_log(size_t actual_size, const log_entry<command> &entry);
-    void persist_snapshot(const std::vector<char> &snapshot_data);
+    // Returns false, and keeps the old one, if the stored snapshot is
+    // already at or past last_included_idx.
+    bool persist_snapshot(int last_included_idx, int last_included_term, const std::vector<char> &snapshot_data);
+
+    // Log updates only hand the entries to the OS and return the WAL
+    // position just past them; sync(pos) waits until they are durable.
+    size_t append_log(size_t idx, const log_entry<command> &entry);
+    size_t append_log(size_t idx, const std::vector<log_entry<command>> &entries);
+    size_t truncate_log(size_t idx);
+    void compact_log(size_t start_idx, int last_included_term);
+    // Like compact_log, but for a log replaced by a snapshot: whatever
+    // it held from start_idx on is dropped too.
+    void reset_log(size_t start_idx, int last_included_term);
+    void sync(size_t pos);
 
     int read_current_term();
     int read_vote_for();
-    void read_log(size_t &start_idx, int &last_included_term, std::vector<log_entry<command>> &log_entries);
-    void read_snapshot(std::vector<char> &snapshot_data);
+    void read_log(size_t &start_idx, int &last_included_term, std::deque<log_entry<command>> &log_entries);
+    void read_snapshot(int &last_included_idx, int &last_included_term, std::vector<char> &snapshot_data);
+
+    // Reads up to len bytes of the stored snapshot at offset, along with
+    // which snapshot it is and its total size. False if there is none.
+    bool read_snapshot_chunk(size_t offset, size_t len, int &last_included_idx, int &last_included_term,
+                             size_t &total, std::string &chunk);
+    // Adds a chunk to the snapshot being received and returns how many
+    // bytes of it are now held, i.e. the offset the sender should go on
+    // from. A chunk for another snapshot starts over; one that doesn't
+    // continue the received prefix is ignored.
+    size_t receive_snapshot_chunk(int last_included_idx, int last_included_term, size_t offset, const std::string &chunk);
+    // Makes the received snapshot the stored one and reads it back.
+    bool install_received_snapshot(int last_included_idx, int last_included_term, std::vector<char> &snapshot_data);
 
 private:
-    std::mutex mtx;
-    std::fstream number_storage;
-    std::fstream log_storage;
-    std::fstream snapshot_storage;
-    char *cmd_buf;
-    int cmd_buf_size;
+    struct snapshot_header {
+        size_t size;
+        int last_included_idx;          // -1 if there is no snapshot
+        int last_included_term;
+    };
+    struct segment {
+        size_t first;                   // index of its first entry
+        std::vector<size_t> offsets;    // offsets[i]: where log[first + i] starts
+        size_t bytes;
+    };
+    static const size_t log_segment_bytes = 1 << 20;
+    static const size_t record_header = 2 * sizeof(int) + sizeof(uint32_t);
+    static constexpr std::chrono::milliseconds wal_flush_interval{10};
+
+    std::mutex mtx;                 // guards the files, segments and wal_buf
+    int number_fd;
+    int base_fd;
+    int log_fd;                     // the last segment, -1 if there is none
+    int snapshot_fd;
+    snapshot_header snapshot;       // of snapshot.rft
+    int part_fd;                    // snapshot.rft.part, -1 if none
+    snapshot_header part;           // size counts the bytes received
+    std::string dir;
+    raft_durability mode;
+
+    std::deque<segment> segments;
+    size_t start_idx;
+    std::vector<char> wal_buf;      // entries being built for one write()
+    std::atomic<size_t> written;    // WAL position handed to the OS
+
+    std::mutex sync_mtx;            // guards the fields below and log_fd swaps
+    std::condition_variable sync_cv;
+    size_t synced;                  // WAL position known to be on disk
+    bool syncing;                   // an fdatasync is in flight
+    bool stopped;
+    std::thread *flusher;
+
+    std::string segment_name(size_t first);
+    size_t log_end();
+    void put_entry(size_t idx, const log_entry<command> &entry);
+    size_t write_wal(size_t idx);
+    void set_log_fd(int fd);
+    void unlink_segment(size_t first);
+    void truncate_locked(size_t idx);
+    void persist_base(size_t start_idx, int last_included_term);
+    void drop_compacted();
+    void do_sync(size_t pos);
+    void run_flusher();
+    void write_at(int fd, const char *buf, size_t len, size_t off);
+    void replace_snapshot(int fd, const snapshot_header &hdr);
 };
 
 template<typename command>
-raft_storage<command>::raft_storage(const std::string& dir): cmd_buf(new char[init_buf_size]), cmd_buf_size(init_buf_size) {
-
-    std::stringstream number_filename;
-    std::stringstream log_filename;
-    std::stringstream snapshot_filename;
-
-    number_filename << dir << "/number.rft";
-    log_filename << dir << "/log.rft";
-    snapshot_filename << dir << "/snapshot.rft";
-
-    FILE *file = fopen(number_filename.str().c_str(), "a+");
-    fclose(file);
-    number_storage.open(number_filename.str(), std::ios::in | std::ios::out | std::ios::binary);
-
-    file = fopen(log_filename.str().c_str(), "a+");
-    fclose(file);
-    log_storage.open(log_filename.str(), std::ios::in | std::ios::out | std::ios::binary);
-
-    file = fopen(snapshot_filename.str().c_str(), "a+");
-    fclose(file);
-    snapshot_storage.open(snapshot_filename.str(), std::ios::in | std::ios::out | std::ios::binary);
-
-    number_storage.seekg(0, std::ios::end);
-    unsigned long file_length = number_storage.tellg();
-    if (file_length < 2 * sizeof(int)) {
-        char buf[sizeof(int)];
-        number_storage.seekg(0);
-        *((int *)buf) = 0;
-        number_storage.write(buf, sizeof(int));
-        *((int *)buf) = -1;
-        number_storage.write(buf, sizeof(int));
-
-        number_storage.flush();
+raft_storage<command>::raft_storage(const std::string& _dir, raft_durability _mode):
+    number_fd(-1), base_fd(-1), log_fd(-1), snapshot_fd(-1), part_fd(-1), dir(_dir), mode(_mode), start_idx(0), written(0),
+    synced(0), syncing(false), stopped(false), flusher(nullptr) {
+
+    std::string number_filename = dir + "/number.rft";
+    std::string snapshot_filename = dir + "/snapshot.rft";
+    std::string base_filename = dir + "/log.rft";
+
+    number_fd = open(number_filename.c_str(), O_RDWR | O_CREAT, 0644);
+    base_fd = open(base_filename.c_str(), O_RDWR | O_CREAT, 0644);
+    snapshot_fd = open(snapshot_filename.c_str(), O_RDWR | O_CREAT, 0644);
+    if (number_fd < 0 || base_fd < 0 || snapshot_fd < 0) {
+        perror("raft_storage: open");
+        exit(1);
     }
 
-    log_storage.seekg(0, std::ios::end);
-    file_length = log_storage.tellg();
+    if (lseek(number_fd, 0, SEEK_END) < (off_t) (2 * sizeof(int))) {
+        int buf[2] = {0, -1};
+        if (pwrite(number_fd, buf, sizeof(buf), 0) != sizeof(buf)) {
+            perror("raft_storage: pwrite");
+        }
+        fdatasync(number_fd);
+    }
 
-    if (file_length < 2 * sizeof(size_t) + sizeof(int)) {
-        std::vector<log_entry<command>> empty;
-        empty.emplace_back();
-        persist_log(0, 0, empty);
+    if (lseek(base_fd, 0, SEEK_END) < (off_t) (sizeof(size_t) + sizeof(int))) {
+        persist_base(0, 0);
+        append_log(0, log_entry<command>());
+        sync(written);
     }
 
-    snapshot_storage.seekg(0, std::ios::end);
-    file_length = snapshot_storage.tellg();
-    if (file_length <= sizeof(size_t)) {
-        char buf[sizeof(size_t)];
-        *((size_t *)buf) = 0;
-        snapshot_storage.seekg(0);
-        snapshot_storage.write(buf, sizeof(size_t));
+    if (pread(snapshot_fd, &snapshot, sizeof(snapshot), 0) != sizeof(snapshot)) {
+        snapshot.size = 0;
+        snapshot.last_included_idx = -1;
+        snapshot.last_included_term = 0;
+        write_at(snapshot_fd, (const char *) &snapshot, sizeof(snapshot), 0);
+        fdatasync(snapshot_fd);
+    }
 
-        snapshot_storage.flush();
+    if (mode == durable_async) {
+        flusher = new std::thread(&raft_storage::run_flusher, this);
     }
 }
 
 template<typename command>
 raft_storage<command>::~raft_storage() {
-   number_storage.close();
-   log_storage.close();
-   delete [] cmd_buf;
+    {
+        std::lock_guard<std::mutex> lock(sync_mtx);
+        stopped = true;
+    }
+    sync_cv.notify_all();
+    if (flusher) {
+        flusher->join();
+        delete flusher;
+    }
+    if (log_fd >= 0) {
+        fdatasync(log_fd);
+        close(log_fd);
+    }
+    close(number_fd);
+    close(base_fd);
+    close(snapshot_fd);
+    if (part_fd >= 0) {
+        close(part_fd);
+        unlink((dir + "/snapshot.rft.part").c_str());
+    }
 }
 
 template<typename command>
 void raft_storage<command>::persist_current_term(int current_term) {
     mtx.lock();
-    char buf[sizeof(int)];
-    *((int *)buf) = current_term;
-    number_storage.seekg(0);
-    number_storage.write(buf, sizeof(int));
-    number_storage.flush();
+    if (pwrite(number_fd, &current_term, sizeof(int), 0) != sizeof(int)) {
+        perror("raft_storage: pwrite");
+    }
+    fdatasync(number_fd);
     mtx.unlock();
 }
 
 template<typename command>
 void raft_storage<command>::persist_vote_for(int vote_for) {
     mtx.lock();
-    char buf[sizeof(int)];
-    *((int *)buf) = vote_for;
-    number_storage.seekg(sizeof(int));
-    number_storage.write(buf, sizeof(int));
-    number_storage.flush();
+    if (pwrite(number_fd, &vote_for, sizeof(int), sizeof(int)) != sizeof(int)) {
+        perror("raft_storage: pwrite");
+    }
+    fdatasync(number_fd);
     mtx.unlock();
 }
 
 template<typename command>
 int raft_storage<command>::read_current_term() {
     mtx.lock();
-    char buf[sizeof(int)];
-    number_storage.seekg(0);
-    number_storage.read(buf, sizeof(int));
+    int term = 0;
+    if (pread(number_fd, &term, sizeof(int), 0) != sizeof(int)) {
+        term = 0;
+    }
     mtx.unlock();
-    return *((int *)buf);
+    return term;
 }
 
 template<typename command>
 int raft_storage<command>::read_vote_for() {
     mtx.lock();
-    char buf[sizeof(int)];
-    number_storage.seekg(sizeof(int));
-    number_storage.read(buf, sizeof(int));
+    int vote_for = -1;
+    if (pread(number_fd, &vote_for, sizeof(int), sizeof(int)) != sizeof(int)) {
+        vote_for = -1;
+    }
     mtx.unlock();
-    return *((int *)buf);
+    return vote_for;
 }
 
 template<typename command>
-void raft_storage<command>::persist_log(size_t start_idx, int last_included_term, const std::vector<log_entry<command>> &log_entries) {
-    mtx.lock();
+std::string raft_storage<command>::segment_name(size_t first) {
+    char name[32];
+    snprintf(name, sizeof(name), "/log_%020lu.rft", (unsigned long) first);
+    return dir + name;
+}
 
-    log_storage.seekg(2 * sizeof(size_t) + sizeof(int));
-    char buf[sizeof(size_t)];
-    for (const log_entry<command> &entry : log_entries) {
-        *((int *)buf) = entry.term;
-        log_storage.write(buf, sizeof(int));
-        
-        int cmd_size = entry.cmd.size();
-        *((int *)buf) = cmd_size;
-        log_storage.write(buf, sizeof(int));
-
-        if (cmd_size > cmd_buf_size) {
-            delete [] cmd_buf;
-            cmd_buf = new char[cmd_size];
-            cmd_buf_size = cmd_size;
-        }
+// Index one past the last entry on disk. mtx must be held.
+template<typename command>
+size_t raft_storage<command>::log_end() {
+    if (segments.empty()) {
+        return start_idx;
+    }
+    return segments.back().first + segments.back().offsets.size();
+}
+
+template<typename command>
+void raft_storage<command>::put_entry(size_t idx, const log_entry<command> &entry) {
+    int cmd_size = entry.cmd->size();
+    size_t off = wal_buf.size();
+    wal_buf.resize(off + record_header + cmd_size);
+    memcpy(&wal_buf[off], &entry.term, sizeof(int));
+    memcpy(&wal_buf[off + sizeof(int)], &cmd_size, sizeof(int));
+    entry.cmd->serialize(&wal_buf[off + record_header], cmd_size);
+    uint32_t crc = log_crc32(0, &wal_buf[off], 2 * sizeof(int));
+    crc = log_crc32(crc, &wal_buf[off + record_header], cmd_size);
+    memcpy(&wal_buf[off + 2 * sizeof(int)], &crc, sizeof(uint32_t));
+}
 
-        entry.cmd.serialize(cmd_buf, cmd_size);
-        log_storage.write(cmd_buf, cmd_size);
+// Switches the fd that sync() flushes. The old one is closed only when no
+// fdatasync is using it.
+template<typename command>
+void raft_storage<command>::set_log_fd(int fd) {
+    std::unique_lock<std::mutex> lock(sync_mtx);
+    sync_cv.wait(lock, [this] { return !syncing; });
+    if (log_fd >= 0) {
+        close(log_fd);
     }
+    log_fd = fd;
+}
 
-    log_storage.seekg(0);
+template<typename command>
+void raft_storage<command>::unlink_segment(size_t first) {
+    if (unlink(segment_name(first).c_str()) < 0) {
+        perror("raft_storage: unlink");
+    }
+}
 
-    *((size_t *)buf) = start_idx;
-    log_storage.write(buf, sizeof(size_t));
+// Writes the entries in wal_buf, which start at log[idx], with one write()
+// to the last segment, starting a new segment first if it is full.
+// mtx must be held.
+template<typename command>
+size_t raft_storage<command>::write_wal(size_t idx) {
+    if (idx < log_end()) {
+        truncate_locked(idx);
+    }
+    assert(idx == log_end());
 
-    *((int *)buf) = last_included_term;
-    log_storage.write(buf, sizeof(int));
+    if (segments.empty() || segments.back().bytes >= log_segment_bytes) {
+        if (log_fd >= 0) {
+            fdatasync(log_fd);      // seal it; sync() only flushes the last one
+        }
+        int fd = open(segment_name(idx).c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+        if (fd < 0) {
+            perror("raft_storage: open");
+            exit(1);
+        }
+        set_log_fd(fd);
+        segments.push_back(segment{idx, {}, 0});
+    }
 
-    *((size_t *)buf) = log_entries.size();
-    log_storage.write(buf, sizeof(size_t));
+    segment &seg = segments.back();
+    size_t off = 0;
+    while (off < wal_buf.size()) {
+        int cmd_size;
+        memcpy(&cmd_size, &wal_buf[off + sizeof(int)], sizeof(int));
+        seg.offsets.push_back(seg.bytes + off);
+        off += record_header + cmd_size;
+    }
 
-    log_storage.flush();
-    
-    mtx.unlock();
+    size_t done = 0;
+    while (done < wal_buf.size()) {
+        ssize_t n = write(log_fd, wal_buf.data() + done, wal_buf.size() - done);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("raft_storage: write");
+            exit(1);
+        }
+        done += n;
+    }
+    seg.bytes += done;
+    wal_buf.clear();
+    return written += done;
 }
 
 template<typename command>
-void raft_storage<command>::append_log(size_t actual_size, const log_entry<command> &entry) {
-    mtx.lock();
+size_t raft_storage<command>::append_log(size_t idx, const log_entry<command> &entry) {
+    std::lock_guard<std::mutex> lock(mtx);
+    put_entry(idx, entry);
+    return write_wal(idx);
+}
 
-    char buf[sizeof(size_t)];
-    log_storage.seekg(0, std::ios::end);
-    *((int *)buf) = entry.term;
-    log_storage.write(buf, sizeof(int));
+template<typename command>
+size_t raft_storage<command>::append_log(size_t idx, const std::vector<log_entry<command>> &entries) {
+    std::lock_guard<std::mutex> lock(mtx);
+    for (size_t i = 0; i < entries.size(); ++i) {
+        put_entry(idx + i, entries[i]);
+    }
+    return write_wal(idx);
+}
 
-    int cmd_size = entry.cmd.size();
-    *((int *)buf) = cmd_size;
-    log_storage.write(buf, sizeof(int));
+// Drops log[idx] and everything after it. mtx must be held.
+template<typename command>
+void raft_storage<command>::truncate_locked(size_t idx) {
+    if (segments.empty() || idx >= log_end()) {
+        return;
+    }
+    while (!segments.empty() && segments.back().first >= idx && segments.size() > 1) {
+        unlink_segment(segments.back().first);
+        segments.pop_back();
+        set_log_fd(-1);
+    }
 
-    if (cmd_size > cmd_buf_size) {
-        delete [] cmd_buf;
-        cmd_buf = new char[cmd_size];
-        cmd_buf_size = cmd_size;
+    segment &seg = segments.back();
+    if (idx <= seg.first) {
+        seg.offsets.clear();
+        seg.bytes = 0;
+    } else {
+        seg.bytes = seg.offsets[idx - seg.first];
+        seg.offsets.resize(idx - seg.first);
     }
+    if (log_fd < 0) {
+        int fd = open(segment_name(seg.first).c_str(), O_RDWR | O_APPEND);
+        if (fd < 0) {
+            perror("raft_storage: open");
+            exit(1);
+        }
+        set_log_fd(fd);
+    }
+    if (ftruncate(log_fd, seg.bytes) < 0) {
+        perror("raft_storage: ftruncate");
+    }
+}
 
-    entry.cmd.serialize(cmd_buf, cmd_size);
-    log_storage.write(cmd_buf, cmd_size);
+template<typename command>
+size_t raft_storage<command>::truncate_log(size_t idx) {
+    std::lock_guard<std::mutex> lock(mtx);
+    truncate_locked(idx);
+    return written;
+}
+
+template<typename command>
+void raft_storage<command>::persist_base(size_t _start_idx, int last_included_term) {
+    char buf[sizeof(size_t) + sizeof(int)];
+    memcpy(buf, &_start_idx, sizeof(size_t));
+    memcpy(buf + sizeof(size_t), &last_included_term, sizeof(int));
+    if (pwrite(base_fd, buf, sizeof(buf), 0) != sizeof(buf)) {
+        perror("raft_storage: pwrite");
+    }
+    fdatasync(base_fd);
+    start_idx = _start_idx;
+}
 
-    log_storage.seekg(sizeof(size_t) + sizeof(int));
-    *((size_t *)buf) = actual_size;
-    log_storage.write(buf, sizeof(size_t));
+// The log now starts at log[start_idx]. Segments holding only earlier
+// entries are unlinked; a partly covered one stays until the next
+// compaction that covers it.
+template<typename command>
+void raft_storage<command>::compact_log(size_t _start_idx, int last_included_term) {
+    std::lock_guard<std::mutex> lock(mtx);
+    persist_base(_start_idx, last_included_term);
+    drop_compacted();
+}
 
-    log_storage.flush();
-    mtx.unlock();
+// The entries past the snapshot may conflict with it, so they go before
+// the new start does; a crash in between leaves an old start with a
+// shorter log, which the snapshot still covers.
+template<typename command>
+void raft_storage<command>::reset_log(size_t _start_idx, int last_included_term) {
+    std::lock_guard<std::mutex> lock(mtx);
+    truncate_locked(_start_idx);
+    persist_base(_start_idx, last_included_term);
+    drop_compacted();
 }
 
+// Unlinks the segments holding only entries before start_idx.
+// mtx must be held.
 template<typename command>
-void raft_storage<command>::read_log(size_t &start_idx, int &last_included_term, std::vector<log_entry<command>> &log_entries) {
-    mtx.lock();
-    char buf[sizeof(size_t)];
+void raft_storage<command>::drop_compacted() {
+    while (!segments.empty()) {
+        size_t end = segments.size() > 1 ? segments[1].first
+                                         : segments[0].first + segments[0].offsets.size();
+        if (end > start_idx) {
+            break;
+        }
+        unlink_segment(segments.front().first);
+        segments.pop_front();
+        if (segments.empty()) {
+            set_log_fd(-1);
+        }
+    }
+}
 
-    log_storage.seekg(0);
-    log_storage.read(buf, sizeof(size_t));
-    start_idx = *((size_t *)buf);
+template<typename command>
+void raft_storage<command>::sync(size_t pos) {
+    if (mode == durable_sync) {
+        do_sync(pos);
+    }
+}
 
-    log_storage.read(buf, sizeof(int));
-    last_included_term = *((int *)buf);
+// Group commit: whoever finds no fdatasync in flight issues one covering
+// everything written so far; the others wait for it and return if it
+// covered their position.
+template<typename command>
+void raft_storage<command>::do_sync(size_t pos) {
+    std::unique_lock<std::mutex> lock(sync_mtx);
+    while (synced < pos) {
+        if (syncing) {
+            sync_cv.wait(lock);
+            continue;
+        }
+        syncing = true;
+        size_t target = written;
+        int fd = log_fd;
+        lock.unlock();
+        if (fd >= 0) {
+            fdatasync(fd);
+        }
+        lock.lock();
+        syncing = false;
+        synced = std::max(synced, target);
+        sync_cv.notify_all();
+    }
+}
 
-    log_storage.read(buf, sizeof(size_t));
-    size_t actual_size = *((size_t *)buf);
+template<typename command>
+void raft_storage<command>::run_flusher() {
+    std::unique_lock<std::mutex> lock(sync_mtx);
+    while (!stopped) {
+        sync_cv.wait_for(lock, wal_flush_interval);
+        size_t target = written;
+        if (synced < target) {
+            lock.unlock();
+            do_sync(target);
+            lock.lock();
+        }
+    }
+}
 
-    for (size_t i = 0; i < actual_size; ++i) {
-        log_storage.read(buf, sizeof(int));
-        int term = *((int *)buf);
+template<typename command>
+void raft_storage<command>::read_log(size_t &_start_idx, int &last_included_term, std::deque<log_entry<command>> &log_entries) {
+    std::lock_guard<std::mutex> lock(mtx);
 
-        log_storage.read(buf, sizeof(int));
-        int cmd_size = *((int *)buf);
+    char buf[sizeof(size_t) + sizeof(int)];
+    if (pread(base_fd, buf, sizeof(buf), 0) != sizeof(buf)) {
+        memset(buf, 0, sizeof(buf));
+    }
+    memcpy(&start_idx, buf, sizeof(size_t));
+    memcpy(&last_included_term, buf + sizeof(size_t), sizeof(int));
+    _start_idx = start_idx;
+
+    std::vector<size_t> firsts;
+    DIR *d = opendir(dir.c_str());
+    if (d) {
+        struct dirent *p;
+        unsigned long first;
+        char tail;
+        while ((p = readdir(d))) {
+            if (sscanf(p->d_name, "log_%lu.rf%c", &first, &tail) == 2 && tail == 't') {
+                firsts.push_back(first);
+            }
+        }
+        closedir(d);
+    }
+    std::sort(firsts.begin(), firsts.end());
+
+    set_log_fd(-1);
+    segments.clear();
+    log_entries.clear();
+
+    bool broken = false;
+    for (size_t first : firsts) {
+        if (broken || (segments.empty() ? first > start_idx : first != log_end())) {
+            // cut off from the log by a gap or an earlier torn segment
+            unlink_segment(first);
+            continue;
+        }
 
-        command cmd;
+        int fd = open(segment_name(first).c_str(), O_RDWR | O_APPEND);
+        if (fd < 0) {
+            perror("raft_storage: open");
+            exit(1);
+        }
+        size_t bytes = lseek(fd, 0, SEEK_END);
+        const char *data = nullptr;
+        if (bytes > 0) {
+            data = (const char *) mmap(nullptr, bytes, PROT_READ, MAP_SHARED, fd, 0);
+            if (data == MAP_FAILED) {
+                perror("raft_storage: mmap");
+                exit(1);
+            }
+        }
 
-        if (cmd_size > cmd_buf_size) {
-            delete [] cmd_buf;
-            cmd_buf = new char[cmd_size];
-            cmd_buf_size = cmd_size;
+        segment seg{first, {}, 0};
+        while (seg.bytes + record_header <= bytes) {
+            const char *record = data + seg.bytes;
+            int term, cmd_size;
+            uint32_t crc;
+            memcpy(&term, record, sizeof(int));
+            memcpy(&cmd_size, record + sizeof(int), sizeof(int));
+            memcpy(&crc, record + 2 * sizeof(int), sizeof(uint32_t));
+            if (cmd_size < 0 || seg.bytes + record_header + cmd_size > bytes
+                || log_crc32(log_crc32(0, record, 2 * sizeof(int)), record + record_header, cmd_size) != crc) {
+                break;
+            }
+            size_t idx = first + seg.offsets.size();
+            if (idx >= start_idx) {
+                command cmd;
+                cmd.deserialize(record + record_header, cmd_size);
+                log_entries.emplace_back(term, std::move(cmd));
+            }
+            seg.offsets.push_back(seg.bytes);
+            seg.bytes += record_header + cmd_size;
+        }
+        if (data) {
+            munmap((void *) data, bytes);
         }
 
-        log_storage.read(cmd_buf, cmd_size);
-        cmd.deserialize(cmd_buf, cmd_size);
-        
-        log_entries.emplace_back(term, cmd);
+        if (seg.bytes < bytes) {
+            printf("raft_storage: dropping %lu torn bytes at the end of %s\n",
+                   (unsigned long) (bytes - seg.bytes), segment_name(first).c_str());
+            if (ftruncate(fd, seg.bytes) < 0) {
+                perror("raft_storage: ftruncate");
+            }
+            broken = true;
+        }
+        segments.push_back(seg);
+        set_log_fd(fd);
     }
 
-    mtx.unlock();
+    // finish a compaction that crashed before unlinking
+    drop_compacted();
 }
 
 template<typename command>
-void raft_storage<command>::persist_snapshot(const std::vector<char> &snapshot_data) {
-    mtx.lock();
-
-    snapshot_storage.seekg(sizeof(size_t));
-    char *byte_buf = new char;
-
-    for (const char &byte : snapshot_data) {
-        *byte_buf = byte;
-        snapshot_storage.write(byte_buf, 1);
+void raft_storage<command>::write_at(int fd, const char *buf, size_t len, size_t off) {
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, off);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("raft_storage: pwrite");
+            exit(1);
+        }
+        buf += n;
+        len -= n;
+        off += n;
     }
+}
 
-    delete byte_buf;
+// Makes fd, a complete snapshot file under a temporary name, the stored
+// snapshot. The caller has renamed it; mtx must be held.
+template<typename command>
+void raft_storage<command>::replace_snapshot(int fd, const snapshot_header &hdr) {
+    close(snapshot_fd);
+    snapshot_fd = fd;
+    snapshot = hdr;
+    if (part_fd >= 0 && part.last_included_idx <= hdr.last_included_idx) {
+        close(part_fd);
+        part_fd = -1;
+        unlink((dir + "/snapshot.rft.part").c_str());
+    }
+}
 
-    char buf[sizeof(size_t)];
-    *((size_t *)buf) = snapshot_data.size();
-    snapshot_storage.seekg(0);
-    snapshot_storage.write(buf, sizeof(size_t));
+template<typename command>
+bool raft_storage<command>::persist_snapshot(int last_included_idx, int last_included_term, const std::vector<char> &snapshot_data) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (last_included_idx <= snapshot.last_included_idx) {
+        return false;
+    }
 
-    snapshot_storage.flush();
-    mtx.unlock();
+    std::string tmp_filename = dir + "/snapshot.rft.tmp";
+    int fd = open(tmp_filename.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+        perror("raft_storage: open");
+        exit(1);
+    }
+    snapshot_header hdr = {snapshot_data.size(), last_included_idx, last_included_term};
+    write_at(fd, (const char *) &hdr, sizeof(hdr), 0);
+    write_at(fd, snapshot_data.data(), snapshot_data.size(), sizeof(hdr));
+    fdatasync(fd);
+    if (rename(tmp_filename.c_str(), (dir + "/snapshot.rft").c_str()) < 0) {
+        perror("raft_storage: rename");
+        exit(1);
+    }
+    replace_snapshot(fd, hdr);
+    return true;
 }
 
 template<typename command>
-void raft_storage<command>::read_snapshot(std::vector<char> &snapshot_data) {
-    mtx.lock();
+void raft_storage<command>::read_snapshot(int &last_included_idx, int &last_included_term, std::vector<char> &snapshot_data) {
+    std::lock_guard<std::mutex> lock(mtx);
+    last_included_idx = snapshot.last_included_idx;
+    last_included_term = snapshot.last_included_term;
+    snapshot_data.resize(snapshot.size);
+    if (pread(snapshot_fd, snapshot_data.data(), snapshot.size, sizeof(snapshot)) != (ssize_t) snapshot.size) {
+        perror("raft_storage: pread");
+        snapshot_data.clear();
+    }
+}
 
-    char buf[sizeof(size_t)];
-    snapshot_storage.seekg(0);
-    snapshot_storage.read(buf, sizeof(size_t));
-    size_t size = *((size_t *)buf);
+template<typename command>
+bool raft_storage<command>::read_snapshot_chunk(size_t offset, size_t len, int &last_included_idx, int &last_included_term,
+                                                size_t &total, std::string &chunk) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (snapshot.last_included_idx < 0) {
+        return false;
+    }
+    last_included_idx = snapshot.last_included_idx;
+    last_included_term = snapshot.last_included_term;
+    total = snapshot.size;
+    offset = std::min(offset, total);
+    chunk.resize(std::min(len, total - offset));
+    if (pread(snapshot_fd, &chunk[0], chunk.size(), sizeof(snapshot) + offset) != (ssize_t) chunk.size()) {
+        perror("raft_storage: pread");
+        return false;
+    }
+    return true;
+}
 
-    char *byte_buf = new char[size];
-    snapshot_storage.read(byte_buf, size);
-    for (size_t i = 0; i < size; ++i) {
-        snapshot_data.push_back(byte_buf[i]);
+template<typename command>
+size_t raft_storage<command>::receive_snapshot_chunk(int last_included_idx, int last_included_term, size_t offset, const std::string &chunk) {
+    std::lock_guard<std::mutex> lock(mtx);
+    if (part_fd < 0 || part.last_included_idx != last_included_idx || part.last_included_term != last_included_term) {
+        if (part_fd >= 0) {
+            close(part_fd);
+        }
+        part_fd = open((dir + "/snapshot.rft.part").c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (part_fd < 0) {
+            perror("raft_storage: open");
+            exit(1);
+        }
+        part.size = 0;
+        part.last_included_idx = last_included_idx;
+        part.last_included_term = last_included_term;
+    }
+    if (offset == part.size) {
+        write_at(part_fd, chunk.data(), chunk.size(), sizeof(part) + offset);
+        part.size += chunk.size();
     }
+    return part.size;
+}
 
-    mtx.unlock();
+template<typename command>
+bool raft_storage<command>::install_received_snapshot(int last_included_idx, int last_included_term, std::vector<char> &snapshot_data) {
+    std::unique_lock<std::mutex> lock(mtx);
+    if (part_fd < 0 || part.last_included_idx != last_included_idx || part.last_included_term != last_included_term
+        || last_included_idx <= snapshot.last_included_idx) {
+        return false;
+    }
+    write_at(part_fd, (const char *) &part, sizeof(part), 0);
+    fdatasync(part_fd);
+    if (rename((dir + "/snapshot.rft.part").c_str(), (dir + "/snapshot.rft").c_str()) < 0) {
+        perror("raft_storage: rename");
+        exit(1);
+    }
+    int fd = part_fd;
+    part_fd = -1;
+    replace_snapshot(fd, part);
+    lock.unlock();
+
+    int idx, term;
+    read_snapshot(idx, term, snapshot_data);
+    return idx == last_included_idx;
 }
 
-#endif // raft_storage_h
\ No newline at end of file
+#endif // raft_storage_h
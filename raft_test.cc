@@ -3,6 +3,7 @@
  */
 
 #include "raft_test_utils.h"
+#include "chfs_state_machine.h"
 
 typedef raft_group<list_state_machine, list_command> list_raft_group;
 
@@ -419,6 +420,80 @@ TEST_CASE(part2, rpc_count, "RPC counts aren't too high") {
     delete group;
 }
 
+TEST_CASE(part2, read_index, "Reads confirmed by a quorum") {
+    int num_nodes = 3;
+    list_raft_group *group = new list_raft_group(num_nodes);
+
+    int index = group->append_new_command(10, num_nodes);
+    int leader = group->check_exact_one_leader();
+
+    int term, read_idx;
+    ASSERT(group->nodes[leader]->read_index(term, read_idx),
+           "leader " << leader << " refused a read");
+    ASSERT(read_idx >= index,
+           "read index " << read_idx << " is behind committed index " << index);
+    ASSERT(!group->nodes[(leader + 1) % num_nodes]->read_index(term, read_idx),
+           "a follower served a read");
+
+    // concurrent reads share heartbeat rounds instead of each sending one
+    int readers = 20;
+    int total1 = group->rpc_count(leader);
+    std::atomic<int> served(0);
+    std::vector<std::thread *> threads;
+    for (int i = 0; i < readers; i++) {
+        threads.push_back(new std::thread([&]() {
+            int t, idx;
+            if (group->nodes[leader]->read_index(t, idx))
+                served++;
+        }));
+    }
+    for (int i = 0; i < readers; i++) {
+        threads[i]->join();
+        delete threads[i];
+    }
+    int total2 = group->rpc_count(leader);
+    ASSERT(served == readers, "leader served " << served << " of " << readers << " reads");
+    ASSERT(total2 - total1 < readers * (num_nodes - 1) / 2,
+           "too many RPCs (" << total2 - total1 << ") for " << readers << " concurrent reads");
+
+    // a leader cut off from the majority can't confirm it still leads
+    group->disable_node((leader + 1) % num_nodes);
+    group->disable_node((leader + 2) % num_nodes);
+    ASSERT(!group->nodes[leader]->read_index(term, read_idx),
+           "partitioned leader " << leader << " served a read");
+
+    group->enable_node((leader + 1) % num_nodes);
+    group->enable_node((leader + 2) % num_nodes);
+    delete group;
+}
+
+TEST_CASE(part2, read_index_restart, "Reads after restarting from a snapshot") {
+    int num_nodes = 3;
+    list_raft_group *group = new list_raft_group(num_nodes);
+
+    for (int i = 1; i < 30; i++)
+        group->append_new_command(100 + i, num_nodes);
+    for (int i = 0; i < num_nodes; i++)
+        ASSERT(group->nodes[i]->save_snapshot(), "node " << i << " cannot save snapshot");
+    mssleep(1000);
+    for (int i = 0; i < num_nodes; i++)
+        group->restart(i);
+
+    // the new leader has nothing of its own term yet, so it must refuse
+    int leader = group->check_exact_one_leader();
+    int term, read_idx;
+    ASSERT(!group->nodes[leader]->read_index(term, read_idx),
+           "leader " << leader << " served a read before committing in its term");
+
+    int index = group->append_new_command(1024, num_nodes);
+    leader = group->check_exact_one_leader();
+    ASSERT(group->nodes[leader]->read_index(term, read_idx),
+           "leader " << leader << " refused a read");
+    ASSERT(read_idx >= index,
+           "read index " << read_idx << " is behind committed index " << index);
+    delete group;
+}
+
 TEST_CASE(part3, persist1, "Basic persistence") {
     int num_nodes = 3;
     list_raft_group *group = new list_raft_group(num_nodes);
@@ -533,6 +608,152 @@ TEST_CASE(part3, persist3,
     delete group;
 }
 
+typedef raft_storage<chfs_command_raft> chfs_storage;
+
+static const char *storage_test_dir = "raft_temp_storage";
+
+static chfs_storage *new_test_storage() {
+    remove_directory(storage_test_dir);
+    ASSERT(mkdir(storage_test_dir, 0777) >= 0, "cannot create dir " << storage_test_dir);
+    return new chfs_storage(storage_test_dir);
+}
+
+static void check_same_command(const chfs_command_raft &a, const chfs_command_raft &b) {
+    ASSERT(a.cmd_tp == b.cmd_tp && a.type == b.type && a.id == b.id && a.off == b.off
+           && a.len == b.len && a.ino == b.ino && a.client_id == b.client_id
+           && a.seq == b.seq && a.acked == b.acked, "command fields differ after replay");
+    ASSERT(a.buf.size() == b.buf.size(), "buf size " << b.buf.size() << " after replay, expected " << a.buf.size());
+    ASSERT(memcmp(a.buf.data(), b.buf.data(), a.buf.size()) == 0, "buf bytes differ after replay");
+}
+
+TEST_CASE(part3, persist_bytes, "Commands with NUL bytes survive a restart") {
+    std::string data("a\0b\0\0c", 6);
+    data += std::string(100, '\0');
+    data += "tail";
+    std::vector<log_entry<chfs_command_raft>> entries;
+    entries.emplace_back(1, chfs_command_raft(chfs_command_raft::CMD_PUT, 0, 2, data));
+    entries.emplace_back(1, chfs_command_raft(chfs_command_raft::CMD_WRITE, 0, 3, std::string(1, '\0'), 7, 1));
+    entries.emplace_back(2, chfs_command_raft(chfs_command_raft::CMD_DINSERT, 0, 1, std::string("x\0y", 3), 0, 0, 4));
+    entries[2].cmd->client_id = 0x1234567890abcdefULL;
+    entries[2].cmd->seq = 42;
+    entries[2].cmd->acked = 40;
+
+    chfs_storage *storage = new_test_storage();
+    storage->sync(storage->append_log(1, entries));
+    delete storage;
+
+    storage = new chfs_storage(storage_test_dir);
+    size_t start_idx;
+    int last_included_term;
+    std::deque<log_entry<chfs_command_raft>> log;
+    storage->read_log(start_idx, last_included_term, log);
+    ASSERT(start_idx == 0, "start_idx " << start_idx);
+    ASSERT(log.size() == entries.size() + 1, "replayed " << log.size() << " entries, expected " << entries.size() + 1);
+    for (size_t i = 0; i < entries.size(); i++) {
+        ASSERT(log[i + 1].term == entries[i].term, "term of entry " << i + 1 << " differs after replay");
+        check_same_command(*entries[i].cmd, *log[i + 1].cmd);
+    }
+    delete storage;
+    remove_directory(storage_test_dir);
+
+    // and over RPC, where they are decoded in place from the message
+    for (size_t i = 0; i < entries.size(); i++) {
+        marshall m;
+        m << *entries[i].cmd;
+        unmarshall u(m.get_content());
+        chfs_command_raft cmd;
+        u >> cmd;
+        ASSERT(u.okdone(), "entry " << i << " not decoded exactly");
+        check_same_command(*entries[i].cmd, cmd);
+    }
+}
+
+TEST_CASE(part3, persist_corrupt, "A corrupted log record ends the log") {
+    std::vector<log_entry<chfs_command_raft>> entries;
+    for (int i = 0; i < 3; i++) {
+        entries.emplace_back(1, chfs_command_raft(chfs_command_raft::CMD_PUT, 0, i + 2, std::string(16, 'a' + i)));
+    }
+
+    chfs_storage *storage = new_test_storage();
+    storage->sync(storage->append_log(1, entries));
+    delete storage;
+
+    // flip one byte of the second command: records are
+    // [int term][int cmd_size][u32 crc][cmd], entry 0 is the initial one
+    size_t record_header = 2 * sizeof(int) + sizeof(uint32_t);
+    size_t off = record_header + chfs_command_raft().size()
+               + record_header + entries[0].cmd->size()
+               + record_header + chfs_command_raft::header_size + 3;
+    std::string segment = std::string(storage_test_dir) + "/log_00000000000000000000.rft";
+    int fd = open(segment.c_str(), O_RDWR);
+    ASSERT(fd >= 0, "cannot open " << segment);
+    char c;
+    ASSERT(pread(fd, &c, 1, off) == 1, "segment too short");
+    c ^= 0x20;
+    ASSERT(pwrite(fd, &c, 1, off) == 1, "cannot write " << segment);
+    close(fd);
+
+    storage = new chfs_storage(storage_test_dir);
+    size_t start_idx;
+    int last_included_term;
+    std::deque<log_entry<chfs_command_raft>> log;
+    storage->read_log(start_idx, last_included_term, log);
+    ASSERT(log.size() == 2, "replayed " << log.size() << " entries, expected the 2 before the corrupted one");
+    check_same_command(*entries[0].cmd, *log[1].cmd);
+
+    // the log goes on from the last good record
+    storage->sync(storage->append_log(2, entries[2]));
+    delete storage;
+    storage = new chfs_storage(storage_test_dir);
+    storage->read_log(start_idx, last_included_term, log);
+    ASSERT(log.size() == 3, "replayed " << log.size() << " entries, expected 3");
+    check_same_command(*entries[2].cmd, *log[2].cmd);
+    delete storage;
+    remove_directory(storage_test_dir);
+}
+
+static chfs_command_raft tagged_create(uint64_t seq, uint64_t acked) {
+    chfs_command_raft cmd(chfs_command_raft::CMD_CRT, extent_protocol::T_FILE, 0, "");
+    cmd.client_id = 7;
+    cmd.seq = seq;
+    cmd.acked = acked;
+    return cmd;
+}
+
+TEST_CASE(part3, apply_once, "A command proposed twice is applied once") {
+    chfs_state_machine *sm = new chfs_state_machine();
+    chfs_command_raft first = tagged_create(1, 1);
+    sm->apply_log(first);
+    chfs_command_raft copy = tagged_create(1, 1);
+    sm->apply_log(copy);
+    ASSERT(copy.res->done && copy.res->id == first.res->id,
+           "the copy created inode " << copy.res->id << " besides " << first.res->id);
+
+    // the sessions travel with a snapshot
+    chfs_state_machine *restored = new chfs_state_machine();
+    restored->apply_snapshot(sm->snapshot());
+    chfs_command_raft restored_copy = tagged_create(1, 1);
+    restored->apply_log(restored_copy);
+    ASSERT(restored_copy.res->id == first.res->id,
+           "the copy created inode " << restored_copy.res->id << " after a restore");
+
+    chfs_command_raft second = tagged_create(2, 1);
+    restored->apply_log(second);
+    ASSERT(second.res->id != first.res->id, "a new command was taken for a copy");
+
+    // once acked, a late copy is dropped without running
+    chfs_command_raft third = tagged_create(3, 3);
+    restored->apply_log(third);
+    chfs_command_raft late = tagged_create(2, 1);
+    restored->apply_log(late);
+    chfs_command_raft fourth = tagged_create(4, 4);
+    restored->apply_log(fourth);
+    ASSERT(fourth.res->id == third.res->id + 1,
+           "inode " << fourth.res->id << " after " << third.res->id << ": a late copy ran");
+    delete sm;
+    delete restored;
+}
+
 void figure_8_test(list_raft_group *group, int num_tries = 100) {
     int num_nodes = 5;
     group->append_new_command(2048, 1);
@@ -667,6 +888,83 @@ TEST_CASE(part4, override_snapshot, "Overrive snapshot") {
     delete group;
 }
 
+TEST_CASE(part4, auto_snapshot, "Snapshot once the log grows") {
+    int num_nodes = 3;
+    list_raft_group *group = new list_raft_group(num_nodes);
+    for (int i = 0; i < num_nodes; i++)
+        group->nodes[i]->set_snapshot_threshold(20);
+    int leader = group->check_exact_one_leader();
+    for (int i = 1; i < 100; i++)
+        group->append_new_command(100 + i, num_nodes);
+    mssleep(2000);
+    leader = group->check_exact_one_leader();
+    group->restart(leader);
+    group->append_new_command(1024, num_nodes);
+    ASSERT(group->states[leader]->num_append_logs < 30,
+           "the log is not compacted automatically");
+    delete group;
+}
+
+TEST_CASE(part4, install_snapshot_restart, "The log a snapshot replaces stays gone after a restart") {
+    typedef raft_storage<list_command> list_storage;
+    remove_directory(storage_test_dir);
+    ASSERT(mkdir(storage_test_dir, 0777) >= 0, "cannot create dir " << storage_test_dir);
+
+    // a follower's log runs past the snapshot it is sent, in an old term
+    list_storage *storage = new list_storage(storage_test_dir);
+    std::vector<log_entry<list_command>> entries;
+    for (int i = 1; i <= 30; i++) {
+        entries.emplace_back(1, list_command(100 + i));
+    }
+    storage->sync(storage->append_log(1, entries));
+    storage->reset_log(21, 2);
+    delete storage;
+
+    storage = new list_storage(storage_test_dir);
+    size_t start_idx;
+    int last_included_term;
+    std::deque<log_entry<list_command>> log;
+    storage->read_log(start_idx, last_included_term, log);
+    ASSERT(start_idx == 21 && last_included_term == 2,
+           "log starts at " << start_idx << " after term " << last_included_term);
+    ASSERT(log.empty(), "replayed " << log.size() << " entries the snapshot replaced");
+
+    // and the log goes on from the snapshot
+    storage->sync(storage->append_log(21, log_entry<list_command>(2, list_command(1))));
+    delete storage;
+    storage = new list_storage(storage_test_dir);
+    storage->read_log(start_idx, last_included_term, log);
+    ASSERT(log.size() == 1 && log[0].term == 2 && log[0].cmd->value == 1,
+           "replayed " << log.size() << " entries after the snapshot");
+    delete storage;
+    remove_directory(storage_test_dir);
+}
+
+TEST_CASE(part4, unreliable_snapshot, "Snapshot install under unreliable network") {
+    int num_nodes = 3;
+    list_raft_group *group = new list_raft_group(num_nodes);
+    int leader = group->check_exact_one_leader();
+    int killed_node = (leader + 1) % num_nodes;
+    group->disable_node(killed_node);
+    for (int i = 1; i < 100; i++)
+        group->append_new_command(100 + i, num_nodes - 1);
+    // the unreliable network may move leadership, so every node that
+    // could lead must only have a snapshot to catch killed_node up from
+    mssleep(1000);
+    for (int i = 0; i < num_nodes; i++) {
+        if (i != killed_node) {
+            ASSERT(group->nodes[i]->save_snapshot(), "node " << i << " cannot save snapshot");
+        }
+    }
+    group->set_reliable(false);
+    group->enable_node(killed_node);
+    group->append_new_command(1024, num_nodes);
+    group->set_reliable(true);
+    ASSERT(group->states[killed_node]->num_append_logs < 90,
+           "the snapshot is not installed");
+    delete group;
+}
+
 int main(int argc, char **argv) {
     unit_test_suite::instance()->run(argc, argv);
     return 0;
@@ -164,11 +164,13 @@ public:
   std::vector<std::vector<rpcc *>> clients;
   std::vector<raft_storage<command> *> storages;
   std::vector<state_machine *> states;
+  std::string storage_dir;
 };
 
 template <typename state_machine, typename command>
 raft_group<state_machine, command>::raft_group(int num,
-                                               const char *storage_dir) {
+                                               const char *storage_dir)
+    : storage_dir(storage_dir) {
     // printf("raft_group created begin\n");
     nodes.resize(num, nullptr);
     servers = create_random_rpc_servers(num);
@@ -449,7 +451,7 @@ int raft_group<state_machine, command>::restart(int node) {
   delete states[node];
   states[node] = new state_machine();
   raft_storage<command> *storage = new raft_storage<command>(
-      std::string("raft_temp/raft_storage_") + std::to_string(node));
+      storage_dir + "/raft_storage_" + std::to_string(node));
   // recreate clients
   for (auto &cl : clients[node])
     delete cl;
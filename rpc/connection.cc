@@ -1,6 +1,7 @@
 #include <fcntl.h>
 #include <sys/types.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <netinet/tcp.h>
 #include <errno.h>
 #include <signal.h>
@@ -10,15 +11,18 @@
 #include "connection.h"
 #include "slock.h"
 #include "pollmgr.h"
+#include "pdu_pool.h"
 #include "jsl_log.h"
 #include "gettime.h"
 #include "lang/verify.h"
 
 #define MAX_PDU (10<<20) //maximum PDF is 10M
+#define MAX_QUEUED (16<<20) //senders wait while this much is unwritten
+#define MAX_WRITEV 64 //PDUs handed to one writev
 
 
-connection::connection(chanmgr *m1, int f1, int l1) 
-: mgr_(m1), fd_(f1), dead_(false),waiters_(0), refno_(1),lossy_(l1)
+connection::connection(chanmgr *m1, int f1, int l1, int reactor) 
+: mgr_(m1), fd_(f1), dead_(false), wq_bytes_(0), writing_(false), refno_(1),lossy_(l1)
 {
 
 	int flags = fcntl(fd_, F_GETFL, NULL);
@@ -29,11 +33,11 @@ connection::connection(chanmgr *m1, int f1, int l1)
 	VERIFY(pthread_mutex_init(&m_,0)==0);
 	VERIFY(pthread_mutex_init(&ref_m_,0)==0);
 	VERIFY(pthread_cond_init(&send_wait_,0)==0);
-	VERIFY(pthread_cond_init(&send_complete_,0)==0);
  
         VERIFY(gettimeofday(&create_time_, NULL) == 0); 
 
-	PollMgr::Instance()->add_callback(fd_, CB_RDONLY, this);
+	PollMgr::assign(fd_, reactor >= 0 ? reactor : fd_);
+	PollMgr::Instance(fd_)->add_callback(fd_, CB_RDONLY, this);
 }
 
 connection::~connection()
@@ -42,10 +46,11 @@ connection::~connection()
 	VERIFY(pthread_mutex_destroy(&m_)== 0);
 	VERIFY(pthread_mutex_destroy(&ref_m_)== 0);
 	VERIFY(pthread_cond_destroy(&send_wait_) == 0);
-	VERIFY(pthread_cond_destroy(&send_complete_) == 0);
-	if (rpdu_.buf)
-		free(rpdu_.buf);
-	VERIFY(!wpdu_.buf);
+	pdu_free(rpdu_.buf);
+	while (!wq_.empty()) {
+		pdu_free(wq_.front().buf);
+		wq_.pop_front();
+	}
 	close(fd_);
 }
 
@@ -77,7 +82,7 @@ connection::closeconn()
 	}
 	//after block_remove_fd, select will never wait on fd_ 
 	//and no callbacks will be active
-	PollMgr::Instance()->block_remove_fd(fd_);
+	PollMgr::Instance(fd_)->block_remove_fd(fd_);
 }
 
 void
@@ -124,17 +129,23 @@ bool
 connection::send(char *b, int sz)
 {
 	ScopedLock ml(&m_);
-	waiters_++;
-	while (!dead_ && wpdu_.buf) {
+	//a PDU bigger than the limit still goes out once the queue is empty.
+	//a reactor thread (e.g. an async completion) never waits: it may be
+	//the very thread that drains the queue
+	bool reactor = PollMgr::in_reactor();
+	while (!reactor && !dead_ && wq_bytes_ > 0 && wq_bytes_ + sz > MAX_QUEUED) {
 		VERIFY(pthread_cond_wait(&send_wait_, &m_)==0);
 	}
-	waiters_--;
 	if (dead_) {
 		return false;
 	}
-	wpdu_.buf = b;
-	wpdu_.sz = sz;
-	wpdu_.solong = 0;
+
+	uint32_t nsz;
+	memcpy(&nsz, b, sizeof(nsz));
+	VERIFY(ntohl(nsz) == (uint32_t)sz);
+	pdu_ref(b);
+	wq_.push_back(charbuf(b, sz));
+	wq_bytes_ += sz;
 
 	if (lossy_) {
 		if ((random()%100) < lossy_) {
@@ -143,27 +154,25 @@ connection::send(char *b, int sz)
 		}
 	}
 
-	if (!writepdu()) {
+	if (writing_) {
+		//whoever is writing will pick it up
+		return true;
+	}
+	if (!flush()) {
 		dead_ = true;
+		VERIFY(pthread_cond_broadcast(&send_wait_) == 0);
+		if (reactor) {
+			//block_remove_fd waits for a reactor to come around,
+			//which may be us; do what read_cb/write_cb do instead
+			PollMgr::Instance(fd_)->del_callback(fd_, CB_RDWR);
+			return false;
+		}
 		VERIFY(pthread_mutex_unlock(&m_) == 0);
-		PollMgr::Instance()->block_remove_fd(fd_);
+		PollMgr::Instance(fd_)->block_remove_fd(fd_);
 		VERIFY(pthread_mutex_lock(&m_) == 0);
-	}else{
-		if (wpdu_.solong == wpdu_.sz) {
-		}else{
-			//should be rare to need to explicitly add write callback
-			PollMgr::Instance()->add_callback(fd_, CB_WRONLY, this);
-			while (!dead_ && wpdu_.solong >= 0 && wpdu_.solong < wpdu_.sz) {
-				VERIFY(pthread_cond_wait(&send_complete_,&m_) == 0);
-			}
-		}
+		return false;
 	}
-	bool ret = (!dead_ && wpdu_.solong == wpdu_.sz);
-	wpdu_.solong = wpdu_.sz = 0;
-	wpdu_.buf = NULL;
-	if (waiters_ > 0)
-		pthread_cond_broadcast(&send_wait_);
-	return ret;
+	return true;
 }
 
 //fd_ is ready to be written
@@ -171,22 +180,19 @@ void
 connection::write_cb(int s)
 {
 	ScopedLock ml(&m_);
-	VERIFY(!dead_);
 	VERIFY(fd_ == s);
-	if (wpdu_.sz == 0) {
-		PollMgr::Instance()->del_callback(fd_,CB_WRONLY);
+	if (dead_ || writing_) {
+		return;
+	}
+	if (wq_.empty()) {
+		PollMgr::Instance(fd_)->del_callback(fd_,CB_WRONLY);
 		return;
 	}
-	if (!writepdu()) {
-		PollMgr::Instance()->del_callback(fd_, CB_RDWR);
+	if (!flush()) {
+		PollMgr::Instance(fd_)->del_callback(fd_, CB_RDWR);
 		dead_ = true;
-	}else{
-		VERIFY(wpdu_.solong >= 0);
-		if (wpdu_.solong < wpdu_.sz) {
-			return;
-		}
-	} 
-	pthread_cond_signal(&send_complete_);
+		VERIFY(pthread_cond_broadcast(&send_wait_) == 0);
+	}
 }
 
 //fd_ is ready to be read
@@ -205,13 +211,18 @@ connection::read_cb(int s)
 	}
 
 	if (!succ) {
-		PollMgr::Instance()->del_callback(fd_,CB_RDWR);
+		PollMgr::Instance(fd_)->del_callback(fd_,CB_RDWR);
 		dead_ = true;
-		pthread_cond_signal(&send_complete_);
+		VERIFY(pthread_cond_broadcast(&send_wait_) == 0);
 	}
 
 	if (rpdu_.buf && rpdu_.sz == rpdu_.solong) {
-		if (mgr_->got_pdu(this, rpdu_.buf, rpdu_.sz)) {
+		//only our PollMgr's thread touches rpdu_, so m_ can be let go;
+		//got_pdu may well send on this connection
+		VERIFY(pthread_mutex_unlock(&m_) == 0);
+		bool taken = mgr_->got_pdu(this, rpdu_.buf, rpdu_.sz);
+		VERIFY(pthread_mutex_lock(&m_) == 0);
+		if (taken) {
 			//chanmgr has successfully consumed the pdu
 			rpdu_.buf = NULL;
 			rpdu_.sz = rpdu_.solong = 0;
@@ -219,28 +230,62 @@ connection::read_cb(int s)
 	}
 }
 
+//write out as much of wq_ as the socket takes, up to MAX_WRITEV PDUs
+//per writev. m_ is released around the syscall so that other senders
+//can queue up behind it; writing_ keeps them from flushing meanwhile.
+//if the socket fills up, write_cb finishes the job.
+//returns false if the connection failed.
 bool
-connection::writepdu()
+connection::flush()
 {
-	VERIFY(wpdu_.solong >= 0);
-	if (wpdu_.solong == wpdu_.sz)
-		return true;
+	VERIFY(!writing_);
+	writing_ = true;
+	bool ok = true;
+	while (!dead_ && !wq_.empty()) {
+		struct iovec iov[MAX_WRITEV];
+		int cnt = 0;
+		size_t want = 0;
+		std::deque<charbuf>::iterator i;
+		for (i = wq_.begin(); i != wq_.end() && cnt < MAX_WRITEV; i++, cnt++) {
+			iov[cnt].iov_base = i->buf + i->solong;
+			iov[cnt].iov_len = i->sz - i->solong;
+			want += iov[cnt].iov_len;
+		}
 
-	if (wpdu_.solong == 0) {
-		int sz = htonl(wpdu_.sz);
-		bcopy(&sz,wpdu_.buf,sizeof(sz));
-	}
-	int n = write(fd_, wpdu_.buf + wpdu_.solong, (wpdu_.sz-wpdu_.solong));
-	if (n < 0) {
-		if (errno != EAGAIN) {
-			jsl_log(JSL_DBG_1, "connection::writepdu fd_ %d failure errno=%d\n", fd_, errno);
-			wpdu_.solong = -1;
-			wpdu_.sz = 0;
+		VERIFY(pthread_mutex_unlock(&m_) == 0);
+		ssize_t n = writev(fd_, iov, cnt);
+		int err = errno;
+		VERIFY(pthread_mutex_lock(&m_) == 0);
+
+		if (n < 0) {
+			if (err != EAGAIN) {
+				jsl_log(JSL_DBG_1, "connection::flush fd_ %d failure errno=%d\n", fd_, err);
+				ok = false;
+			}
+			break;
+		}
+		bool full = (size_t)n < want;
+		while (n > 0) {
+			charbuf &p = wq_.front();
+			if (n < p.sz - p.solong) {
+				p.solong += n;
+				break;
+			}
+			n -= p.sz - p.solong;
+			wq_bytes_ -= p.sz;
+			pdu_free(p.buf);
+			wq_.pop_front();
+		}
+		VERIFY(pthread_cond_broadcast(&send_wait_) == 0);
+		if (full) {
+			break;
 		}
-		return (errno == EAGAIN);
 	}
-	wpdu_.solong += n;
-	return true;
+	writing_ = false;
+	if (ok && !dead_ && !wq_.empty()) {
+		PollMgr::Instance(fd_)->add_callback(fd_, CB_WRONLY, this);
+	}
+	return ok;
 }
 
 bool
@@ -275,8 +320,7 @@ connection::readpdu()
 
 		rpdu_.sz = sz;
 		VERIFY(rpdu_.buf == NULL);
-		rpdu_.buf = (char *)malloc(sz+sizeof(sz));
-		VERIFY(rpdu_.buf);
+		rpdu_.buf = pdu_alloc(sz+sizeof(sz));
 		bcopy(&sz1,rpdu_.buf,sizeof(sz));
 		rpdu_.solong = sizeof(sz);
 	}
@@ -285,8 +329,7 @@ connection::readpdu()
 	if (n <= 0) {
 		if (errno == EAGAIN)
 			return true;
-		if (rpdu_.buf)
-			free(rpdu_.buf);
+		pdu_free(rpdu_.buf);
 		rpdu_.buf = NULL;
 		rpdu_.sz = rpdu_.solong = 0;
 		return (errno == EAGAIN);
@@ -301,50 +344,84 @@ tcpsconn::tcpsconn(chanmgr *m1, int port, int lossytest)
 
 	VERIFY(pthread_mutex_init(&m_,NULL) == 0);
 
+	//one listening socket per reactor, so that accepting is spread
+	//over several threads; the kernel balances new connections
+	//across sockets sharing a port with SO_REUSEPORT. The first
+	//socket stays reactor 0's listener, so the port is never let go
+	//between binds; a port some other socket holds without
+	//SO_REUSEPORT still fails its bind.
+	int n = PollMgr::reactors();
+	tcp_.push_back(listen_on(port, n > 1));
+	if (port == 0) {
+		port = ntohs(this->port());
+	}
+	for (int i = 1; i < n; i++) {
+		tcp_.push_back(listen_on(port, true));
+	}
+
+	jsl_log(JSL_DBG_2, "tcpsconn::tcpsconn listen on %d with %d sockets\n",
+		port, n);
+
+	if (pipe(pipe_) < 0) {
+		perror("accept_loop pipe:");
+		VERIFY(0);
+	}
+
+	int flags = fcntl(pipe_[0], F_GETFL, NULL);
+	flags |= O_NONBLOCK;
+	fcntl(pipe_[0], F_SETFL, flags);
+
+	for (unsigned i = 0; i < tcp_.size(); i++) {
+		pthread_t th;
+		VERIFY((th = method_thread(this, false, &tcpsconn::accept_conn,
+				(int)i)) != 0);
+		th_.push_back(th);
+	}
+}
+
+int
+tcpsconn::listen_on(int port, bool reuseport)
+{
 	struct sockaddr_in sin;
 	memset(&sin, 0, sizeof(sin));
 	sin.sin_family = AF_INET;
 	sin.sin_port = htons(port);
 
-	tcp_ = socket(AF_INET, SOCK_STREAM, 0);
-	if(tcp_ < 0){
+	int s = socket(AF_INET, SOCK_STREAM, 0);
+	if(s < 0){
 		perror("tcpsconn::tcpsconn accept_loop socket:");
 		VERIFY(0);
 	}
 
 	int yes = 1;
-	setsockopt(tcp_, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
-	setsockopt(tcp_, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+	setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+#ifdef SO_REUSEPORT
+	if (reuseport) {
+		setsockopt(s, SOL_SOCKET, SO_REUSEPORT, &yes, sizeof(yes));
+	}
+#endif
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
 
-	if(bind(tcp_, (sockaddr *)&sin, sizeof(sin)) < 0){
+	if(bind(s, (sockaddr *)&sin, sizeof(sin)) < 0){
 		perror("accept_loop tcp bind:");
 		VERIFY(0);
 	}
 
-	if(listen(tcp_, 1000) < 0) {
+	if(listen(s, 1000) < 0) {
 		perror("tcpsconn::tcpsconn listen:");
 		VERIFY(0);
 	}
-
-	jsl_log(JSL_DBG_2, "tcpsconn::tcpsconn listen on %d %d\n", port, 
-		sin.sin_port);
-
-	if (pipe(pipe_) < 0) {
-		perror("accept_loop pipe:");
-		VERIFY(0);
-	}
-
-	int flags = fcntl(pipe_[0], F_GETFL, NULL);
-	flags |= O_NONBLOCK;
-	fcntl(pipe_[0], F_SETFL, flags);
-
-	VERIFY((th_ = method_thread(this, false, &tcpsconn::accept_conn)) != 0); 
+	return s;
 }
 
 tcpsconn::~tcpsconn()
 {
+	//wakes up every accept thread
 	VERIFY(close(pipe_[1]) == 0);
-	VERIFY(pthread_join(th_, NULL) == 0);
+	for (unsigned i = 0; i < th_.size(); i++) {
+		VERIFY(pthread_join(th_[i], NULL) == 0);
+	}
+	close(pipe_[0]);
 
 	//close all the active connections
 	std::map<int, connection *>::iterator i;
@@ -359,7 +436,7 @@ tcpsconn::port()
 {
 	struct sockaddr_in sin;
 	socklen_t len = sizeof(sin);
-	if (getsockname(tcp_, (sockaddr *)&sin, &len) < 0) {
+	if (getsockname(tcp_[0], (sockaddr *)&sin, &len) < 0) {
 		perror("tcpsconn::tcpsconn getsockname:");
 		VERIFY(0);
 	}
@@ -367,11 +444,11 @@ tcpsconn::port()
 }
 
 void
-tcpsconn::process_accept()
+tcpsconn::process_accept(int li)
 {
 	sockaddr_in sin;
 	socklen_t slen = sizeof(sin);
-	int s1 = accept(tcp_, (sockaddr *)&sin, &slen); 
+	int s1 = accept(tcp_[li], (sockaddr *)&sin, &slen); 
 	if (s1 < 0) {
 		perror("tcpsconn::accept_conn error");
 		pthread_exit(NULL);
@@ -379,8 +456,9 @@ tcpsconn::process_accept()
 
 	jsl_log(JSL_DBG_2, "accept_loop got connection fd=%d %s:%d\n", 
 			s1, inet_ntoa(sin.sin_addr), ntohs(sin.sin_port));
-	connection *ch = new connection(mgr_, s1, lossy_);
+	connection *ch = new connection(mgr_, s1, lossy_, li);
 
+	ScopedLock ml(&m_);
         // garbage collect all dead connections with refcount of 1
         std::map<int, connection *>::iterator i;
         for (i = conns_.begin(); i != conns_.end();) {
@@ -401,15 +479,16 @@ tcpsconn::process_accept()
 }
 
 void
-tcpsconn::accept_conn()
+tcpsconn::accept_conn(int li)
 {
+	int tcp = tcp_[li];
 	fd_set rfds;
-	int max_fd = pipe_[0] > tcp_ ? pipe_[0] : tcp_;
+	int max_fd = pipe_[0] > tcp ? pipe_[0] : tcp;
 
 	while (1) { 
 		FD_ZERO(&rfds);
 		FD_SET(pipe_[0], &rfds);
-		FD_SET(tcp_, &rfds);
+		FD_SET(tcp, &rfds);
 
 		int ret = select(max_fd+1, &rfds, NULL, NULL, NULL);
 
@@ -424,12 +503,12 @@ tcpsconn::accept_conn()
 		}
 
 		if (FD_ISSET(pipe_[0], &rfds)) {
-			close(pipe_[0]);
-			close(tcp_);
+			//the destructor closes pipe_[0] once all of us are gone
+			close(tcp);
 			return;
 		}
-		else if (FD_ISSET(tcp_, &rfds)) {
-			process_accept();
+		else if (FD_ISSET(tcp, &rfds)) {
+			process_accept(li);
 		} else {
 			VERIFY(0);
 		}
@@ -7,7 +7,9 @@
 #include <netinet/in.h>
 #include <cstddef>
 
+#include <deque>
 #include <map>
+#include <vector>
 
 #include "pollmgr.h"
 
@@ -29,13 +31,20 @@ class connection : public aio_callback {
 			int solong; //amount of bytes written or read so far
 		};
 
-		connection(chanmgr *m1, int f1, int lossytest=0);
+		//watched by reactor f1 % PollMgr::reactors() unless the
+		//reactor is given
+		connection(chanmgr *m1, int f1, int lossytest=0, int reactor=-1);
 		~connection();
 
 		int channo() { return fd_; }
 		bool isdead();
 		void closeconn();
 
+		// Queues the PDU and returns without waiting for it to reach
+		// the socket; false if the connection is dead. b is a pdu_pool
+		// buffer with its size packed in front, as marshall leaves it;
+		// the queue takes its own reference, so the caller keeps its
+		// one but must not change the buffer any more.
 		bool send(char *b, int sz);
 		void write_cb(int s);
 		void read_cb(int s);
@@ -48,25 +57,25 @@ class connection : public aio_callback {
 	private:
 
 		bool readpdu();
-		bool writepdu();
+		bool flush();
 
 		chanmgr *mgr_;
 		const int fd_;
 		bool dead_;
 
-		charbuf wpdu_;
+		std::deque<charbuf> wq_; // PDUs not yet fully written, oldest first
+		int wq_bytes_;
+		bool writing_; // some thread is draining wq_
 		charbuf rpdu_;
                 
                 struct timeval create_time_;
 
-		int waiters_;
 		int refno_;
 		const int lossy_;
 
 		pthread_mutex_t m_;
 		pthread_mutex_t ref_m_;
-		pthread_cond_t send_complete_;
-		pthread_cond_t send_wait_;
+		pthread_cond_t send_wait_; // wq_ has room, or the connection died
 };
 
 class tcpsconn {
@@ -74,20 +83,24 @@ class tcpsconn {
 		tcpsconn(chanmgr *m1, int port, int lossytest=0);
 		~tcpsconn();
 
-		void accept_conn();
+		void accept_conn(int li);
 		int port();
 	private:
 
-		pthread_mutex_t m_;
-		pthread_t th_;
+		pthread_mutex_t m_; // protects conns_
+		std::vector<pthread_t> th_;
 		int pipe_[2];
 
-		int tcp_; //file desciptor for accepting connection
+		//file desciptors for accepting connection, one per reactor,
+		//all bound to the same port with SO_REUSEPORT; what tcp_[li]
+		//accepts is served by reactor li
+		std::vector<int> tcp_;
 		chanmgr *mgr_;
 		int lossy_;
 		std::map<int, connection *> conns_;
 
-		void process_accept();
+		int listen_on(int port, bool reuseport);
+		void process_accept(int li);
 };
 
 struct bundle {
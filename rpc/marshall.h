@@ -12,6 +12,7 @@
 #include <inttypes.h>
 #include "lang/verify.h"
 #include "lang/algorithm.h"
+#include "pdu_pool.h"
 
 struct req_header {
 	req_header(int x=0, int p=0, int c = 0, int s = 0, int xi = 0):
@@ -43,6 +44,8 @@ enum {
 #endif
 };
 
+// marshall and unmarshall keep their bytes in pdu_pool buffers; a
+// buffer handed out by take_buf() is released with pdu_free().
 class marshall {
 	private:
 		char *_buf;     // Base of the raw bytes buffer (dynamically readjusted)
@@ -51,15 +54,13 @@ class marshall {
 
 	public:
 		marshall() {
-			_buf = (char *) malloc(sizeof(char)*DEFAULT_RPC_SZ);
-			VERIFY(_buf);
-			_capa = DEFAULT_RPC_SZ;
+			_buf = pdu_alloc(DEFAULT_RPC_SZ);
+			_capa = pdu_capacity(_buf);
 			_ind = RPC_HEADER_SZ;
 		}
 
 		~marshall() { 
-			if (_buf) 
-				free(_buf); 
+			pdu_free(_buf); 
 		}
 
 		int size() { return _ind;}
@@ -82,8 +83,9 @@ class marshall {
 
 		void pack_req_header(const req_header &h) {
 			int saved_sz = _ind;
-			//leave the first 4-byte empty for channel to fill size of pdu
-			_ind = sizeof(rpc_sz_t); 
+			//the first 4 bytes hold the size of the pdu
+			_ind = 0;
+			pack(saved_sz);
 #if RPC_CHECKSUMMING
 			_ind += sizeof(rpc_checksum_t);
 #endif
@@ -97,8 +99,9 @@ class marshall {
 
 		void pack_reply_header(const reply_header &h) {
 			int saved_sz = _ind;
-			//leave the first 4-byte empty for channel to fill size of pdu
-			_ind = sizeof(rpc_sz_t); 
+			//the first 4 bytes hold the size of the pdu
+			_ind = 0;
+			pack(saved_sz);
 #if RPC_CHECKSUMMING
 			_ind += sizeof(rpc_checksum_t);
 #endif
@@ -140,7 +143,7 @@ class unmarshall {
 			take_content(s);
 		}
 		~unmarshall() {
-			if (_buf) free(_buf);
+			pdu_free(_buf);
 		}
 
 		//take contents from another unmarshall object
@@ -149,8 +152,8 @@ class unmarshall {
 		//take the content which does not exclude a RPC header from a string
 		void take_content(const std::string &s) {
 			_sz = s.size()+RPC_HEADER_SZ;
-			_buf = (char *)realloc(_buf,_sz);
-			VERIFY(_buf);
+			pdu_free(_buf);
+			_buf = pdu_alloc(_sz);
 			_ind = RPC_HEADER_SZ;
 			memcpy(_buf+_ind, s.data(), s.size());
 			_ok = true;
@@ -161,6 +164,15 @@ class unmarshall {
 		bool okdone();
 		unsigned int rawbyte();
 		void rawbytes(std::string &s, unsigned int n);
+		//the next n bytes in place, valid as long as this object
+		const char *rawptr(unsigned int n) {
+			if ((_ind+n) > (unsigned)_sz) {
+				_ok = false;
+				return NULL;
+			}
+			_ind += n;
+			return _buf+_ind-n;
+		}
 
 		int ind() { return _ind;}
 		int size() { return _sz;}
@@ -0,0 +1,247 @@
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <atomic>
+#include <new>
+
+#include "pdu_pool.h"
+#include "lang/verify.h"
+
+#define PDU_CLASSES 15 //PDU_MIN_CLASS << 14 == PDU_MAX_CLASS
+#define PDU_CACHE_BYTES (512<<10) //kept by each thread, over all classes
+#define PDU_DEPOT_BYTES (8<<20) //kept in the depot, over all classes
+#define PDU_BATCH 16 //most buffers moved between a cache and the depot at once
+
+//sits right in front of every buffer
+struct pdu_hdr {
+	std::atomic<int> refs;
+	int cls; //size class, or -1 if malloc'd to size
+	int capa; //bytes after the header
+	int pad; //keeps the buffer as aligned as malloc's
+};
+
+//free buffers of one size class, linked through their first bytes
+struct pdu_list {
+	char *head;
+	int count;
+};
+
+//a thread's cache; zero-initialized like any thread_local
+struct pdu_cache {
+	pdu_list lists[PDU_CLASSES];
+	long bytes;
+	bool gone;
+	~pdu_cache();
+};
+
+static pthread_mutex_t depot_m = PTHREAD_MUTEX_INITIALIZER;
+static pdu_list depot[PDU_CLASSES];
+static long depot_bytes;
+static thread_local pdu_cache cache;
+
+static inline pdu_hdr *
+hdr(const char *b)
+{
+	return (pdu_hdr *)(b - sizeof(pdu_hdr));
+}
+
+static inline int
+class_size(int cls)
+{
+	return PDU_MIN_CLASS << cls;
+}
+
+static inline int
+size_class(int sz)
+{
+	int cls = 0;
+	while (class_size(cls) < sz)
+		cls++;
+	return cls;
+}
+
+//how many buffers of a class to move at once: a quarter of the
+//cache's worth, within [1, PDU_BATCH]
+static inline int
+batch(int cls)
+{
+	int n = PDU_CACHE_BYTES / 4 / class_size(cls);
+	return n < 1 ? 1 : n > PDU_BATCH ? PDU_BATCH : n;
+}
+
+static inline void
+push(pdu_list *l, char *b)
+{
+	*(char **)b = l->head;
+	l->head = b;
+	l->count++;
+}
+
+static inline char *
+pop(pdu_list *l)
+{
+	char *b = l->head;
+	if (b) {
+		l->head = *(char **)b;
+		l->count--;
+	}
+	return b;
+}
+
+static pdu_hdr *
+new_buffer(int cls, int capa)
+{
+	void *m = malloc(sizeof(pdu_hdr) + capa);
+	VERIFY(m);
+	pdu_hdr *h = new (m) pdu_hdr;
+	h->cls = cls;
+	h->capa = capa;
+	return h;
+}
+
+//move up to n buffers from one list to another; returns how many
+static int
+move(pdu_list *from, pdu_list *to, int n)
+{
+	int moved = 0;
+	char *b;
+	while (moved < n && (b = pop(from)) != NULL) {
+		push(to, b);
+		moved++;
+	}
+	return moved;
+}
+
+//hand the buffers of class cls on l back to the depot, and to the
+//system those the depot has no room for
+static void
+release(int cls, pdu_list *l)
+{
+	pdu_list spill = { NULL, 0 };
+	pthread_mutex_lock(&depot_m);
+	char *b;
+	while ((b = pop(l)) != NULL) {
+		if (depot_bytes + class_size(cls) <= PDU_DEPOT_BYTES) {
+			push(&depot[cls], b);
+			depot_bytes += class_size(cls);
+		} else {
+			push(&spill, b);
+		}
+	}
+	pthread_mutex_unlock(&depot_m);
+	while ((b = pop(&spill)) != NULL)
+		free(hdr(b));
+}
+
+pdu_cache::~pdu_cache()
+{
+	gone = true;
+	for (int cls = 0; cls < PDU_CLASSES; cls++)
+		release(cls, &lists[cls]);
+	bytes = 0;
+}
+
+static char *
+take(int cls)
+{
+	pdu_list *l = &cache.lists[cls];
+	if (!l->head) {
+		pthread_mutex_lock(&depot_m);
+		if (cache.gone) {
+			char *b = pop(&depot[cls]);
+			if (b)
+				depot_bytes -= class_size(cls);
+			pthread_mutex_unlock(&depot_m);
+			return b;
+		}
+		int n = move(&depot[cls], l, batch(cls));
+		depot_bytes -= (long)n * class_size(cls);
+		pthread_mutex_unlock(&depot_m);
+		cache.bytes += (long)n * class_size(cls);
+	}
+	char *b = pop(l);
+	if (b)
+		cache.bytes -= class_size(cls);
+	return b;
+}
+
+static void
+put(int cls, char *b)
+{
+	pdu_list spill = { NULL, 0 };
+	if (cache.gone) {
+		push(&spill, b);
+		release(cls, &spill);
+		return;
+	}
+	push(&cache.lists[cls], b);
+	cache.bytes += class_size(cls);
+
+	//over budget: spill a batch of this class, which is what this
+	//thread frees more than it allocates, then the largest others
+	for (int i = PDU_CLASSES; i >= 0 && cache.bytes > PDU_CACHE_BYTES; i--) {
+		int c = i == PDU_CLASSES ? cls : i;
+		int n = move(&cache.lists[c], &spill, batch(c));
+		cache.bytes -= (long)n * class_size(c);
+		release(c, &spill);
+	}
+}
+
+char *
+pdu_alloc(int sz)
+{
+	VERIFY(sz >= 0);
+	pdu_hdr *h;
+	if (sz > PDU_MAX_CLASS) {
+		h = new_buffer(-1, sz);
+	} else {
+		int cls = size_class(sz);
+		char *b = take(cls);
+		if (b) {
+			h = hdr(b);
+		} else {
+			h = new_buffer(cls, class_size(cls));
+		}
+	}
+	h->refs.store(1, std::memory_order_relaxed);
+	return (char *)(h + 1);
+}
+
+char *
+pdu_grow(char *b, int used, int sz)
+{
+	if (sz <= pdu_capacity(b))
+		return b;
+	VERIFY(hdr(b)->refs.load(std::memory_order_relaxed) == 1);
+	char *nb = pdu_alloc(sz);
+	memcpy(nb, b, used);
+	pdu_free(b);
+	return nb;
+}
+
+int
+pdu_capacity(const char *b)
+{
+	return hdr(b)->capa;
+}
+
+void
+pdu_ref(char *b)
+{
+	hdr(b)->refs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void
+pdu_free(char *b)
+{
+	if (!b)
+		return;
+	pdu_hdr *h = hdr(b);
+	if (h->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+	if (h->cls < 0) {
+		free(h);
+	} else {
+		put(h->cls, b);
+	}
+}
@@ -0,0 +1,36 @@
+#ifndef pdu_pool_h
+#define pdu_pool_h
+
+// Buffers for PDUs: marshall/unmarshall contents, PDUs read off and
+// queued onto connections, and replies kept for at-most-once.
+//
+// Buffers come in power-of-two size classes from PDU_MIN_CLASS up to
+// PDU_MAX_CLASS bytes; bigger ones go straight to malloc. Freed
+// buffers are kept in a small per-thread cache, which spills to and
+// refills from a shared depot in batches, so a steady stream of RPCs
+// does not call malloc at all. Each cache and the depot hold a bounded
+// number of bytes over all classes; what does not fit is freed.
+//
+// Each buffer is reference counted. pdu_alloc() returns a buffer
+// holding one reference, pdu_ref() adds one and pdu_free() drops one,
+// returning the buffer to the pool with the last; like free(),
+// pdu_free(NULL) does nothing. The contents of a buffer with more
+// than one reference must not change.
+
+#define PDU_MIN_CLASS (1<<6)
+#define PDU_MAX_CLASS (1<<20)
+
+// a buffer of at least sz bytes
+char *pdu_alloc(int sz);
+
+// a buffer of at least sz bytes holding the first used bytes of b,
+// which it replaces. b must not be shared.
+char *pdu_grow(char *b, int used, int sz);
+
+// the number of bytes b can hold
+int pdu_capacity(const char *b);
+
+void pdu_ref(char *b);
+void pdu_free(char *b);
+
+#endif
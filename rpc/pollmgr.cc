@@ -9,27 +9,68 @@
 #include "lang/verify.h"
 #include "pollmgr.h"
 
-PollMgr *PollMgr::instance = NULL;
+static thread_local bool reactor_thread = false;
+
+PollMgr **PollMgr::instances = NULL;
+int PollMgr::ninstances = 0;
+std::atomic<unsigned char> PollMgr::owners[MAX_POLL_FDS];
 static pthread_once_t pollmgr_is_initialized = PTHREAD_ONCE_INIT;
 
 void
 PollMgrInit()
 {
-	PollMgr::instance = new PollMgr();
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) {
+		n = 1;
+	} else if (n > MAX_REACTORS) {
+		n = MAX_REACTORS;
+	}
+	PollMgr::instances = new PollMgr *[n];
+	for (int i = 0; i < n; i++) {
+		PollMgr::instances[i] = new PollMgr();
+	}
+	PollMgr::ninstances = n;
 }
 
 PollMgr *
-PollMgr::Instance()
+PollMgr::Instance(int fd)
+{
+	pthread_once(&pollmgr_is_initialized, PollMgrInit);
+	VERIFY(fd >= 0 && fd < MAX_POLL_FDS);
+	return instances[owners[fd].load(std::memory_order_relaxed)];
+}
+
+void
+PollMgr::assign(int fd, int r)
 {
 	pthread_once(&pollmgr_is_initialized, PollMgrInit);
-	return instance;
+	VERIFY(fd >= 0 && fd < MAX_POLL_FDS);
+	owners[fd].store(r % ninstances, std::memory_order_relaxed);
+}
+
+bool
+PollMgr::in_reactor()
+{
+	return reactor_thread;
+}
+
+int
+PollMgr::reactors()
+{
+	pthread_once(&pollmgr_is_initialized, PollMgrInit);
+	return ninstances;
 }
 
 PollMgr::PollMgr() : pending_change_(false)
 {
-	bzero(callbacks_, MAX_POLL_FDS*sizeof(void *));
+	for (int i = 0; i < MAX_POLL_FDS; i++) {
+		callbacks_[i].store(NULL, std::memory_order_relaxed);
+	}
+#ifdef __linux__
+	aio_ = new EPollAIO();
+#else
 	aio_ = new SelectAIO();
-	//aio_ = new EPollAIO();
+#endif
 
 	VERIFY(pthread_mutex_init(&m_, NULL) == 0);
 	VERIFY(pthread_cond_init(&changedone_c_, NULL) == 0);
@@ -50,8 +91,9 @@ PollMgr::add_callback(int fd, poll_flag flag, aio_callback *ch)
 	ScopedLock ml(&m_);
 	aio_->watch_fd(fd, flag);
 
-	VERIFY(!callbacks_[fd] || callbacks_[fd]==ch);
-	callbacks_[fd] = ch;
+	aio_callback *old = callbacks_[fd].load(std::memory_order_relaxed);
+	VERIFY(!old || old==ch);
+	callbacks_[fd].store(ch, std::memory_order_release);
 }
 
 //remove all callbacks related to fd
@@ -64,7 +106,7 @@ PollMgr::block_remove_fd(int fd)
 	aio_->unwatch_fd(fd, CB_RDWR);
 	pending_change_ = true;
 	VERIFY(pthread_cond_wait(&changedone_c_, &m_)==0);
-	callbacks_[fd] = NULL;
+	callbacks_[fd].store(NULL, std::memory_order_release);
 }
 
 void
@@ -72,7 +114,7 @@ PollMgr::del_callback(int fd, poll_flag flag)
 {
 	ScopedLock ml(&m_);
 	if (aio_->unwatch_fd(fd, flag)) {
-		callbacks_[fd] = NULL;
+		callbacks_[fd].store(NULL, std::memory_order_release);
 	}
 }
 
@@ -80,7 +122,7 @@ bool
 PollMgr::has_callback(int fd, poll_flag flag, aio_callback *c)
 {
 	ScopedLock ml(&m_);
-	if (!callbacks_[fd] || callbacks_[fd]!=c)
+	if (callbacks_[fd].load(std::memory_order_relaxed) != c)
 		return false;
 
 	return aio_->is_watched(fd, flag);
@@ -93,6 +135,7 @@ PollMgr::wait_loop()
 	std::vector<int> readable;
 	std::vector<int> writable;
 
+	reactor_thread = true;
 	while (1) {
 		{
 			ScopedLock ml(&m_);
@@ -113,14 +156,16 @@ PollMgr::wait_loop()
 		//modify callbacks_[fd] while the fd is not dead
 		for (unsigned int i = 0; i < readable.size(); i++) {
 			int fd = readable[i];
-			if (callbacks_[fd])
-				callbacks_[fd]->read_cb(fd);
+			aio_callback *cb = callbacks_[fd].load(std::memory_order_acquire);
+			if (cb)
+				cb->read_cb(fd);
 		}
 
 		for (unsigned int i = 0; i < writable.size(); i++) {
 			int fd = writable[i];
-			if (callbacks_[fd])
-				callbacks_[fd]->write_cb(fd);
+			aio_callback *cb = callbacks_[fd].load(std::memory_order_acquire);
+			if (cb)
+				cb->write_cb(fd);
 		}
 	}
 }
@@ -263,10 +308,22 @@ EPollAIO::EPollAIO()
 	pollfd_ = epoll_create(MAX_POLL_FDS);
 	VERIFY(pollfd_ >= 0);
 	bzero(fdstatus_, sizeof(int)*MAX_POLL_FDS);
+
+	VERIFY(pipe(pipefd_) == 0);
+	int flags = fcntl(pipefd_[0], F_GETFL, NULL);
+	flags |= O_NONBLOCK;
+	fcntl(pipefd_[0], F_SETFL, flags);
+
+	struct epoll_event ev;
+	ev.events = EPOLLIN;
+	ev.data.fd = pipefd_[0];
+	VERIFY(epoll_ctl(pollfd_, EPOLL_CTL_ADD, pipefd_[0], &ev) == 0);
 }
 
 EPollAIO::~EPollAIO()
 {
+	close(pipefd_[0]);
+	close(pipefd_[1]);
 	close(pollfd_);
 }
 
@@ -293,7 +350,8 @@ EPollAIO::watch_fd(int fd, poll_flag flag)
 	int op = fdstatus_[fd]? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
 	fdstatus_[fd] |= (int)flag;
 
-	ev.events = EPOLLET;
+	//level-triggered: read_cb consumes at most one PDU per call
+	ev.events = 0;
 	ev.data.fd = fd;
 
 	if (fdstatus_[fd] & CB_RDONLY) {
@@ -304,7 +362,7 @@ EPollAIO::watch_fd(int fd, poll_flag flag)
 	}
 
 	if (flag == CB_RDWR) {
-		VERIFY(ev.events == (uint32_t)(EPOLLET | EPOLLIN | EPOLLOUT));
+		VERIFY(ev.events == (uint32_t)(EPOLLIN | EPOLLOUT));
 	}
 
 	VERIFY(epoll_ctl(pollfd_, op, fd, &ev) == 0);
@@ -314,12 +372,13 @@ bool
 EPollAIO::unwatch_fd(int fd, poll_flag flag)
 {
 	VERIFY(fd < MAX_POLL_FDS);
+	bool registered = (fdstatus_[fd] != 0);
 	fdstatus_[fd] &= ~(int)flag;
 
 	struct epoll_event ev;
 	int op = fdstatus_[fd]? EPOLL_CTL_MOD : EPOLL_CTL_DEL;
 
-	ev.events = EPOLLET;
+	ev.events = 0;
 	ev.data.fd = fd;
 
 	if (fdstatus_[fd] & CB_RDONLY) {
@@ -332,7 +391,16 @@ EPollAIO::unwatch_fd(int fd, poll_flag flag)
 	if (flag == CB_RDWR) {
 		VERIFY(op == EPOLL_CTL_DEL);
 	}
-	VERIFY(epoll_ctl(pollfd_, op, fd, &ev) == 0);
+	//the fd may already have been removed, e.g. by a failed read_cb
+	//before closeconn() calls block_remove_fd()
+	if (registered) {
+		VERIFY(epoll_ctl(pollfd_, op, fd, &ev) == 0);
+	}
+	if (flag == CB_RDWR) {
+		//let block_remove_fd() know once wait_loop comes around
+		char tmp = 1;
+		VERIFY(write(pipefd_[1], &tmp, sizeof(tmp))==1);
+	}
 	return (op == EPOLL_CTL_DEL);
 }
 
@@ -340,15 +408,29 @@ bool
 EPollAIO::is_watched(int fd, poll_flag flag)
 {
 	VERIFY(fd < MAX_POLL_FDS);
-	return ((fdstatus_[fd] & CB_MASK) == flag);
+	return ((fdstatus_[fd] & flag) == flag);
 }
 
 void
 EPollAIO::wait_ready(std::vector<int> *readable, std::vector<int> *writable)
 {
 	int nfds = epoll_wait(pollfd_, ready_,	MAX_POLL_FDS, -1);
+	if (nfds < 0) {
+		if (errno == EINTR) {
+			return;
+		}
+		perror("epoll_wait:");
+		jsl_log(JSL_DBG_OFF, "PollMgr::epoll_loop failure errno %d\n",errno);
+		VERIFY(0);
+	}
 	for (int i = 0; i < nfds; i++) {
-		if (ready_[i].events & EPOLLIN) {
+		if (ready_[i].data.fd == pipefd_[0]) {
+			char tmp[64];
+			while (read(pipefd_[0], tmp, sizeof(tmp)) > 0)
+				;
+			continue;
+		}
+		if (ready_[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
 			readable->push_back(ready_[i].data.fd);
 		}
 		if (ready_[i].events & EPOLLOUT) {
@@ -2,6 +2,7 @@
 #define pollmgr_h 
 
 #include <sys/select.h>
+#include <atomic>
 #include <vector>
 
 #ifdef __linux__
@@ -9,6 +10,7 @@
 #endif
 
 #define MAX_POLL_FDS 2048
+#define MAX_REACTORS 16
 
 typedef enum {
 	CB_NONE = 0x0,
@@ -34,13 +36,24 @@ class aio_callback {
 		virtual ~aio_callback() {}
 };
 
+// One reactor: a thread waiting on its own set of fds and running their
+// callbacks. There is a reactor per core. An fd belongs to the reactor
+// it was last assigned to, so each connection's callbacks run on one
+// thread only.
 class PollMgr {
 	public:
 		PollMgr();
 		~PollMgr();
 
-		static PollMgr *Instance();
-		static PollMgr *CreateInst();
+		// the reactor that watches fd
+		static PollMgr *Instance(int fd);
+		// hand fd to reactor r % reactors(); a new fd must be assigned
+		// before it is watched
+		static void assign(int fd, int r);
+		static int reactors();
+		// whether the caller is a reactor thread, i.e. inside a
+		// callback; such a caller must never wait on a reactor
+		static bool in_reactor();
 
 		void add_callback(int fd, poll_flag flag, aio_callback *ch);
 		void del_callback(int fd, poll_flag flag);
@@ -49,16 +62,17 @@ class PollMgr {
 		void wait_loop();
 
 
-		static PollMgr *instance;
-		static int useful;
-		static int useless;
+		static PollMgr **instances;
+		static int ninstances;
+		static std::atomic<unsigned char> owners[MAX_POLL_FDS];
 
 	private:
-		pthread_mutex_t m_;
+		pthread_mutex_t m_; // serializes changes to the watched set
 		pthread_cond_t changedone_c_;
 		pthread_t th_;
 
-		aio_callback *callbacks_[MAX_POLL_FDS];
+		// read by wait_loop without m_
+		std::atomic<aio_callback *> callbacks_[MAX_POLL_FDS];
 		aio_mgr *aio_;
 		bool pending_change_;
 
@@ -97,6 +111,7 @@ class EPollAIO : public aio_mgr {
 
 	private:
 		int pollfd_;
+		int pipefd_[2]; // to wake up wait_ready
 		struct epoll_event ready_[MAX_POLL_FDS];
 		int fdstatus_[MAX_POLL_FDS];
 
@@ -11,21 +11,25 @@
 
  Both rpcc and rpcs use the connection class as an abstraction for the
  underlying communication channel.  To send an RPC request/reply, one calls
- connection::send() which blocks until data is sent or the connection has failed
- (thus the caller can free the buffer when send() returns).  When a
+ connection::send() which queues a reference to the (pooled, see pdu_pool.h)
+ buffer and returns, so the caller may drop its own reference when send()
+ returns; nothing is copied.  Queued PDUs are written
+ out in batches with writev, by whichever sender finds the socket idle or
+ else by PollMgr once the socket drains.  When a
  request/reply is received, connection makes a callback into the corresponding
  rpcc or rpcs (see rpcc::got_pdu() and rpcs::got_pdu()).
 
  Thread organization:
  rpcc uses application threads to send RPC requests and blocks to receive the
- reply or error. All connections use a single PollMgr object to perform async
- socket IO.  PollMgr creates a single thread to examine the readiness of socket
- file descriptors and informs the corresponding connection whenever a socket is
- ready to be read or written.  (We use asynchronous socket IO to reduce the
- number of threads needed to manage these connections; without async IO, at
- least one thread is needed per connection to read data without blocking other
- activities.)  Each rpcs object creates one thread for listening on the server
- port and a pool of threads for executing RPC requests.  The
+ reply or error. Connections use PollMgr objects to perform async socket IO.
+ There is one PollMgr (reactor) per core, each with its own thread and epoll
+ set; a connection's fd picks its reactor, which examines the readiness of the
+ fd and informs the connection whenever it is ready to be read or written.
+ (We use asynchronous socket IO to reduce the number of threads needed to
+ manage these connections; without async IO, at least one thread is needed per
+ connection to read data without blocking other activities.)  Each rpcs object
+ creates one listening socket and thread per reactor, all on the server port,
+ and a pool of threads for executing RPC requests.  The
  thread pool allows us to control the number of threads spawned at the server
  (spawning one thread per request will hurt when the server faces thousands of
  requests).
@@ -78,7 +82,8 @@ const rpcc::TO rpcc::to_max = { 10000 };
 const rpcc::TO rpcc::to_min = { 1000 };
 
 rpcc::caller::caller(unsigned int xxid, unmarshall *xun)
-: xid(xxid), un(xun), done(false)
+: xid(xxid), un(xun), done(false), req(NULL), req_sz(0), ch(NULL),
+  curr_to(0)
 {
 	VERIFY(pthread_mutex_init(&m,0) == 0);
 	VERIFY(pthread_cond_init(&c, 0) == 0);
@@ -88,6 +93,7 @@ rpcc::caller::~caller()
 {
 	VERIFY(pthread_mutex_destroy(&m) == 0);
 	VERIFY(pthread_cond_destroy(&c) == 0);
+	pdu_free(req);
 }
 
 inline
@@ -100,11 +106,13 @@ void set_rand_seed()
 
 rpcc::rpcc(sockaddr_in d, bool retrans) : 
 	_count(0), dst_(d), srv_nonce_(0), bind_done_(false), xid_(1), lossytest_(0), 
-	retrans_(retrans), reachable_(true), chan_(NULL), destroy_wait_ (false), xid_rep_done_(-1)
+	retrans_(retrans), reachable_(true), chan_(NULL), destroy_wait_ (false),
+	timer_started_(false), timer_stop_(false), xid_rep_done_(-1)
 {
 	VERIFY(pthread_mutex_init(&m_, 0) == 0);
 	VERIFY(pthread_mutex_init(&chan_m_, 0) == 0);
 	VERIFY(pthread_cond_init(&destroy_wait_c_, 0) == 0);
+	VERIFY(pthread_cond_init(&timer_c_, 0) == 0);
 
 	if(retrans){
 		set_rand_seed();
@@ -134,13 +142,24 @@ rpcc::~rpcc()
 {
 	jsl_log(JSL_DBG_2, "rpcc::~rpcc delete nonce %d channo=%d\n", 
 			clt_nonce_, chan_?chan_->channo():-1); 
+	fail_async_calls(rpc_const::cancel_failure);
+	{
+		ScopedLock ml(&m_);
+		timer_stop_ = true;
+		VERIFY(pthread_cond_signal(&timer_c_) == 0);
+	}
+	if(timer_started_){
+		VERIFY(pthread_join(timer_th_, NULL) == 0);
+	}
 	if(chan_){
 		chan_->closeconn();
 		chan_->decref();
 	}
 	VERIFY(calls_.size() == 0);
+	pdu_free(dup_req_.buf);
 	VERIFY(pthread_mutex_destroy(&m_) == 0);
 	VERIFY(pthread_mutex_destroy(&chan_m_) == 0);
+	VERIFY(pthread_cond_destroy(&timer_c_) == 0);
 }
 
 int
@@ -163,6 +182,7 @@ rpcc::bind(TO to)
 void
 rpcc::cancel(void)
 {
+  fail_async_calls(rpc_const::cancel_failure);
   ScopedLock ml(&m_);
   jsl_log(JSL_DBG_2, "rpcc::cancel: force callers to fail\n");
   std::map<int,caller*>::iterator it;
@@ -238,8 +258,10 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
                                                         dup_req_.clear();
                                                 }
                                         }
-                                        if (forgot.isvalid()) 
-                                                ch->send((char *)forgot.buf.c_str(), forgot.buf.size());
+                                        if (forgot.isvalid()) {
+                                                ch->send(forgot.buf, forgot.sz);
+                                                pdu_free(forgot.buf);
+                                        }
                                         ch->send(req.cstr(), req.size());
                                 }
 				else jsl_log(JSL_DBG_1, "not reachable\n");
@@ -302,7 +324,9 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
         {
                 ScopedLock ml(&m_);
                 if (!dup_req_.isvalid()) {
-                        dup_req_.buf.assign(req.cstr(), req.size());
+                        pdu_ref(req.cstr());
+                        dup_req_.buf = req.cstr();
+                        dup_req_.sz = req.size();
                         dup_req_.xid = ca.xid;
                 }
                 if (xid_rep > xid_rep_done_)
@@ -326,6 +350,215 @@ rpcc::call1(unsigned int proc, marshall &req, unmarshall &rep,
 	return (ca.done? ca.intret : rpc_const::timeout_failure);
 }
 
+void
+rpcc::async_call1(unsigned int proc, marshall &req, done_cb cb, TO to)
+{
+	unmarshall none;
+	if (!reachable_) {
+		cb(rpc_const::unreachable_failure, none);
+		return;
+	}
+
+	caller *ca = new caller(0, NULL);
+	ca->un = &ca->rep;
+	ca->cb = cb;
+	unsigned int xid = 0;
+	{
+		ScopedLock ml(&m_);
+
+		if((proc != rpc_const::bind && !bind_done_) ||
+				(proc == rpc_const::bind && bind_done_)){
+			jsl_log(JSL_DBG_1, "rpcc::async_call1 rpcc has not been bound to dst or binding twice\n");
+			ca->intret = rpc_const::bind_failure;
+		}else if(destroy_wait_){
+			ca->intret = rpc_const::cancel_failure;
+		}else{
+			ca->xid = xid = xid_++;
+			calls_[ca->xid] = ca;
+
+			req_header h(ca->xid, proc, clt_nonce_, srv_nonce_,
+					xid_rep_window_.front());
+			req.pack_req_header(h);
+			pdu_ref(req.cstr());
+			ca->req = req.cstr();
+			ca->req_sz = req.size();
+
+			struct timespec now;
+			clock_gettime(CLOCK_REALTIME, &now);
+			add_timespec(now, to.to, &ca->final);
+			ca->curr_to = to_min.to;
+			add_timespec(now, ca->curr_to, &ca->next);
+
+			if(!timer_started_){
+				VERIFY((timer_th_ = method_thread(this, false, &rpcc::timer_loop)) != 0);
+				timer_started_ = true;
+			}
+			VERIFY(pthread_cond_signal(&timer_c_) == 0);
+		}
+	}
+
+	if(xid == 0){
+		complete(ca);
+		return;
+	}
+	// ca may already be complete and gone
+	transmit(xid, req.cstr(), req.size());
+}
+
+// send an async call's request, unless it has completed meanwhile.
+void
+rpcc::transmit(unsigned int xid, char *req, int req_sz)
+{
+	connection *ch = NULL;
+	get_refconn(&ch);
+	if(ch){
+		if(reachable_){
+			ch->send(req, req_sz);
+		}else{
+			jsl_log(JSL_DBG_1, "not reachable\n");
+		}
+	}
+
+	ScopedLock ml(&m_);
+	std::map<int, caller *>::iterator it = calls_.find(xid);
+	if(it == calls_.end()){
+		if(ch)
+			ch->decref();
+		return;
+	}
+	caller *ca = it->second;
+	if(ca->ch)
+		ca->ch->decref();
+	ca->ch = ch;
+}
+
+// hand a finished async call to its callback. ca must no longer be in
+// calls_, and no lock may be held.
+void
+rpcc::complete(caller *ca)
+{
+	if(ca->intret < 0){
+		jsl_log(JSL_DBG_2, "rpcc::complete: RPC error for xid %d intret %d\n",
+				ca->xid, ca->intret);
+	}
+	ca->cb(ca->intret, ca->rep);
+	if(ca->ch)
+		ca->ch->decref();
+	delete ca;
+}
+
+void
+rpcc::fail_async_calls(int ret)
+{
+	std::vector<caller *> failed;
+	{
+		ScopedLock ml(&m_);
+		std::map<int, caller *>::iterator it;
+		for(it = calls_.begin(); it != calls_.end();){
+			if(it->second->cb){
+				it->second->intret = ret;
+				failed.push_back(it->second);
+				calls_.erase(it++);
+			}else{
+				it++;
+			}
+		}
+	}
+	for(unsigned i = 0; i < failed.size(); i++){
+		complete(failed[i]);
+	}
+}
+
+// times out async calls, and like call1 retransmits those whose
+// connection died. the wait between checks doubles from to_min, and
+// starts over from to_min on the new connection after a retransmit.
+void
+rpcc::timer_loop()
+{
+	struct due {
+		unsigned int xid;
+		char *req;
+		int req_sz;
+		connection *ch;
+	};
+
+	ScopedLock ml(&m_);
+	while(!timer_stop_){
+		struct timespec now, wake;
+		clock_gettime(CLOCK_REALTIME, &now);
+		add_timespec(now, to_max.to, &wake);
+
+		std::vector<caller *> expired;
+		std::vector<due> resend;
+		std::map<int, caller *>::iterator it;
+		for(it = calls_.begin(); it != calls_.end();){
+			caller *ca = it->second;
+			if(!ca->cb){
+				it++;
+				continue;
+			}
+			if(cmp_timespec(now, ca->final) >= 0){
+				ca->intret = rpc_const::timeout_failure;
+				expired.push_back(ca);
+				update_xid_rep(ca->xid);
+				calls_.erase(it++);
+				continue;
+			}
+			if(cmp_timespec(now, ca->next) >= 0){
+				if(retrans_){
+					due d = { ca->xid, ca->req, ca->req_sz, ca->ch };
+					pdu_ref(d.req);
+					if(d.ch)
+						d.ch->incref();
+					resend.push_back(d);
+				}
+				ca->curr_to <<= 1;
+				add_timespec(now, ca->curr_to, &ca->next);
+			}
+			if(cmp_timespec(ca->next, wake) < 0)
+				wake = ca->next;
+			if(cmp_timespec(ca->final, wake) < 0)
+				wake = ca->final;
+			it++;
+		}
+		if(destroy_wait_ && expired.size()){
+			VERIFY(pthread_cond_signal(&destroy_wait_c_) == 0);
+		}
+
+		if(expired.size() || resend.size()){
+			// isdead() takes the connection's lock, which is held
+			// around got_pdu; don't call it with m_ held
+			VERIFY(pthread_mutex_unlock(&m_) == 0);
+			for(unsigned i = 0; i < expired.size(); i++){
+				complete(expired[i]);
+			}
+			std::vector<unsigned int> resent;
+			for(unsigned i = 0; i < resend.size(); i++){
+				if(!resend[i].ch || resend[i].ch->isdead()){
+					transmit(resend[i].xid, resend[i].req,
+							resend[i].req_sz);
+					resent.push_back(resend[i].xid);
+				}
+				pdu_free(resend[i].req);
+				if(resend[i].ch)
+					resend[i].ch->decref();
+			}
+			VERIFY(pthread_mutex_lock(&m_) == 0);
+
+			clock_gettime(CLOCK_REALTIME, &now);
+			for(unsigned i = 0; i < resent.size(); i++){
+				if(calls_.count(resent[i])){
+					caller *ca = calls_[resent[i]];
+					ca->curr_to = to_min.to;
+					add_timespec(now, ca->curr_to, &ca->next);
+				}
+			}
+			continue;
+		}
+		pthread_cond_timedwait(&timer_c_, &m_, &wake);
+	}
+}
+
 void
 rpcc::get_refconn(connection **ch)
 {
@@ -344,7 +577,7 @@ rpcc::get_refconn(connection **ch)
 	}
 }
 
-// PollMgr's thread is being used to 
+// the connection's PollMgr thread is being used to 
 // make this upcall from connection object to rpcc. 
 // this funtion must not block.
 //
@@ -361,27 +594,43 @@ rpcc::got_pdu(connection *c, char *b, int sz)
 		return true;
 	}
 
-	ScopedLock ml(&m_);
+	caller *ca;
+	{
+		ScopedLock ml(&m_);
 
-	update_xid_rep(h.xid);
+		update_xid_rep(h.xid);
 
-	if(calls_.find(h.xid) == calls_.end()){
-		jsl_log(JSL_DBG_2, "rpcc::got_pdu xid %d no pending request\n", h.xid);
-		return true;
-	}
-	caller *ca = calls_[h.xid];
-
-	ScopedLock cl(&ca->m);
-	if(!ca->done){
-		ca->un->take_in(rep);
-		ca->intret = h.ret;
-		if(ca->intret < 0){
-			jsl_log(JSL_DBG_2, "rpcc::got_pdu: RPC reply error for xid %d intret %d\n",
-					h.xid, ca->intret);
+		if(calls_.find(h.xid) == calls_.end()){
+			jsl_log(JSL_DBG_2, "rpcc::got_pdu xid %d no pending request\n", h.xid);
+			return true;
+		}
+		ca = calls_[h.xid];
+
+		if(!ca->cb){
+			// a thread is blocked in call1 for it
+			ScopedLock cl(&ca->m);
+			if(!ca->done){
+				ca->un->take_in(rep);
+				ca->intret = h.ret;
+				if(ca->intret < 0){
+					jsl_log(JSL_DBG_2, "rpcc::got_pdu: RPC reply error for xid %d intret %d\n",
+							h.xid, ca->intret);
+				}
+				ca->done = 1;
+			}
+			VERIFY(pthread_cond_broadcast(&ca->c) == 0);
+			return true;
+		}
+
+		calls_.erase(h.xid);
+		if(destroy_wait_){
+			VERIFY(pthread_cond_signal(&destroy_wait_c_) == 0);
 		}
-		ca->done = 1;
 	}
-	VERIFY(pthread_cond_broadcast(&ca->c) == 0);
+
+	ca->rep.take_in(rep);
+	ca->intret = h.ret;
+	complete(ca);
 	return true;
 }
 
@@ -417,7 +666,8 @@ rpcs::rpcs(unsigned int p1, int count)
 {
 	VERIFY(pthread_mutex_init(&procs_m_, 0) == 0);
 	VERIFY(pthread_mutex_init(&count_m_, 0) == 0);
-	VERIFY(pthread_mutex_init(&reply_window_m_, 0) == 0);
+	for (int i = 0; i < reply_shards; i++)
+		VERIFY(pthread_mutex_init(&reply_shards_[i].m, 0) == 0);
 	VERIFY(pthread_mutex_init(&conss_m_, 0) == 0);
 
 	set_rand_seed();
@@ -497,17 +747,23 @@ rpcs::updatestat(unsigned int proc)
 		}
 		printf("\n");
 
-		ScopedLock rwl(&reply_window_m_);
-		std::map<unsigned int,std::list<reply_t> >::iterator clt;
-
-		unsigned int totalrep = 0, maxrep = 0;
-		for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++){
-			totalrep += clt->second.size();
-			if(clt->second.size() > maxrep)
-				maxrep = clt->second.size();
+		std::map<unsigned int,reply_window_t *>::iterator clt;
+
+		int nclients = 0, totalrep = 0, maxrep = 0;
+		for (int i = 0; i < reply_shards; i++) {
+			ScopedLock sl(&reply_shards_[i].m);
+			std::map<unsigned int,reply_window_t *> &clients =
+				reply_shards_[i].clients;
+			nclients += clients.size();
+			for (clt = clients.begin(); clt != clients.end(); clt++){
+				ScopedLock wl(&clt->second->m);
+				totalrep += clt->second->count;
+				if(clt->second->count > maxrep)
+					maxrep = clt->second->count;
+			}
 		}
 		jsl_log(JSL_DBG_1, "REPLY WINDOW: clients %d total reply %d max per client %d\n", 
-                        (int) reply_window_.size(), totalrep, maxrep);
+                        nclients, totalrep, maxrep);
 		curr_counts_ = counting_;
 	}
 }
@@ -593,18 +849,6 @@ rpcs::dispatch(djob_t *j)
 	int sz1;
 
 	if(h.clt_nonce){
-		// have i seen this client before?
-		{
-			ScopedLock rwl(&reply_window_m_);
-			// if we don't know about this clt_nonce, create a cleanup object
-			if(reply_window_.find(h.clt_nonce) == reply_window_.end()){
-				VERIFY (reply_window_[h.clt_nonce].size() == 0); // create
-				jsl_log(JSL_DBG_2,
-						"rpcs::dispatch: new client %u xid %d chan %d, total clients %d\n", 
-						h.clt_nonce, h.xid, c->channo(), (int)reply_window_.size());
-			}
-		}
-
 		// save the latest good connection to the client
 		{
 			ScopedLock rwl(&conss_m_);
@@ -664,15 +908,14 @@ rpcs::dispatch(djob_t *j)
 			}
 
 			c->send(b1, sz1);
-			if(h.clt_nonce == 0){
-				// reply is not added to at-most-once window, free it
-				free(b1);
-			}
+			// the at-most-once window holds its own reference
+			pdu_free(b1);
 			break;
 		case INPROGRESS: // server is working on this request
 			break;
 		case DONE: // duplicate and we still have the response
 			c->send(b1, sz1);
+			pdu_free(b1);
 			break;
 		case FORGOTTEN: // very old request and we don't have the response anymore
 			jsl_log(JSL_DBG_2, "rpcs::dispatch: very old request %u from %u\n", 
@@ -685,117 +928,158 @@ rpcs::dispatch(djob_t *j)
 	c->decref();
 }
 
+// find clt_nonce's reply window, creating it the first time
+// we hear from that client. windows live until the rpcs does.
+rpcs::reply_window_t *
+rpcs::get_reply_window(unsigned int clt_nonce)
+{
+	reply_shard_t *s = &reply_shards_[clt_nonce % reply_shards];
+	ScopedLock sl(&s->m);
+	std::map<unsigned int,reply_window_t *>::iterator i =
+		s->clients.find(clt_nonce);
+	if (i != s->clients.end())
+		return i->second;
+
+	reply_window_t *w = new reply_window_t();
+	VERIFY(pthread_mutex_init(&w->m, 0) == 0);
+	s->clients[clt_nonce] = w;
+	jsl_log(JSL_DBG_2, "rpcs::get_reply_window: new client %u\n", clt_nonce);
+	return w;
+}
+
+// forget the replies for xids below base, moving the window up.
+// each xid is passed over once, so this is constant amortized time.
+// caller holds w->m.
+void
+rpcs::forget_replies(reply_window_t *w, unsigned int base)
+{
+	unsigned int size = w->slots.size();
+	if (base - w->base >= size) {
+		for (unsigned int i = 0; i < size; i++) {
+			pdu_free(w->slots[i].buf);
+			w->slots[i] = reply_t(0);
+		}
+		w->count = 0;
+	} else {
+		for (unsigned int x = w->base; x != base; x++) {
+			reply_t &r = w->slots[x & (size - 1)];
+			if (r.xid == x) {
+				pdu_free(r.buf);
+				r = reply_t(0);
+				w->count--;
+			}
+		}
+	}
+	w->base = base;
+}
+
+// make room in the ring for xid, doubling it up to
+// reply_window_max slots; past that, forget the oldest replies.
+// caller holds w->m.
+void
+rpcs::grow_reply_window(reply_window_t *w, unsigned int xid)
+{
+	unsigned int size = w->slots.size();
+	while (xid - w->base >= size && size < reply_window_max)
+		size *= 2;
+
+	if (size != w->slots.size()) {
+		std::vector<reply_t> slots(size, reply_t(0));
+		for (unsigned int i = 0; i < w->slots.size(); i++) {
+			if (w->slots[i].xid != 0)
+				slots[w->slots[i].xid & (size - 1)] = w->slots[i];
+		}
+		w->slots.swap(slots);
+	}
+	if (xid - w->base >= size)
+		forget_replies(w, xid - size + 1);
+}
+
 // rpcs::dispatch calls this when an RPC request arrives.
 //
 // checks to see if an RPC with xid from clt_nonce has already been received.
-// if not, remembers the request in reply_window_.
+// if not, remembers the request in the client's reply window.
 //
-// deletes remembered requests with XIDs <= xid_rep; the client
+// deletes remembered requests with XIDs < xid_rep; the client
 // says it has received a reply for every RPC up through xid_rep.
 // frees the reply_t::buf of each such request.
 //
 // returns one of:
 //   NEW: never seen this xid before.
 //   INPROGRESS: seen this xid, and still processing it.
-//   DONE: seen this xid, previous reply returned in *b and *sz.
+//   DONE: seen this xid, previous reply returned in *b and *sz; the
+//         caller holds a reference to it and pdu_free()s it.
 //   FORGOTTEN: might have seen this xid, but deleted previous reply.
 rpcs::rpcstate_t 
 rpcs::checkduplicate_and_update(unsigned int clt_nonce, unsigned int xid,
                                 unsigned int xid_rep, char **b, int *sz)
 {
-	
-    ScopedLock rwl(&reply_window_m_);
-    // Your lab7 code goes here
-    bool flag = true;
-    std::list<reply_t>::iterator it = reply_window_[clt_nonce].begin();
-	for (it = reply_window_[clt_nonce].begin(); it != reply_window_[clt_nonce].end(); it++) 
-	{
-		reply_t reply = *it;
-		if (reply.xid == xid)
-		{
-			if (reply.cb_present)
-			{
-				*b = reply.buf;
-				*sz = reply.sz;
-				return DONE;
-			}
-			return INPROGRESS;
-		}
-	}
+	reply_window_t *w = get_reply_window(clt_nonce);
+	ScopedLock wl(&w->m);
 
-	if (reply_window_[clt_nonce].size() > 0 && reply_window_[clt_nonce].front().xid > xid)
+	if (xid_rep > w->base)
+		forget_replies(w, xid_rep);
+	if (xid < w->base)
 		return FORGOTTEN;
+	if (xid - w->base >= w->slots.size())
+		grow_reply_window(w, xid);
 
-	reply_t reply(xid);
-    reply.cb_present = false;
-
-    for (it = reply_window_[clt_nonce].begin(); it != reply_window_[clt_nonce].end(); it++) 
-    {
-        if ((*it).xid > xid) 
-        {
-            reply_window_[clt_nonce].insert(it, reply);
-            break;
-        }
-    }
-
-    if (it == reply_window_[clt_nonce].end())
-        reply_window_[clt_nonce].push_back(reply);
-
-    for (it = reply_window_[clt_nonce].begin(); it != reply_window_[clt_nonce].end(); it++) 
-    {
-        if ((*it).xid >= xid_rep)
-        {
-        	flag = false;
-        	reply_window_[clt_nonce].erase(reply_window_[clt_nonce].begin(), it);
-        	break;
-        }
-    }
+	reply_t &r = w->slots[xid & (w->slots.size() - 1)];
+	if (r.xid == xid) {
+		if (!r.cb_present)
+			return INPROGRESS;
+		pdu_ref(r.buf);
+		*b = r.buf;
+		*sz = r.sz;
+		return DONE;
+	}
 
-    if (flag == true)
-    {
-    	reply_window_[clt_nonce].erase(reply_window_[clt_nonce].begin(), it);
-    }
-    return NEW;
+	VERIFY(r.xid == 0);
+	r = reply_t(xid);
+	w->count++;
+	return NEW;
 }
 
 // rpcs::dispatch calls add_reply when it is sending a reply to an RPC,
 // and passes the return value in b and sz.
-// add_reply() should remember b and sz.
-// free_reply_window() and checkduplicate_and_update is responsible for 
-// calling free(b).
+// add_reply() remembers b and sz, taking a reference to b that
+// free_reply_window() and checkduplicate_and_update drop with
+// pdu_free(b).
 void
 rpcs::add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz)
 {
-    ScopedLock rwl(&reply_window_m_);
+	reply_window_t *w = get_reply_window(clt_nonce);
+	ScopedLock wl(&w->m);
 
-    // Your lab7 code goes here
-	for(std::list<reply_t>::iterator it = reply_window_[clt_nonce].begin(); it != reply_window_[clt_nonce].end(); it++)
-	{
-		reply_t reply = *it;
-		if(reply.xid == xid)
-		{
-			it->buf = b;
-			it->sz = sz;
-			it->cb_present = true;
-			break;
-		}
-	}
+	if (xid < w->base || xid - w->base >= w->slots.size())
+		return;
+	reply_t &r = w->slots[xid & (w->slots.size() - 1)];
+	if (r.xid != xid)
+		return;
+	pdu_ref(b);
+	r.buf = b;
+	r.sz = sz;
+	r.cb_present = true;
 }
 
 void
 rpcs::free_reply_window(void)
 {
-	std::map<unsigned int,std::list<reply_t> >::iterator clt;
-	std::list<reply_t>::iterator it;
-
-	ScopedLock rwl(&reply_window_m_);
-	for (clt = reply_window_.begin(); clt != reply_window_.end(); clt++){
-		for (it = clt->second.begin(); it != clt->second.end(); it++){
-			free((*it).buf);
+	std::map<unsigned int,reply_window_t *>::iterator clt;
+
+	for (int i = 0; i < reply_shards; i++) {
+		ScopedLock sl(&reply_shards_[i].m);
+		std::map<unsigned int,reply_window_t *> &clients =
+			reply_shards_[i].clients;
+		for (clt = clients.begin(); clt != clients.end(); clt++){
+			reply_window_t *w = clt->second;
+			for (unsigned int j = 0; j < w->slots.size(); j++)
+				pdu_free(w->slots[j].buf);
+			VERIFY(pthread_mutex_destroy(&w->m) == 0);
+			delete w;
 		}
-		clt->second.clear();
+		clients.clear();
 	}
-	reply_window_.clear();
 }
 
 // rpc handler
@@ -811,10 +1095,9 @@ void
 marshall::rawbyte(unsigned char x)
 {
 	if(_ind >= _capa){
-		_capa *= 2;
 		VERIFY (_buf != NULL);
-		_buf = (char *)realloc(_buf, _capa);
-		VERIFY(_buf);
+		_buf = pdu_grow(_buf, _ind, _capa * 2);
+		_capa = pdu_capacity(_buf);
 	}
 	_buf[_ind++] = x;
 }
@@ -823,10 +1106,9 @@ void
 marshall::rawbytes(const char *p, int n)
 {
 	if((_ind+n) > _capa){
-		_capa = _capa > n? 2*_capa:(_capa+n);
 		VERIFY (_buf != NULL);
-		_buf = (char *)realloc(_buf, _capa);
-		VERIFY(_buf);
+		_buf = pdu_grow(_buf, _ind, _capa > n? 2*_capa:(_capa+n));
+		_capa = pdu_capacity(_buf);
 	}
 	memcpy(_buf+_ind, p, n);
 	_ind += n;
@@ -926,8 +1208,7 @@ unmarshall::unpack(int *x)
 void
 unmarshall::take_in(unmarshall &another)
 {
-	if(_buf)
-		free(_buf);
+	pdu_free(_buf);
 	another.take_buf(&_buf, &_sz);
 	_ind = RPC_HEADER_SZ;
 	_ok = _sz >= RPC_HEADER_SZ?true:false;
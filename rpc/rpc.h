@@ -8,6 +8,9 @@
 #include <stdio.h>
 #include <unistd.h>
 #include <atomic>
+#include <functional>
+#include <string>
+#include <vector>
 
 #include "thr_pool.h"
 #include "marshall.h"
@@ -35,6 +38,11 @@ class rpc_const {
 // threaded: multiple threads can be sending RPCs,
 class rpcc : public chanmgr {
 
+	public:
+		// completion of an async call: the RPC's return value, negative
+		// on failure, and the reply to unmarshall the result from.
+		typedef std::function<void(int, unmarshall &)> done_cb;
+
 	private:
 
 		//manages per rpc info
@@ -48,11 +56,27 @@ class rpcc : public chanmgr {
 			bool done;
 			pthread_mutex_t m;
 			pthread_cond_t c;
+
+			// only for async calls, whose caller lives on the heap
+			// until it completes. the timer thread retransmits and
+			// times them out instead of a blocked thread.
+			done_cb cb;
+			unmarshall rep;
+			char *req; // a reference to the request's pdu
+			int req_sz;
+			connection *ch; // where req was last sent
+			int curr_to;
+			struct timespec next, final;
 		};
 
 		void get_refconn(connection **ch);
 		void update_xid_rep(unsigned int xid);
 
+		void transmit(unsigned int xid, char *req, int req_sz);
+		void complete(caller *ca);
+		void fail_async_calls(int ret);
+		void timer_loop();
+
 		std::atomic_int _count;
 		sockaddr_in dst_;
 		unsigned int clt_nonce_;
@@ -71,14 +95,21 @@ class rpcc : public chanmgr {
 		bool destroy_wait_;
 		pthread_cond_t destroy_wait_c_;
 
+		pthread_t timer_th_; // started by the first async call
+		bool timer_started_;
+		bool timer_stop_;
+		pthread_cond_t timer_c_; // an async call was added
+
 		std::map<int, caller *> calls_;
 		std::list<unsigned int> xid_rep_window_;
                 
+                // holds a reference to the request's pdu while valid
                 struct request {
                     request() { clear(); }
-                    void clear() { buf.clear(); xid = -1; }
+                    void clear() { buf = NULL; sz = 0; xid = -1; }
                     bool isvalid() { return xid != -1; }
-                    std::string buf;
+                    char *buf;
+                    int sz;
                     int xid;
                 };
                 struct request dup_req_;
@@ -111,12 +142,30 @@ class rpcc : public chanmgr {
 		int call1(unsigned int proc, 
 				marshall &req, unmarshall &rep, TO to);
 
+		// like call1, but returns at once. cb runs exactly once: on
+		// PollMgr's thread when the reply arrives, or on the timer
+		// thread if the call times out, or right here if it can't be
+		// sent at all. cb must not block; in particular it must not
+		// make a blocking call().
+		void async_call1(unsigned int proc, marshall &req, done_cb cb,
+				TO to = to_max);
+
 		bool got_pdu(connection *c, char *b, int sz);
 
 
 		template<class R>
 			int call_m(unsigned int proc, marshall &req, R & r, TO to);
 
+		// e.g. c->async_call<int>(proc, [](int ret, int &r) {...}, a1, a2)
+		// lets one thread keep many RPCs in flight. r is only valid if
+		// ret >= 0.
+		template<class R, class... Args>
+			void async_call(unsigned int proc,
+					std::function<void(int, R &)> cb, const Args &... args);
+		template<class R, class... Args>
+			void async_call_to(unsigned int proc, TO to,
+					std::function<void(int, R &)> cb, const Args &... args);
+
 		template<class R>
 			int call(unsigned int proc, R & r, TO to = to_max); 
 		template<class R, class A1>
@@ -164,6 +213,35 @@ rpcc::call_m(unsigned int proc, marshall &req, R & r, TO to)
 	return intret;
 }
 
+template<class R, class... Args> void
+rpcc::async_call(unsigned int proc, std::function<void(int, R &)> cb,
+		const Args &... args)
+{
+	async_call_to<R>(proc, to_max, std::move(cb), args...);
+}
+
+template<class R, class... Args> void
+rpcc::async_call_to(unsigned int proc, TO to,
+		std::function<void(int, R &)> cb, const Args &... args)
+{
+	marshall m;
+	(m << ... << args);
+	_count.fetch_add(1);
+	async_call1(proc, m, [proc, cb](int intret, unmarshall &u) {
+		R r;
+		if (intret >= 0) {
+			u >> r;
+			if (u.okdone() != true) {
+				fprintf(stderr, "rpcc::async_call: failed to unmarshall "
+						"the reply. You are probably calling RPC 0x%x "
+						"with wrong return type.\n", proc);
+				VERIFY(0);
+			}
+		}
+		cb(intret, r);
+	}, to);
+}
+
 template<class R> int
 rpcc::call(unsigned int proc, R & r, TO to) 
 {
@@ -283,7 +361,7 @@ class rpcs : public chanmgr {
 
         // state about an in-progress or completed RPC, for at-most-once.
         // if cb_present is true, then the RPC is complete and a reply
-        // has been sent; in that case buf points to a copy of the reply,
+        // has been sent; in that case buf holds a reference to the reply,
         // and sz holds the size of the reply.
 	struct reply_t {
 		reply_t (unsigned int _xid) {
@@ -298,14 +376,42 @@ class rpcs : public chanmgr {
 		int sz;         // the size of reply buffer
 	};
 
+	// the replies one client hasn't acknowledged receiving yet, in a
+	// ring indexed by xid: xid lives in slots[xid & (slots.size()-1)],
+	// and that slot holds it iff its xid matches (clients number their
+	// calls from 1, so empty slots have xid 0).  the ring covers xids
+	// [base, base + slots.size()) and doubles when a client has more
+	// calls outstanding than that.
+	struct reply_window_t {
+		reply_window_t() : base(0), count(0),
+			slots(reply_window_min, reply_t(0)) {}
+		pthread_mutex_t m; // protects the rest
+		unsigned int base; // xids below base are forgotten
+		int count; // occupied slots
+		std::vector<reply_t> slots;
+	};
+
+	static const unsigned int reply_window_min = 64;
+	static const unsigned int reply_window_max = 1 << 16;
+	static const int reply_shards = 16;
+
+	// the reply window of each client, spread over shards by nonce
+	// so that clients don't contend on one lock to find theirs.
+	struct reply_shard_t {
+		pthread_mutex_t m; // protects clients
+		std::map<unsigned int, reply_window_t *> clients;
+	};
+
 	int port_;
 	unsigned int nonce_;
 
 	// provide at most once semantics by maintaining a window of replies
 	// per client that that client hasn't acknowledged receiving yet.
-        // indexed by client nonce.
-	std::map<unsigned int, std::list<reply_t> > reply_window_;
+	reply_shard_t reply_shards_[reply_shards];
 
+	reply_window_t *get_reply_window(unsigned int clt_nonce);
+	static void forget_replies(reply_window_t *w, unsigned int base);
+	static void grow_reply_window(reply_window_t *w, unsigned int xid);
 	void free_reply_window(void);
 	void add_reply(unsigned int clt_nonce, unsigned int xid, char *b, int sz);
 
@@ -332,7 +438,6 @@ class rpcs : public chanmgr {
 
 	pthread_mutex_t procs_m_; // protect insert/delete to procs[]
 	pthread_mutex_t count_m_;  //protect modification of counts
-	pthread_mutex_t reply_window_m_; // protect reply window et al
 	pthread_mutex_t conss_m_; // protect conns_
 
 
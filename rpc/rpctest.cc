@@ -281,6 +281,89 @@ concurrent_test(int nt)
 	printf(" OK\n");
 }
 
+// completions of async_test's calls
+pthread_mutex_t async_m = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t async_c = PTHREAD_COND_INITIALIZER;
+int async_done;
+
+void
+async_finished()
+{
+	ScopedLock ml(&async_m);
+	async_done++;
+	VERIFY(pthread_cond_broadcast(&async_c) == 0);
+}
+
+void
+async_wait(int n)
+{
+	ScopedLock ml(&async_m);
+	while (async_done < n) {
+		VERIFY(pthread_cond_wait(&async_c, &async_m) == 0);
+	}
+}
+
+// chains calls: each reply issues the next call from the callback
+void
+async_chain(rpcc *c, int arg, int left)
+{
+	c->async_call<int>(23, [c, arg, left](int ret, int &r) {
+		VERIFY(ret == 0 && r == arg + 1);
+		if (left > 1) {
+			async_chain(c, r, left - 1);
+		} else {
+			async_finished();
+		}
+	}, arg);
+}
+
+void
+async_test(rpcc *c)
+{
+	printf("start async_test ...\n");
+
+	// one thread, many calls in flight; replies come back in any order
+	async_done = 0;
+	int n = 200;
+	for (int i = 0; i < n; i++) {
+		c->async_call<int>(24, [i](int ret, int &r) {
+			VERIFY(ret == 0 && r == i + 2);
+			async_finished();
+		}, i);
+	}
+	async_wait(n);
+	printf("   -- %d concurrent calls from one thread .. ok\n", n);
+
+	async_done = 0;
+	async_chain(c, 0, 50);
+	async_wait(1);
+	printf("   -- calls made from completions .. ok\n");
+
+	// the server never answers an unknown proc
+	async_done = 0;
+	time_t t0 = time(0);
+	c->async_call_to<int>(0x7777, rpcc::to(1500), [](int ret, int &) {
+		VERIFY(ret == rpc_const::timeout_failure);
+		async_finished();
+	}, 0);
+	async_wait(1);
+	VERIFY(time(0) - t0 <= 3);
+	printf("   -- async call timeout .. ok\n");
+
+	// a completion's send may fail and must not hang the reactor
+	// it runs on
+	VERIFY(setenv("RPC_LOSSY", "20", 1) == 0);
+	rpcc *lc = new rpcc(dst);
+	VERIFY(setenv("RPC_LOSSY", "0", 1) == 0);
+	VERIFY(lc->bind() == 0);
+	async_done = 0;
+	async_chain(lc, 0, 100);
+	async_wait(1);
+	delete lc;
+	printf("   -- lossy calls made from completions .. ok\n");
+	printf("async_test OK\n");
+}
+
 void 
 lossy_test()
 {
@@ -463,6 +546,7 @@ main(int argc, char *argv[])
 
 		simple_tests(clients[0]);
 		concurrent_test(10);
+		async_test(clients[1]);
 		lossy_test();
 		if (isserver) {
 			failure_test();
@@ -74,9 +74,11 @@ int test_persist_chfs() {
     chfs_c->unlink(1, filenames[0].c_str());
 
     printf("--- begin crash ---\n");
-    for (int i = 0; i < 3; i++) {
-        es_rg->raft_group->disable_node(i);
-        es_rg->raft_group->restart(i);
+    for (chfs_raft_group *group : es_rg->raft_groups) {
+        for (int i = 0; i < 3; i++) {
+            group->disable_node(i);
+            group->restart(i);
+        }
     }
 
     mssleep(2000); // wait for election
@@ -119,6 +121,14 @@ int main(int argc, char *argv[]) {
     server.reg(extent_protocol::put, es_rg, &extent_server_dist::put);
     server.reg(extent_protocol::remove, es_rg, &extent_server_dist::remove);
     server.reg(extent_protocol::create, es_rg, &extent_server_dist::create);
+    server.reg(extent_protocol::read_range, es_rg, &extent_server_dist::read_range);
+    server.reg(extent_protocol::write_range, es_rg, &extent_server_dist::write_range);
+    server.reg(extent_protocol::dir_lookup, es_rg, &extent_server_dist::dir_lookup);
+    server.reg(extent_protocol::dir_insert, es_rg, &extent_server_dist::dir_insert);
+    server.reg(extent_protocol::dir_remove, es_rg, &extent_server_dist::dir_remove);
+    server.reg(extent_protocol::readdir, es_rg, &extent_server_dist::readdir);
+    server.reg(extent_protocol::create_in_dir, es_rg, &extent_server_dist::create_in_dir);
+    server.reg(extent_protocol::unlink_from_dir, es_rg, &extent_server_dist::unlink_from_dir);
 
     chfs_c = new chfs_client(extent_port);
 